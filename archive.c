@@ -0,0 +1,503 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "patchtools.h"
+#include "patchfile.h"
+
+/** Number of members that can be waiting to be decrypted */
+#define ARCHIVE_QUEUE_SIZE  (64)
+
+#define ARCHIVE_BUF_SIZE    (65536)
+#define ARCHIVE_NAME_SIZE   (4096)
+
+#define TAR_BLOCK_SIZE      (512)
+#define CPIO_HDR_SIZE       (110)
+#define CPIO_MODE_TYPE      (0170000)
+#define CPIO_MODE_REG       (0100000)
+
+/** A patch read from the archive */
+typedef struct {
+	char          name[ ARCHIVE_NAME_SIZE ];
+	epatch_file_t patch;
+} archive_member_t;
+
+typedef struct {
+	int               fd;
+	uint8_t           buf[ ARCHIVE_BUF_SIZE ];
+	size_t            pos;
+	size_t            len;
+} archive_in_t;
+
+typedef struct {
+	archive_in_t      in;
+	pack_t           *pack;
+	pthread_mutex_t   lock;
+	pthread_cond_t    not_empty;
+	pthread_cond_t    not_full;
+	archive_member_t *queue[ ARCHIVE_QUEUE_SIZE ];
+	int               head;
+	int               count;
+	int               done;
+	int               extracted;
+	int               failed;
+	int               skipped;
+	char            **names;
+	int               name_count;
+	int               name_cap;
+} archive_t;
+
+/**
+ * Reads from the archive stream.
+ * @param dst      The buffer to read into, or NULL to skip the data
+ * @return         The number of bytes read, less than size at end of stream
+ */
+static size_t archive_in_read( archive_in_t *in, void *dst, size_t size ) {
+	size_t done, n;
+	ssize_t nr;
+
+	for ( done = 0; done < size; done += n ) {
+		if ( in->pos == in->len ) {
+			nr = read( in->fd, in->buf, sizeof in->buf );
+			if ( nr < 0 && errno == EINTR )
+				nr = 0;
+			else if ( nr < 0 ) {
+				perror( "Could not read archive" );
+				exit( EXIT_FAILURE );
+			} else if ( nr == 0 )
+				break;
+			in->pos = 0;
+			in->len = nr;
+		}
+		n = in->len - in->pos;
+		if ( n > size - done )
+			n = size - done;
+		if ( dst )
+			memcpy( (uint8_t *) dst + done, in->buf + in->pos, n );
+		in->pos += n;
+	}
+
+	return done;
+}
+
+/**
+ * Reads the first bytes of the stream without consuming them.
+ */
+static size_t archive_in_peek( archive_in_t *in, size_t size ) {
+	ssize_t nr;
+
+	while ( in->len < size ) {
+		nr = read( in->fd, in->buf + in->len, size - in->len );
+		if ( nr < 0 && errno == EINTR )
+			continue;
+		if ( nr < 0 ) {
+			perror( "Could not read archive" );
+			exit( EXIT_FAILURE );
+		}
+		if ( nr == 0 )
+			break;
+		in->len += nr;
+	}
+
+	return in->len;
+}
+
+static void archive_truncated( void ) {
+	fprintf( stderr, "Archive is truncated\n" );
+	exit( EXIT_FAILURE );
+}
+
+/**
+ * Queues a member for decryption, waiting while the queue is full.
+ */
+static void archive_push( archive_t *ar, archive_member_t *m ) {
+	pthread_mutex_lock( &ar->lock );
+	while ( ar->count == ARCHIVE_QUEUE_SIZE )
+		pthread_cond_wait( &ar->not_full, &ar->lock );
+	ar->queue[ ( ar->head + ar->count++ ) % ARCHIVE_QUEUE_SIZE ] = m;
+	pthread_cond_signal( &ar->not_empty );
+	pthread_mutex_unlock( &ar->lock );
+}
+
+/**
+ * Takes a member from the queue, waiting while it is empty.
+ * @return         The member, or NULL when the archive has been read entirely
+ */
+static archive_member_t *archive_pop( archive_t *ar ) {
+	archive_member_t *m = NULL;
+
+	pthread_mutex_lock( &ar->lock );
+	while ( ar->count == 0 && !ar->done )
+		pthread_cond_wait( &ar->not_empty, &ar->lock );
+	if ( ar->count ) {
+		m = ar->queue[ ar->head ];
+		ar->head = ( ar->head + 1 ) % ARCHIVE_QUEUE_SIZE;
+		ar->count--;
+		pthread_cond_signal( &ar->not_full );
+	}
+	pthread_mutex_unlock( &ar->lock );
+
+	return m;
+}
+
+/**
+ * Reads the data of a member. Members large enough to hold a patch are
+ * queued, anything else is skipped.
+ */
+static void archive_member( archive_t *ar, const char *name, uint64_t size ) {
+	archive_member_t *m;
+
+	if ( size < sizeof(epatch_file_t) ) {
+		if ( archive_in_read( &ar->in, NULL, size ) != size )
+			archive_truncated();
+		ar->skipped++;
+		return;
+	}
+
+	m = malloc( sizeof(archive_member_t) );
+	if ( !m ) {
+		perror( "Could not allocate archive member" );
+		exit( EXIT_FAILURE );
+	}
+	snprintf( m->name, sizeof m->name, "%s", name );
+
+	if ( archive_in_read( &ar->in, &m->patch, sizeof m->patch ) !=
+	     sizeof m->patch ||
+	     archive_in_read( &ar->in, NULL, size - sizeof m->patch ) !=
+	     size - sizeof m->patch )
+		archive_truncated();
+
+	archive_push( ar, m );
+}
+
+static uint64_t tar_number( const char *field, int size ) {
+	uint64_t v = 0;
+	int i;
+
+	/* GNU tar stores large values in base 256 */
+	if ( (uint8_t) field[0] & 0x80 ) {
+		v = (uint8_t) field[0] & 0x7F;
+		for ( i = 1; i < size; i++ )
+			v = ( v << 8 ) | (uint8_t) field[i];
+		return v;
+	}
+
+	for ( i = 0; i < size && field[i] == ' '; i++ );
+	for ( ; i < size && field[i] >= '0' && field[i] <= '7'; i++ )
+		v = v * 8 + field[i] - '0';
+	return v;
+}
+
+/**
+ * Reads the members of a ustar or GNU tar archive.
+ */
+static void archive_read_tar( archive_t *ar ) {
+	char hdr[ TAR_BLOCK_SIZE ], zero[ TAR_BLOCK_SIZE ];
+	char name[ ARCHIVE_NAME_SIZE ], long_name[ ARCHIVE_NAME_SIZE ];
+	uint64_t size, padded;
+	int has_long_name = 0;
+
+	memset( zero, 0, sizeof zero );
+
+	for ( ;; ) {
+		if ( archive_in_read( &ar->in, hdr, sizeof hdr ) != sizeof hdr )
+			archive_truncated();
+
+		/* The archive ends with zero blocks */
+		if ( memcmp( hdr, zero, sizeof hdr ) == 0 )
+			break;
+
+		size   = tar_number( hdr + 124, 12 );
+		padded = ( size + TAR_BLOCK_SIZE - 1 ) & ~(uint64_t)
+		         ( TAR_BLOCK_SIZE - 1 );
+
+		if ( hdr[156] == 'L' ) {
+			/* GNU long name for the next member */
+			if ( size >= sizeof long_name )
+				archive_truncated();
+			if ( archive_in_read( &ar->in, long_name, padded ) != padded )
+				archive_truncated();
+			long_name[ size ] = 0;
+			has_long_name = 1;
+			continue;
+		}
+
+		if ( has_long_name )
+			snprintf( name, sizeof name, "%s", long_name );
+		else if ( hdr[345] && memcmp( hdr + 257, "ustar", 5 ) == 0 )
+			snprintf( name, sizeof name, "%.155s/%.100s",
+			          hdr + 345, hdr );
+		else
+			snprintf( name, sizeof name, "%.100s", hdr );
+		has_long_name = 0;
+
+		/* Only regular files hold patches */
+		if ( hdr[156] != '0' && hdr[156] != 0 ) {
+			if ( archive_in_read( &ar->in, NULL, padded ) != padded )
+				archive_truncated();
+			continue;
+		}
+
+		archive_member( ar, name, size );
+		if ( archive_in_read( &ar->in, NULL, padded - size ) !=
+		     padded - size )
+			archive_truncated();
+	}
+}
+
+static uint32_t cpio_number( const char *field ) {
+	char buf[9];
+
+	memcpy( buf, field, 8 );
+	buf[8] = 0;
+	return strtoul( buf, NULL, 16 );
+}
+
+/**
+ * Reads the members of a cpio archive in the "newc" format.
+ */
+static void archive_read_cpio( archive_t *ar ) {
+	char hdr[ CPIO_HDR_SIZE ], name[ ARCHIVE_NAME_SIZE ];
+	uint32_t mode, size, name_size, pad;
+
+	for ( ;; ) {
+		if ( archive_in_read( &ar->in, hdr, sizeof hdr ) != sizeof hdr )
+			archive_truncated();
+		if ( memcmp( hdr, "07070", 5 ) ) {
+			fprintf( stderr, "Invalid cpio header\n" );
+			exit( EXIT_FAILURE );
+		}
+
+		mode      = cpio_number( hdr + 14 );
+		size      = cpio_number( hdr + 54 );
+		name_size = cpio_number( hdr + 94 );
+		if ( name_size == 0 || name_size > sizeof name )
+			archive_truncated();
+
+		/* The name is padded so that the data is 4 byte aligned */
+		pad = ( 4 - ( CPIO_HDR_SIZE + name_size ) % 4 ) % 4;
+		if ( archive_in_read( &ar->in, name, name_size ) != name_size ||
+		     archive_in_read( &ar->in, NULL, pad ) != pad )
+			archive_truncated();
+		name[ name_size - 1 ] = 0;
+
+		if ( strcmp( name, "TRAILER!!!" ) == 0 )
+			break;
+
+		if ( ( mode & CPIO_MODE_TYPE ) == CPIO_MODE_REG )
+			archive_member( ar, name, size );
+		else if ( archive_in_read( &ar->in, NULL, size ) != size )
+			archive_truncated();
+
+		pad = ( 4 - size % 4 ) % 4;
+		if ( archive_in_read( &ar->in, NULL, pad ) != pad )
+			archive_truncated();
+	}
+}
+
+/**
+ * Reader thread, parses the archive and feeds the queue.
+ */
+static void *archive_reader( void *_ar ) {
+	archive_t *ar = _ar;
+
+	if ( archive_in_peek( &ar->in, TAR_BLOCK_SIZE ) >= 6 &&
+	     memcmp( ar->in.buf, "07070", 5 ) == 0 ) {
+		archive_read_cpio( ar );
+	} else if ( ar->in.len == TAR_BLOCK_SIZE &&
+	            memcmp( ar->in.buf + 257, "ustar", 5 ) == 0 ) {
+		archive_read_tar( ar );
+	} else {
+		fprintf( stderr, "Unknown archive format\n" );
+		exit( EXIT_FAILURE );
+	}
+
+	pthread_mutex_lock( &ar->lock );
+	ar->done = 1;
+	pthread_cond_broadcast( &ar->not_empty );
+	pthread_mutex_unlock( &ar->lock );
+
+	return NULL;
+}
+
+/**
+ * Names the outputs of a member after its path in the archive without the
+ * suffix, with the directories joined by '_' so that members in different
+ * directories do not overwrite each other.
+ */
+static void archive_output_name( char *name, size_t size, const char *path ) {
+	char *p, *slash;
+
+	while ( path[0] == '/' || strncmp( path, "./", 2 ) == 0 )
+		path += path[0] == '/' ? 1 : 2;
+
+	snprintf( name, size, "%s", path );
+
+	slash = strrchr( name, '/' );
+	p = strrchr( slash ? slash : name, '.' );
+	if ( p && p != name && p != slash + 1 )
+		*p = 0;
+
+	for ( p = name; *p; p++ )
+		if ( *p == '/' )
+			*p = '_';
+}
+
+/**
+ * Records the output name of a member, must be called with the lock held.
+ * @return         Zero if an earlier member already used the name
+ */
+static int archive_claim_name( archive_t *ar, const char *name ) {
+	int i;
+
+	for ( i = 0; i < ar->name_count; i++ )
+		if ( strcmp( ar->names[i], name ) == 0 )
+			return 0;
+
+	if ( ar->name_count == ar->name_cap ) {
+		ar->name_cap = ar->name_cap ? ar->name_cap * 2 : 64;
+		ar->names = realloc( ar->names, ar->name_cap * sizeof(char *) );
+		if ( !ar->names ) {
+			perror( "Could not allocate archive member names" );
+			exit( EXIT_FAILURE );
+		}
+	}
+
+	ar->names[ ar->name_count ] = strdup( name );
+	if ( !ar->names[ ar->name_count ] ) {
+		perror( "Could not allocate archive member names" );
+		exit( EXIT_FAILURE );
+	}
+	ar->name_count++;
+
+	return 1;
+}
+
+/**
+ * Decrypts and extracts a single member.
+ */
+static void archive_extract( archive_t *ar, archive_member_t *m ) {
+	pack_entry_t entry;
+	char name[ ARCHIVE_NAME_SIZE ], cfg[ ARCHIVE_NAME_SIZE + 8 ];
+	char msram[ ARCHIVE_NAME_SIZE + 8 ];
+	int status, unique;
+
+	memset( &entry, 0, sizeof entry );
+	status = decrypt_patch_checked( &entry.body, &m->patch.body,
+	                                m->patch.header.proc_sig );
+	if ( status & ( DECRYPT_BAD_ICV | DECRYPT_UNKNOWN_KEY ) ) {
+		fprintf( stderr, "Could not decrypt archive member %s\n",
+		         m->name );
+		__atomic_add_fetch( &ar->failed, 1, __ATOMIC_RELAXED );
+		return;
+	}
+
+	archive_output_name( name, sizeof name, m->name );
+
+	if ( ar->pack && strlen( name ) >= PACK_NAME_SIZE ) {
+		fprintf( stderr, "Archive member name %s is too long for a "
+		         "pack entry\n", m->name );
+		__atomic_add_fetch( &ar->failed, 1, __ATOMIC_RELAXED );
+		return;
+	}
+
+	pthread_mutex_lock( &ar->lock );
+	unique = archive_claim_name( ar, name );
+	if ( unique && ar->pack ) {
+		memcpy( &entry.header, &m->patch.header, sizeof(patch_hdr_t) );
+		entry.key_seed = m->patch.body.key_seed;
+		pack_add( ar->pack, name, &entry );
+	}
+	pthread_mutex_unlock( &ar->lock );
+
+	if ( !unique ) {
+		fprintf( stderr, "Archive member %s would overwrite the output "
+		         "%s of another member\n", m->name, name );
+		__atomic_add_fetch( &ar->failed, 1, __ATOMIC_RELAXED );
+		return;
+	}
+
+	if ( !ar->pack ) {
+		snprintf( cfg,   sizeof cfg,   "%s.txt", name );
+		snprintf( msram, sizeof msram, "%s.hex", name );
+		write_patch_config( &m->patch.header, &entry.body, cfg, msram,
+		                    m->patch.body.key_seed );
+		write_msram_file( &entry.body, msram );
+	}
+
+	__atomic_add_fetch( &ar->extracted, 1, __ATOMIC_RELAXED );
+}
+
+static void archive_worker( void *_ar, int idx __attribute__(( unused )) ) {
+	archive_t *ar = _ar;
+	archive_member_t *m;
+
+	while ( ( m = archive_pop( ar ) ) ) {
+		archive_extract( ar, m );
+		free( m );
+	}
+}
+
+/**
+ * Extracts all patches in a tar or cpio archive. The archive is read by one
+ * thread while the patches are decrypted and written by the worker pool,
+ * connected by a bounded queue.
+ * @param path      The archive file, or "-" to read it from stdin
+ * @param pack_path A pack to store the patches in, or NULL to extract them
+ *                  to config and MSRAM files
+ */
+void extract_archive( const char *path, const char *pack_path ) {
+	archive_t *ar;
+	pthread_t reader;
+
+	ar = calloc( 1, sizeof(archive_t) );
+	if ( !ar ) {
+		perror( "Could not allocate archive reader" );
+		exit( EXIT_FAILURE );
+	}
+
+	if ( strcmp( path, "-" ) == 0 ) {
+		ar->in.fd = STDIN_FILENO;
+	} else {
+		ar->in.fd = open( path, O_RDONLY );
+		if ( ar->in.fd < 0 ) {
+			perror( "Could not open archive" );
+			exit( EXIT_FAILURE );
+		}
+	}
+
+	if ( pack_path )
+		ar->pack = pack_open_write( pack_path );
+
+	pthread_mutex_init( &ar->lock, NULL );
+	pthread_cond_init( &ar->not_empty, NULL );
+	pthread_cond_init( &ar->not_full, NULL );
+
+	if ( pthread_create( &reader, NULL, archive_reader, ar ) ) {
+		fprintf( stderr, "Could not start archive reader\n" );
+		exit( EXIT_FAILURE );
+	}
+
+	workpool_run( archive_worker, ar, workpool_size() );
+	pthread_join( reader, NULL );
+
+	if ( ar->pack )
+		pack_close( ar->pack );
+	if ( ar->in.fd != STDIN_FILENO )
+		close( ar->in.fd );
+
+	printf( "Extracted %d patches, %d failed, %d other members skipped\n",
+	        ar->extracted, ar->failed, ar->skipped );
+
+	while ( ar->name_count )
+		free( ar->names[ --ar->name_count ] );
+	free( ar->names );
+	pthread_cond_destroy( &ar->not_full );
+	pthread_cond_destroy( &ar->not_empty );
+	pthread_mutex_destroy( &ar->lock );
+	free( ar );
+}
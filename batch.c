@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include "crypto.h"
+#include "patchtools.h"
+#include "patchfile.h"
+#include "stats.h"
+#include "trace.h"
+
+#define BODY_WORDS   ( sizeof(epatch_body_t) / sizeof(uint32_t) )
+#define MSRAM_WORD   ( offsetof( epatch_body_t, msram ) / sizeof(uint32_t) )
+#define MSRAM_ICV    \
+	( offsetof( epatch_body_t, msram_integrity ) / sizeof(uint32_t) )
+#define CR_OP_WORD   ( offsetof( epatch_body_t, cr_ops ) / sizeof(uint32_t) )
+
+/**
+ * A group of patches decrypted together, stored as a struct of arrays: word
+ * i of every lane is contiguous.
+ */
+typedef struct {
+	crypto_lanes_t      words[ BODY_WORDS ];
+	crypto_lanes_ctx_t  ctx;
+	uint32_t            iv[ CRYPTO_LANES ];
+	uint32_t            key[ CRYPTO_LANES ];
+	int                 patch[ CRYPTO_LANES ];
+	int                 count;
+} batch_t;
+
+/**
+ * Decrypts the ICV of every lane and checks it against the FPROM entry
+ * selected by the cipher state of that lane.
+ */
+static void batch_verify_integrity(
+	batch_t *b,
+	crypto_lanes_t *ct,
+	int *status ) {
+	crypto_lanes_t idx;
+	int l;
+
+	idx = b->ctx.state & INTEGRITY_INDEX_MASK;
+
+	crypto_lanes_decrypt( &b->ctx, ct );
+
+	for ( l = 0; l < b->count; l++ ) {
+		if ( !fprom_exists( idx[l] ) ) {
+			status[ b->patch[l] ] |= DECRYPT_MISSING_FPROM;
+		} else if ( (*ct)[l] != fprom_get( idx[l] ) ) {
+			STAT_INC( icv_fail );
+			status[ b->patch[l] ] |= DECRYPT_BAD_ICV;
+		} else {
+			STAT_INC( icv_pass );
+		}
+	}
+}
+
+/**
+ * Decrypts all lanes of a batch and transposes the result back into
+ * per-patch bodies.
+ */
+static void batch_run( batch_t *b, const epatch_file_t *in,
+                       patch_body_t *out, int *status ) {
+	const uint8_t *body;
+	uint32_t word;
+	int i, l, w;
+
+	/* Transpose into word-major order, idle lanes decrypt zeroes */
+	memset( b->words, 0, sizeof b->words );
+	for ( l = 0; l < b->count; l++ ) {
+		body = (const uint8_t *) &in[ b->patch[l] ].body;
+		for ( w = 0; w < BODY_WORDS; w++ ) {
+			memcpy( &word, body + w * sizeof(uint32_t), sizeof word );
+			b->words[w][l] = word;
+		}
+	}
+
+	crypto_lanes_init( &b->ctx, b->key, b->iv );
+
+	for ( i = 0; i < MSRAM_DWORD_COUNT; i++ )
+		crypto_lanes_decrypt( &b->ctx, b->words + MSRAM_WORD + i );
+
+	batch_verify_integrity( b, b->words + MSRAM_ICV, status );
+
+	for ( i = 0; i < PATCH_CR_OP_COUNT; i++ ) {
+		w = CR_OP_WORD + i * 4;
+		crypto_lanes_decrypt( &b->ctx, b->words + w );
+		crypto_lanes_decrypt( &b->ctx, b->words + w + 1 );
+		crypto_lanes_decrypt( &b->ctx, b->words + w + 2 );
+		batch_verify_integrity( b, b->words + w + 3, status );
+	}
+
+	/* Transpose back */
+	for ( l = 0; l < b->count; l++ ) {
+		patch_body_t *o = out + b->patch[l];
+
+		for ( i = 0; i < MSRAM_DWORD_COUNT; i++ )
+			o->msram[i] = b->words[ MSRAM_WORD + i ][l];
+
+		for ( i = 0; i < PATCH_CR_OP_COUNT; i++ ) {
+			w = CR_OP_WORD + i * 4;
+			o->cr_ops[i].address = b->words[ w ][l];
+			o->cr_ops[i].mask    = b->words[ w + 1 ][l];
+			o->cr_ops[i].value   = b->words[ w + 2 ][l];
+		}
+	}
+}
+
+/**
+ * Decrypts a number of patches, CRYPTO_LANES at a time. The patches are
+ * transposed into a struct of arrays and all of their cipher chains are
+ * advanced together, each with its own key and IV, which gives the same
+ * result as decrypt_patch_checked on every patch.
+ * @param out      The decrypted patch bodies
+ * @param in       The encrypted patch files
+ * @param status   The DECRYPT_ flags of every patch
+ * @param count    The number of patches
+ */
+void decrypt_patch_batch(
+	patch_body_t *out,
+	const epatch_file_t *in,
+	int *status,
+	int count ) {
+	batch_t *b;
+	uint32_t base, proc_sig, seed;
+	int i;
+
+	/* Traces follow the scalar cipher, one chain at a time */
+	if ( TRACE_ACTIVE() ) {
+		for ( i = 0; i < count; i++ ) {
+			memcpy( &proc_sig, &in[i].header.proc_sig, sizeof proc_sig );
+			status[i] = decrypt_patch_checked( out + i, &in[i].body,
+			                                   proc_sig );
+		}
+		return;
+	}
+
+	if ( posix_memalign( (void **) &b, sizeof(crypto_lanes_t),
+	                     sizeof(batch_t) ) ) {
+		perror( "Could not allocate decryption batch" );
+		exit( EXIT_FAILURE );
+	}
+
+	b->count = 0;
+	for ( i = 0; i < count; i++ ) {
+		memset( out + i, 0, sizeof(patch_body_t) );
+		status[i] = DECRYPT_OK;
+
+		memcpy( &proc_sig, &in[i].header.proc_sig, sizeof proc_sig );
+		memcpy( &seed, &in[i].body.key_seed, sizeof seed );
+
+		/* Patches without a usable key never enter a lane */
+		if ( !cpukeys_lookup( proc_sig, &base ) ) {
+			status[i] = DECRYPT_UNKNOWN_KEY;
+			continue;
+		}
+		if ( derive_key( b->iv + b->count, b->key + b->count,
+		                 proc_sig, seed ) != ENCRYPT_OK ) {
+			status[i] = DECRYPT_MISSING_FPROM;
+			continue;
+		}
+
+		b->patch[ b->count++ ] = i;
+		if ( b->count == CRYPTO_LANES ) {
+			batch_run( b, in, out, status );
+			b->count = 0;
+		}
+	}
+
+	if ( b->count ) {
+		/* Idle lanes run on a zero key and IV */
+		for ( i = b->count; i < CRYPTO_LANES; i++ ) {
+			b->iv[i]  = 0;
+			b->key[i] = 0;
+		}
+		batch_run( b, in, out, status );
+	}
+
+	free( b );
+}
@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "crypto.h"
+#include "patchtools.h"
+#include "patchfile.h"
+
+/**
+ * Bitsliced implementation of the cipher, used to evaluate many key search
+ * candidates at once. Bit j of the state of every candidate is kept in plane
+ * j, one candidate per bit of the plane. All candidates in a batch share the
+ * key, so the conditional XOR of the LFSR becomes an unconditional XOR of the
+ * top plane into the planes of the set key bits, and the rotate is only a
+ * renaming of the planes.
+ */
+
+static const slice_t slice_ones = {
+	~0ull, ~0ull, ~0ull, ~0ull
+};
+
+/**
+ * Transposes SLICE_LANES words into bit planes.
+ */
+void bitslice_load( slice_t *planes, const uint32_t *words ) {
+	uint64_t p;
+	int j, w, l;
+
+	for ( j = 0; j < 32; j++ ) {
+		for ( w = 0; w < SLICE_LANES / 64; w++ ) {
+			p = 0;
+			for ( l = 0; l < 64; l++ )
+				p |= (uint64_t) ( ( words[ w * 64 + l ] >> j ) & 1 ) << l;
+			planes[j][w] = p;
+		}
+	}
+}
+
+/**
+ * Transposes bit planes back into SLICE_LANES words.
+ * @param count    The number of low planes to extract, the other bits of
+ *                 the words are zero.
+ */
+void bitslice_store( uint32_t *words, const slice_t *planes, int count ) {
+	int j, l;
+
+	memset( words, 0, SLICE_LANES * sizeof(uint32_t) );
+	for ( j = 0; j < count; j++ )
+		for ( l = 0; l < SLICE_LANES; l++ )
+			words[l] |= (uint32_t)
+				( ( planes[j][ l / 64 ] >> ( l % 64 ) ) & 1 ) << j;
+}
+
+/**
+ * The blockfunc on SLICE_LANES states at once, in place.
+ * @param s        The bit planes of the states
+ * @param key      The key shared by all lanes
+ */
+void bitslice_blockfunc( slice_t *s, uint32_t key ) {
+	slice_t lfsr[32];
+	uint32_t k;
+	int iter, r, j;
+
+	memcpy( lfsr, s, sizeof lfsr );
+
+	/* Logical plane j lives in lfsr[ ( j + r ) % 32 ] */
+	for ( r = 0, iter = 0; iter < 37; iter++ ) {
+		/* Rotate right, the old bit 0 becomes the top bit */
+		r = ( r + 1 ) & 31;
+		for ( k = key; k; k &= k - 1 ) {
+			j = __builtin_ctz( k );
+			if ( j != 31 )
+				lfsr[ ( j + r ) & 31 ] ^= lfsr[ ( 31 + r ) & 31 ];
+		}
+		/* Bit 31 of the key clears or keeps the top bit itself */
+		if ( key & 0x80000000 )
+			lfsr[ ( 31 + r ) & 31 ] ^= lfsr[ ( 31 + r ) & 31 ];
+	}
+
+	for ( j = 0; j < 32; j++ )
+		s[j] ^= lfsr[ ( j + r ) & 31 ];
+}
+
+/**
+ * XORs the same word into every lane.
+ */
+static void bitslice_xor_word( slice_t *s, uint32_t word ) {
+	int j;
+
+	for ( j = 0; j < 32; j++ )
+		if ( ( word >> j ) & 1 )
+			s[j] ^= slice_ones;
+}
+
+/**
+ * Decrypts the MSRAM contents of a patch for SLICE_LANES IVs that share a key
+ * and checks the MSRAM ICV of every lane.
+ * @param stream   The encrypted words in cipher order, starting at the MSRAM
+ * @param key      The key of all lanes
+ * @param iv       The IV of every lane
+ * @param pass     Set to non-zero for the lanes whose ICV matches or uses an
+ *                 unknown FPROM entry
+ * @return         The number of lanes that passed
+ */
+int bitslice_msram_icv(
+	const uint32_t *stream,
+	uint32_t key,
+	const uint32_t *iv,
+	uint8_t *pass ) {
+	slice_t s[32];
+	uint32_t idx[ SLICE_LANES ], pt[ SLICE_LANES ];
+	int i, l, count;
+
+	bitslice_load( s, iv );
+
+	/* Only the state chain matters up to the ICV, which only depends on
+	 * the ciphertext */
+	for ( i = 0; i < MSRAM_DWORD_COUNT; i++ ) {
+		bitslice_blockfunc( s, key );
+		bitslice_xor_word( s, stream[i] );
+	}
+
+	bitslice_store( idx, s, 8 );
+
+	bitslice_blockfunc( s, key );
+	bitslice_xor_word( s, stream[ MSRAM_DWORD_COUNT ] );
+	bitslice_xor_word( s, stream[ MSRAM_DWORD_COUNT - 1 ] );
+	bitslice_store( pt, s, 32 );
+
+	for ( count = 0, l = 0; l < SLICE_LANES; l++ ) {
+		idx[l] &= INTEGRITY_INDEX_MASK;
+		pass[l] = !fprom_exists( idx[l] ) || pt[l] == fprom_get( idx[l] );
+		count += pass[l];
+	}
+
+	return count;
+}
+
+/**
+ * Checks the bitsliced blockfunc against the C reference blockfunc, and the
+ * one in use, on pseudo random states and keys.
+ * @return         Non-zero if all agree
+ */
+int bitslice_selftest( void ) {
+	slice_t s[32];
+	uint32_t in[ SLICE_LANES ], out[ SLICE_LANES ], key, x;
+	int t, l;
+
+	x = 0x12345678;
+	for ( t = 0; t < 8; t++ ) {
+		for ( l = 0; l < SLICE_LANES; l++ ) {
+			/* xorshift32 */
+			x ^= x << 13;
+			x ^= x >> 17;
+			x ^= x << 5;
+			in[l] = x;
+		}
+		key = t == 0 ? 0x80000000 : t == 1 ? 0xFFFFFFFF : in[ t ];
+
+		bitslice_load( s, in );
+		bitslice_blockfunc( s, key );
+		bitslice_store( out, s, 32 );
+
+		for ( l = 0; l < SLICE_LANES; l++ ) {
+			if ( out[l] != crypto_c_blockfunc( in[l], key ) )
+				return 0;
+#ifndef USE_C_BLOCKFUNC
+			if ( out[l] != crypto_blockfunc( in[l], key ) )
+				return 0;
+#endif
+		}
+	}
+
+	return 1;
+}
@@ -0,0 +1,360 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "crypto.h"
+#include "patchtools.h"
+#include "patchfile.h"
+#include "stats.h"
+
+/** Number of patches loaded and decrypted together */
+#define CORPUS_CHUNK (4 * CRYPTO_LANES)
+
+/** One MSRAM group, processed as a single vector */
+typedef uint32_t group_vec_t
+	__attribute__(( vector_size( MSRAM_GROUP_SIZE * sizeof(uint32_t) ) ));
+
+/**
+ * Bit statistics of a set of patches. word_bits holds, for every bit of
+ * every MSRAM word, the number of patches that have it set.
+ */
+typedef struct {
+	group_vec_t   word_bits[ MSRAM_GROUP_COUNT ][ 32 ];
+	group_vec_t   word_and[ MSRAM_GROUP_COUNT ];
+	group_vec_t   word_or[ MSRAM_GROUP_COUNT ];
+	group_vec_t   word_xor[ MSRAM_GROUP_COUNT ];
+	uint32_t      popcount[ MSRAM_GROUP_SIZE ][ 33 ];
+	int           patches;
+} bitstats_t;
+
+typedef struct {
+	char *const         *paths;
+	const patch_body_t **bodies;
+	patch_body_t        *storage;
+	int                  count;
+	bitstats_t          *parts;
+	int                  part_count;
+} corpus_t;
+
+/**
+ * Loads and decrypts a chunk of the corpus. The chunk is decrypted as one
+ * batch so that the cipher chains of its patches are advanced together.
+ */
+static void corpus_load( void *_corpus, int idx ) {
+	corpus_t *corpus = _corpus;
+	epatch_file_t patch[ CORPUS_CHUNK ];
+	int status[ CORPUS_CHUNK ];
+	int i, first, count;
+
+	first = idx * CORPUS_CHUNK;
+	count = corpus->count - first;
+	if ( count > CORPUS_CHUNK )
+		count = CORPUS_CHUNK;
+
+	memset( patch, 0, sizeof patch );
+	for ( i = 0; i < count; i++ ) {
+		if ( try_read_file( corpus->paths[ first + i ], patch + i,
+		                    sizeof(epatch_file_t) ) !=
+		     sizeof(epatch_file_t) ) {
+			fprintf( stderr, "Could not read patch %s\n",
+			         corpus->paths[ first + i ] );
+			/* Zeroed, so it fails with an unknown key below */
+			memset( patch + i, 0, sizeof(epatch_file_t) );
+		}
+	}
+
+	decrypt_patch_batch( corpus->storage + first, patch, status, count );
+
+	for ( i = 0; i < count; i++ ) {
+		if ( status[i] & ( DECRYPT_BAD_ICV | DECRYPT_UNKNOWN_KEY ) ) {
+			fprintf( stderr, "Could not decrypt patch %s\n",
+			         corpus->paths[ first + i ] );
+			continue;
+		}
+		corpus->bodies[ first + i ] = corpus->storage + first + i;
+	}
+}
+
+/**
+ * Counts the set bits in every lane of a vector, in place.
+ */
+static inline void group_popcount( group_vec_t *v ) {
+	*v = *v - ( ( *v >> 1 ) & 0x55555555 );
+	*v = ( *v & 0x33333333 ) + ( ( *v >> 2 ) & 0x33333333 );
+	*v = ( *v + ( *v >> 4 ) ) & 0x0F0F0F0F;
+	*v = ( *v * 0x01010101 ) >> 24;
+}
+
+static void bitstats_init( bitstats_t *s ) {
+	int i;
+
+	memset( s, 0, sizeof(bitstats_t) );
+	for ( i = 0; i < MSRAM_GROUP_COUNT; i++ )
+		s->word_and[i] = ~s->word_and[i];
+}
+
+/**
+ * Accumulates the statistics of a slice of the corpus.
+ */
+static void corpus_bitstats_worker( void *_corpus, int idx ) {
+	corpus_t *corpus = _corpus;
+	bitstats_t *s = corpus->parts + idx;
+	group_vec_t v, pc;
+	int i, g, b, j, first, last;
+
+	bitstats_init( s );
+
+	first = (int64_t) corpus->count * idx / corpus->part_count;
+	last  = (int64_t) corpus->count * ( idx + 1 ) / corpus->part_count;
+
+	for ( i = first; i < last; i++ ) {
+		if ( !corpus->bodies[i] )
+			continue;
+		s->patches++;
+
+		for ( g = 0; g < MSRAM_GROUP_COUNT; g++ ) {
+			memcpy( &v, corpus->bodies[i]->msram + g * MSRAM_GROUP_SIZE,
+			        sizeof v );
+
+			s->word_and[g] &= v;
+			s->word_or[g]  |= v;
+			s->word_xor[g] ^= v;
+
+			/* Vertical counters, one per bit of every word */
+			for ( b = 0; b < 32; b++ )
+				s->word_bits[g][b] += ( v >> b ) & 1;
+
+			pc = v;
+			group_popcount( &pc );
+			for ( j = 0; j < MSRAM_GROUP_SIZE; j++ )
+				s->popcount[j][ pc[j] ]++;
+		}
+	}
+}
+
+/**
+ * Merges the statistics of one slice into another.
+ */
+static void bitstats_merge( bitstats_t *dst, const bitstats_t *src ) {
+	int g, b, j;
+
+	for ( g = 0; g < MSRAM_GROUP_COUNT; g++ ) {
+		dst->word_and[g] &= src->word_and[g];
+		dst->word_or[g]  |= src->word_or[g];
+		dst->word_xor[g] ^= src->word_xor[g];
+		for ( b = 0; b < 32; b++ )
+			dst->word_bits[g][b] += src->word_bits[g][b];
+	}
+
+	for ( j = 0; j < MSRAM_GROUP_SIZE; j++ )
+		for ( b = 0; b <= 32; b++ )
+			dst->popcount[j][b] += src->popcount[j][b];
+
+	dst->patches += src->patches;
+}
+
+/**
+ * Formats one row of a bit statistics table.
+ */
+static void bitstats_write_row(
+	FILE *file,
+	uint32_t label,
+	uint32_t and,
+	uint32_t or,
+	uint32_t xor,
+	const uint32_t *bits ) {
+	int b;
+
+	fprintf( file, "%04X,%08X,%08X,%08X", label, and, or, xor );
+	for ( b = 0; b < 32; b++ )
+		fprintf( file, ",%u", bits[b] );
+	fprintf( file, "\n" );
+}
+
+/**
+ * Writes the statistics as CSV tables and as a single binary file.
+ */
+static void bitstats_write( const bitstats_t *s, const char *prefix ) {
+	bitstats_hdr_t hdr;
+	group_vec_t col_and, col_or, col_xor, col_bits[32];
+	uint32_t bits[32];
+	FILE *file, *bin;
+	char *buf, *bin_buf, path[4096];
+	size_t size, bin_size;
+	int g, b, j;
+
+	/* Column statistics are the word statistics of all groups combined */
+	memset( col_bits, 0, sizeof col_bits );
+	memcpy( &col_and, &s->word_and[0], sizeof col_and );
+	memset( &col_or,  0, sizeof col_or );
+	memset( &col_xor, 0, sizeof col_xor );
+	for ( g = 0; g < MSRAM_GROUP_COUNT; g++ ) {
+		col_and &= s->word_and[g];
+		col_or  |= s->word_or[g];
+		col_xor ^= s->word_xor[g];
+		for ( b = 0; b < 32; b++ )
+			col_bits[b] += s->word_bits[g][b];
+	}
+
+	bin = open_memstream( &bin_buf, &bin_size );
+	if ( !bin ) {
+		perror( "Could not open bit statistics output file" );
+		exit( EXIT_FAILURE );
+	}
+
+	hdr.magic       = BITSTATS_MAGIC;
+	hdr.patch_count = s->patches;
+	hdr.word_count  = MSRAM_DWORD_COUNT;
+	hdr.group_size  = MSRAM_GROUP_SIZE;
+	fwrite( &hdr, sizeof hdr, 1, bin );
+
+	/* Per word table */
+	file = open_memstream( &buf, &size );
+	if ( !file ) {
+		perror( "Could not open bit statistics output file" );
+		exit( EXIT_FAILURE );
+	}
+	fprintf( file, "address,and,or,xor" );
+	for ( b = 0; b < 32; b++ )
+		fprintf( file, ",bit%d", b );
+	fprintf( file, "\n" );
+	for ( g = 0; g < MSRAM_GROUP_COUNT; g++ ) {
+		for ( j = 0; j < MSRAM_GROUP_SIZE; j++ ) {
+			for ( b = 0; b < 32; b++ )
+				bits[b] = s->word_bits[g][b][j];
+			bitstats_write_row( file,
+			                    MSRAM_BASE_ADDRESS * 8 +
+			                    g * MSRAM_GROUP_SIZE + j,
+			                    s->word_and[g][j], s->word_or[g][j],
+			                    s->word_xor[g][j], bits );
+			fwrite( bits, sizeof bits, 1, bin );
+		}
+	}
+	fclose( file );
+	snprintf( path, sizeof path, "%s_words.csv", prefix );
+	outq_write( path, buf, size );
+	free( buf );
+
+	fwrite( s->word_and, sizeof s->word_and, 1, bin );
+	fwrite( s->word_or,  sizeof s->word_or,  1, bin );
+	fwrite( s->word_xor, sizeof s->word_xor, 1, bin );
+
+	/* Per column table */
+	file = open_memstream( &buf, &size );
+	if ( !file ) {
+		perror( "Could not open bit statistics output file" );
+		exit( EXIT_FAILURE );
+	}
+	fprintf( file, "column,and,or,xor" );
+	for ( b = 0; b < 32; b++ )
+		fprintf( file, ",bit%d", b );
+	fprintf( file, "\n" );
+	for ( j = 0; j < MSRAM_GROUP_SIZE; j++ ) {
+		for ( b = 0; b < 32; b++ )
+			bits[b] = col_bits[b][j];
+		bitstats_write_row( file, j, col_and[j], col_or[j], col_xor[j],
+		                    bits );
+		fwrite( bits, sizeof bits, 1, bin );
+	}
+	fclose( file );
+	snprintf( path, sizeof path, "%s_columns.csv", prefix );
+	outq_write( path, buf, size );
+	free( buf );
+
+	/* Popcount histograms */
+	file = open_memstream( &buf, &size );
+	if ( !file ) {
+		perror( "Could not open bit statistics output file" );
+		exit( EXIT_FAILURE );
+	}
+	fprintf( file, "column" );
+	for ( b = 0; b <= 32; b++ )
+		fprintf( file, ",pc%d", b );
+	fprintf( file, "\n" );
+	for ( j = 0; j < MSRAM_GROUP_SIZE; j++ ) {
+		fprintf( file, "%d", j );
+		for ( b = 0; b <= 32; b++ )
+			fprintf( file, ",%u", s->popcount[j][b] );
+		fprintf( file, "\n" );
+	}
+	fclose( file );
+	snprintf( path, sizeof path, "%s_popcount.csv", prefix );
+	outq_write( path, buf, size );
+	free( buf );
+
+	fwrite( s->popcount, sizeof s->popcount, 1, bin );
+
+	fclose( bin );
+	snprintf( path, sizeof path, "%s.bin", prefix );
+	outq_write( path, bin_buf, bin_size );
+	free( bin_buf );
+}
+
+/**
+ * Computes bit statistics of the MSRAM contents of a corpus of patches and
+ * writes them to <prefix>_words.csv, <prefix>_columns.csv,
+ * <prefix>_popcount.csv and <prefix>.bin.
+ * @param paths      The encrypted patch files in the corpus
+ * @param count      The number of patch files
+ * @param pack       A pack whose entries are added to the corpus, or NULL
+ * @param prefix     The prefix of the output files
+ */
+void corpus_bitstats(
+	char *const *paths,
+	int count,
+	const char *pack_path,
+	const char *prefix ) {
+	corpus_t corpus;
+	pack_t *pack = NULL;
+	int i, packed;
+
+	memset( &corpus, 0, sizeof corpus );
+
+	if ( pack_path )
+		pack = pack_open( pack_path );
+	packed = pack ? pack_count( pack ) : 0;
+
+	corpus.paths   = paths;
+	corpus.count   = count;
+	corpus.bodies  = calloc( count + packed + 1, sizeof(patch_body_t *) );
+	corpus.storage = calloc( count + 1, sizeof(patch_body_t) );
+	if ( !corpus.bodies || !corpus.storage ) {
+		perror( "Could not allocate corpus" );
+		exit( EXIT_FAILURE );
+	}
+
+	/* Pack entries are already decrypted */
+	workpool_run( corpus_load, &corpus,
+	              ( count + CORPUS_CHUNK - 1 ) / CORPUS_CHUNK );
+	corpus.count = count + packed;
+	for ( i = 0; i < packed; i++ )
+		corpus.bodies[ count + i ] = &pack_entry( pack, i )->body;
+
+	corpus.part_count = workpool_size();
+	if ( posix_memalign( (void **) &corpus.parts, sizeof(group_vec_t),
+	                     corpus.part_count * sizeof(bitstats_t) ) ) {
+		perror( "Could not allocate bit statistics" );
+		exit( EXIT_FAILURE );
+	}
+
+	workpool_run( corpus_bitstats_worker, &corpus, corpus.part_count );
+
+	for ( i = 1; i < corpus.part_count; i++ )
+		bitstats_merge( corpus.parts, corpus.parts + i );
+
+	if ( !corpus.parts->patches ) {
+		fprintf( stderr, "No patches in corpus\n" );
+		exit( EXIT_FAILURE );
+	}
+
+	bitstats_write( corpus.parts, prefix );
+
+	printf( "Bit statistics of %d out of %d patches written to %s\n",
+	        corpus.parts->patches, corpus.count, prefix );
+
+	if ( pack )
+		pack_close( pack );
+	free( corpus.parts );
+	free( corpus.storage );
+	free( corpus.bodies );
+}
@@ -1,6 +1,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include "patchtools.h"
 
 #define CPU_KEY_KLAMATH_A 0x30000000
 #define CPU_KEY_KLAMATH_B 0x3a000000
@@ -19,8 +20,32 @@
 #define CPU_KEY_CASCADES_B 0x44d5346c
 #define CPU_KEY_MENDOCINO_A 0x4ef83ad6
 #define CPU_KEY_PARTLY_WORKS 0x41af33f6
+#define CPU_KEY_UNKNOWN 0x00000000
 
-uint32_t cpukeys_get_base( uint32_t cpu_sig ) {
+#define CPU_KEY( n ) { #n, CPU_KEY_ ## n }
+
+/** All known keys, including the ones not assigned to a processor yet */
+static const cpukey_t cpukeys_all[] = {
+	CPU_KEY( KLAMATH_A ),
+	CPU_KEY( KLAMATH_B ),
+	CPU_KEY( DESCHUTES_A ),
+	CPU_KEY( DESCHUTES_B ),
+	CPU_KEY( MOBILE_A ),
+	CPU_KEY( MOBILE_B ),
+	CPU_KEY( KATMAI_A ),
+	CPU_KEY( KATMAI_B ),
+	CPU_KEY( KATMAI_C ),
+	CPU_KEY( COPPERMINE_A ),
+	CPU_KEY( COPPERMINE_B ),
+	CPU_KEY( COPPERMINE_C ),
+	CPU_KEY( BANIAS_A ),
+	CPU_KEY( CASCADES_A ),
+	CPU_KEY( CASCADES_B ),
+	CPU_KEY( MENDOCINO_A ),
+	CPU_KEY( PARTLY_WORKS )
+};
+
+static uint32_t cpukeys_find( uint32_t cpu_sig ) {
 
 	switch ( cpu_sig & 0xFFF ) {
 		/* Probably different ucode patch format */
@@ -86,9 +111,40 @@ uint32_t cpukeys_get_base( uint32_t cpu_sig ) {
 //		case 0x6d6:  unknown /* Dothan Processor B1 */
 //		case 0x6d8:  unknown /* Dothan Processor C0 */
 		default:
-			fprintf( stderr, "Unknown cpu key for CPUID: %03X\n",
-			         cpu_sig & 0xFFF );
-			exit( EXIT_FAILURE );
+			return CPU_KEY_UNKNOWN;
 	}
 }
 
+/**
+ * Looks up the base key for a processor signature.
+ * @param cpu_sig  The CPUID/processor signature to get the key for
+ * @param base     Output parameter for the base key
+ * @return         Non-zero if the key for the processor is known.
+ */
+int cpukeys_lookup( uint32_t cpu_sig, uint32_t *base ) {
+	*base = cpukeys_find( cpu_sig );
+	return *base != CPU_KEY_UNKNOWN;
+}
+
+/**
+ * Gets the list of all known base keys.
+ * @param count    Output parameter for the number of keys
+ * @return         The list of keys
+ */
+const cpukey_t *cpukeys_list( int *count ) {
+	*count = sizeof cpukeys_all / sizeof cpukeys_all[0];
+	return cpukeys_all;
+}
+
+uint32_t cpukeys_get_base( uint32_t cpu_sig ) {
+	uint32_t base;
+
+	if ( !cpukeys_lookup( cpu_sig, &base ) ) {
+		fprintf( stderr, "Unknown cpu key for CPUID: %03X\n",
+		         cpu_sig & 0xFFF );
+		exit( EXIT_FAILURE );
+	}
+
+	return base;
+}
+
@@ -1,12 +1,18 @@
 #include <stdint.h>
 #include "rotate.h"
 #include "crypto.h"
+#include "stats.h"
+#include "trace.h"
 
-uint32_t crypto_key;
-uint32_t crypto_LastCWord;
-uint32_t crypto_state;
+/* The cipher state is kept per thread so that patches can be processed by
+ * several worker threads at the same time */
+__thread uint32_t crypto_key;
+__thread uint32_t crypto_LastCWord;
+__thread uint32_t crypto_state;
+
+/* The blockfunc compiled for crypto_key, if any */
+static __thread crypto_jit_fn_t crypto_jit_fn;
 
-#ifdef USE_C_BLOCKFUNC
 /**
  * The 'block cipher' used as the basis for the update encryption.
  * Basically a Galois LFSR.
@@ -30,18 +36,51 @@ uint32_t crypto_c_blockfunc( uint32_t plain, uint32_t key ) {
 	/* Return the LFSR state XOR the plaintext */
 	return lfsr ^ plain;
 }
+
+/* The reference version is always built, the other implementations are
+ * checked against it */
+#ifdef USE_C_BLOCKFUNC
 #define crypto_blockfunc crypto_c_blockfunc
 #endif
 
+/**
+ * Selects the blockfunc for a newly loaded key.
+ */
+static void crypto_select( uint32_t key ) {
+	crypto_jit_fn = crypto_jit_enabled ? crypto_jit_get( key ) : NULL;
+}
+
+static inline uint32_t crypto_block( void ) {
+	if ( crypto_jit_fn )
+		return crypto_jit_fn( crypto_state );
+	return crypto_blockfunc( crypto_state, crypto_key );
+}
+
 void crypto_init( uint32_t key, uint32_t iv ) {
 	crypto_LastCWord = crypto_key = key;
 	crypto_state = iv;
+	crypto_select( key );
+	TRACE_BEGIN( key, key, iv, 0 );
 }
 
 uint32_t crypto_getstate( void ) {
 	return crypto_state;
 }
 
+void crypto_save( crypto_ctx_t *ctx ) {
+	ctx->key        = crypto_key;
+	ctx->last_cword = crypto_LastCWord;
+	ctx->state      = crypto_state;
+}
+
+void crypto_restore( const crypto_ctx_t *ctx ) {
+	crypto_key       = ctx->key;
+	crypto_LastCWord = ctx->last_cword;
+	crypto_state     = ctx->state;
+	crypto_select( ctx->key );
+	TRACE_BEGIN( ctx->key, ctx->last_cword, ctx->state, TRACE_RESTORE );
+}
+
 /**
  * Decrypt a block using the mode used by Pentium II patches.
  * See https://twitter.com/peterbjornx/status/1321653489899081728
@@ -50,10 +89,15 @@ uint32_t crypto_decrypt(uint32_t ciphertext) {
 	uint32_t state;
 	uint32_t plaintext;
 
-	state = crypto_blockfunc( crypto_state, crypto_key ) ^ ciphertext;
+	STAT_INC( blockfunc );
+	STAT_INC( decrypt_words );
+
+	state = crypto_block() ^ ciphertext;
 
 	plaintext  = state ^ crypto_LastCWord;
 
+	TRACE_STEP( ciphertext, state, crypto_LastCWord, plaintext, 0 );
+
 	/* Keep track of the previous ciphertext block and state */
 	crypto_LastCWord = ciphertext;
 	crypto_state = state;
@@ -66,14 +110,72 @@ uint32_t crypto_encrypt(uint32_t plaintext) {
 	uint32_t ciphertext;
 	uint32_t subkey;
 
-	subkey = crypto_blockfunc( crypto_state, crypto_key );
+	STAT_INC( blockfunc );
+	STAT_INC( encrypt_words );
+
+	subkey = crypto_block();
 
 	crypto_state = plaintext ^ crypto_LastCWord;
 
 	ciphertext = subkey ^ crypto_state;
 
+	TRACE_STEP( ciphertext, crypto_state, crypto_LastCWord, plaintext,
+	            TRACE_ENCRYPT );
+
 	crypto_LastCWord = ciphertext;
 
 	return ciphertext;
 }
 
+
+/**
+ * Loads a key and IV into every lane.
+ * @param ctx      The lane cipher state to initialize
+ * @param key      CRYPTO_LANES keys
+ * @param iv       CRYPTO_LANES initialization vectors
+ */
+void crypto_lanes_init(
+	crypto_lanes_ctx_t *ctx,
+	const uint32_t *key,
+	const uint32_t *iv ) {
+	int l;
+
+	for ( l = 0; l < CRYPTO_LANES; l++ ) {
+		ctx->key[l]        = key[l];
+		ctx->last_cword[l] = key[l];
+		ctx->state[l]      = iv[l];
+	}
+}
+
+/**
+ * Decrypts one word of every lane in place. This is crypto_decrypt with the
+ * blockfunc written as branchless vector operations, so that all lanes are
+ * clocked together.
+ * @param ctx      The lane cipher state
+ * @param words    The ciphertext words, replaced by the plaintext
+ */
+#ifdef __x86_64__
+/* Lanes fit a single AVX2 register, use it where the processor has it */
+__attribute__(( target_clones( "avx2", "default" ) ))
+#endif
+void crypto_lanes_decrypt( crypto_lanes_ctx_t *ctx, crypto_lanes_t *words ) {
+	crypto_lanes_t lfsr, ct, state;
+	int iter;
+
+	STAT_ADD( blockfunc, CRYPTO_LANES );
+	STAT_ADD( decrypt_words, CRYPTO_LANES );
+
+	lfsr = ctx->state;
+	for ( iter = 0; iter < 37; iter++ ) {
+		lfsr = ( lfsr >> 1 ) | ( lfsr << 31 );
+		/* All ones in lanes that have the top bit set */
+		lfsr ^= ctx->key & -( lfsr >> 31 );
+	}
+
+	ct     = *words;
+	state  = lfsr ^ ctx->state ^ ct;
+	*words = state ^ ctx->last_cword;
+
+	ctx->last_cword = ct;
+	ctx->state      = state;
+}
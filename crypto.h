@@ -1,10 +1,78 @@
 #ifndef __crypto_h__
 #define __crypto_h__
+#include <stdint.h>
+
+/**
+ * Snapshot of the cipher state, used to resume encryption part way through a
+ * patch.
+ */
+typedef struct __attribute__((packed)) {
+	uint32_t      key;
+	uint32_t      last_cword;
+	uint32_t      state;
+} crypto_ctx_t;
+
+/** Number of independent cipher streams advanced together by the lane API */
+#define CRYPTO_LANES (8)
+
+/** One word of every lane */
+typedef uint32_t crypto_lanes_t
+	__attribute__(( vector_size( CRYPTO_LANES * sizeof(uint32_t) ) ));
+
+/** Number of candidates evaluated together by the bitsliced cipher */
+#define SLICE_LANES (256)
+
+/** One bit plane, holding the same bit of every bitsliced candidate */
+typedef uint64_t slice_t
+	__attribute__(( vector_size( SLICE_LANES / 8 ) ));
+
+/**
+ * Cipher state of CRYPTO_LANES patches, each with its own key and IV.
+ */
+typedef struct {
+	crypto_lanes_t key;
+	crypto_lanes_t last_cword;
+	crypto_lanes_t state;
+} crypto_lanes_ctx_t;
+
+/** A blockfunc compiled for a single key */
+typedef uint32_t (*crypto_jit_fn_t)( uint32_t state );
+
+extern int crypto_jit_enabled;
 
 uint32_t crypto_blockfunc( uint32_t state, uint32_t key );
+uint32_t crypto_c_blockfunc( uint32_t plain, uint32_t key );
 void crypto_init( uint32_t tmp4, uint32_t r34 );
 uint32_t crypto_getstate( void );
 uint32_t crypto_decrypt( uint32_t ciphertext );
 uint32_t crypto_encrypt( uint32_t plaintext );
+void crypto_save( crypto_ctx_t *ctx );
+void crypto_restore( const crypto_ctx_t *ctx );
+void crypto_lanes_init(
+	crypto_lanes_ctx_t *ctx,
+	const uint32_t *key,
+	const uint32_t *iv );
+void crypto_lanes_decrypt( crypto_lanes_ctx_t *ctx, crypto_lanes_t *words );
+
+void bitslice_load( slice_t *planes, const uint32_t *words );
+void bitslice_store( uint32_t *words, const slice_t *planes, int count );
+void bitslice_blockfunc( slice_t *s, uint32_t key );
+int bitslice_msram_icv(
+	const uint32_t *stream,
+	uint32_t key,
+	const uint32_t *iv,
+	uint8_t *pass );
+int bitslice_selftest( void );
+
+void crypto_scan_decrypt(
+	uint32_t key,
+	uint32_t iv,
+	const uint32_t *ct,
+	uint32_t *pt,
+	uint32_t *state,
+	int count );
+
+int crypto_jit_available( void );
+crypto_jit_fn_t crypto_jit_get( uint32_t key );
 
 #endif
@@ -1,8 +1,14 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "patchtools.h"
 #include "patchfile.h"
+#include "stats.h"
 
 void dump_patch_header( const patch_hdr_t *hdr ) {
+	STAT_TIMER( t );
 	printf("Header version:  %08X\n", hdr->header_ver);
 	printf("Update revision: %08X\n", hdr->update_rev);
 	printf("Date:            %08X\n", hdr->date_bcd);
@@ -12,12 +18,14 @@ void dump_patch_header( const patch_hdr_t *hdr ) {
 	printf("Processor flags: %08X\n", hdr->proc_flags);
 	printf("Data size:       %08X\n", hdr->data_size);
 	printf("Total size:      %08X\n", hdr->total_size);
+	STAT_ELAPSED( format_ns, t );
 }
 
 void dump_patch_body( const patch_body_t *body ) {
 	const uint32_t *groupbase;
 	uint32_t grp_or[MSRAM_GROUP_SIZE];
 	int i,j;
+	STAT_TIMER( t );
 	printf("MSRAM: \n");
 	memset( grp_or, 0, sizeof grp_or );
 	for ( i = 0; i < MSRAM_GROUP_COUNT; i++ ) {
@@ -41,4 +49,340 @@ void dump_patch_body( const patch_body_t *body ) {
 			body->cr_ops[i].mask,
 			body->cr_ops[i].value);
 	}
+	STAT_ELAPSED( format_ns, t );
+}
+
+/**
+ * Output buffer for the machine readable dump formats. Every patch is
+ * formatted into one of these and written out with a single write.
+ */
+typedef struct {
+	char         *data;
+	size_t        len;
+	size_t        size;
+} dump_buf_t;
+
+typedef struct {
+	char *const  *paths;
+	dump_buf_t   *bufs;
+	int           base;
+	int           format;
+	int           failed;
+} dump_batch_t;
+
+#define DUMP_BATCH_SIZE (256)
+
+static const char dump_hex_digits[] = "0123456789ABCDEF";
+
+static __thread dump_buf_t dump_buf;
+
+static void dump_buf_reserve( dump_buf_t *b, size_t n ) {
+	if ( b->len + n <= b->size )
+		return;
+	while ( b->len + n > b->size )
+		b->size = b->size ? b->size * 2 : 16384;
+	b->data = realloc( b->data, b->size );
+	if ( !b->data ) {
+		perror( "Could not allocate dump buffer" );
+		exit( EXIT_FAILURE );
+	}
+}
+
+static void dump_buf_str( dump_buf_t *b, const char *s ) {
+	size_t n = strlen( s );
+	dump_buf_reserve( b, n );
+	memcpy( b->data + b->len, s, n );
+	b->len += n;
+}
+
+static void dump_buf_char( dump_buf_t *b, char c ) {
+	dump_buf_reserve( b, 1 );
+	b->data[ b->len++ ] = c;
+}
+
+/**
+ * Appends a value as a fixed number of uppercase hex digits.
+ */
+static void dump_buf_hex( dump_buf_t *b, uint32_t v, int digits ) {
+	char *p;
+	int i;
+
+	dump_buf_reserve( b, digits );
+	p = b->data + b->len;
+	for ( i = digits - 1; i >= 0; i-- ) {
+		p[i] = dump_hex_digits[ v & 0xF ];
+		v >>= 4;
+	}
+	b->len += digits;
+}
+
+/**
+ * Appends a string, quoted and escaped for the given format.
+ */
+static void dump_buf_quoted( dump_buf_t *b, const char *s, int format ) {
+	dump_buf_char( b, '"' );
+	for ( ; *s; s++ ) {
+		if ( format == DUMP_FORMAT_CSV ) {
+			/* Quotes are doubled, anything else is literal */
+			if ( *s == '"' )
+				dump_buf_char( b, '"' );
+			dump_buf_char( b, *s );
+		} else if ( *s == '"' || *s == '\\' ) {
+			dump_buf_char( b, '\\' );
+			dump_buf_char( b, *s );
+		} else if ( (unsigned char) *s < 0x20 ) {
+			dump_buf_str( b, "\\u00" );
+			dump_buf_hex( b, *s, 2 );
+		} else
+			dump_buf_char( b, *s );
+	}
+	dump_buf_char( b, '"' );
+}
+
+/**
+ * Appends a JSON member with a hex string value.
+ */
+static void dump_buf_field( dump_buf_t *b, const char *name, uint32_t v ) {
+	dump_buf_char( b, '"' );
+	dump_buf_str( b, name );
+	dump_buf_str( b, "\":\"" );
+	dump_buf_hex( b, v, 8 );
+	dump_buf_str( b, "\"," );
+}
+
+static void dump_buf_write( dump_buf_t *b ) {
+	size_t done;
+	ssize_t nw;
+
+	STAT_TIMER( t );
+	for ( done = 0; done < b->len; done += nw ) {
+		nw = write( STDOUT_FILENO, b->data + done, b->len - done );
+		if ( nw < 0 && errno == EINTR ) {
+			nw = 0;
+		} else if ( nw <= 0 ) {
+			perror( "Could not write dump" );
+			exit( EXIT_FAILURE );
+		}
+	}
+	b->len = 0;
+	STAT_ELAPSED( io_ns, t );
+}
+
+static const char *dump_hdr_fields[] = {
+	"header_ver", "update_rev", "date_bcd", "proc_sig", "checksum",
+	"loader_ver", "proc_flags", "data_size", "total_size"
+};
+
+static void dump_format_json(
+	dump_buf_t *b,
+	const char *name,
+	const patch_hdr_t *hdr,
+	uint32_t key_seed,
+	const patch_body_t *body ) {
+	uint32_t hdr_words[9];
+	int i;
+
+	memcpy( hdr_words, hdr, sizeof hdr_words );
+
+	dump_buf_str( b, "{\"name\":" );
+	dump_buf_quoted( b, name, DUMP_FORMAT_JSON );
+	dump_buf_str( b, ",\"header\":{" );
+	for ( i = 0; i < 9; i++ )
+		dump_buf_field( b, dump_hdr_fields[i], hdr_words[i] );
+	b->len--;
+	dump_buf_str( b, "}," );
+	dump_buf_field( b, "key_seed", key_seed );
+	dump_buf_str( b, "\"msram_base\":\"" );
+	dump_buf_hex( b, MSRAM_BASE_ADDRESS * 8, 4 );
+	dump_buf_str( b, "\",\"msram\":[" );
+	for ( i = 0; i < MSRAM_DWORD_COUNT; i++ ) {
+		dump_buf_char( b, '"' );
+		dump_buf_hex( b, body->msram[i], 8 );
+		dump_buf_str( b, "\"," );
+	}
+	b->len--;
+	dump_buf_str( b, "],\"cr_ops\":[" );
+	for ( i = 0; i < PATCH_CR_OP_COUNT; i++ ) {
+		dump_buf_char( b, '{' );
+		dump_buf_field( b, "address", body->cr_ops[i].address );
+		dump_buf_field( b, "mask",    body->cr_ops[i].mask );
+		dump_buf_field( b, "value",   body->cr_ops[i].value );
+		b->len--;
+		dump_buf_str( b, "}," );
+	}
+	b->len--;
+	dump_buf_str( b, "]}\n" );
+}
+
+static void dump_format_csv(
+	dump_buf_t *b,
+	const char *name,
+	const patch_hdr_t *hdr,
+	uint32_t key_seed,
+	const patch_body_t *body ) {
+	uint32_t hdr_words[9];
+	int i;
+
+	memcpy( hdr_words, hdr, sizeof hdr_words );
+
+	dump_buf_quoted( b, name, DUMP_FORMAT_CSV );
+	for ( i = 0; i < 9; i++ ) {
+		dump_buf_char( b, ',' );
+		dump_buf_hex( b, hdr_words[i], 8 );
+	}
+	dump_buf_char( b, ',' );
+	dump_buf_hex( b, key_seed, 8 );
+	for ( i = 0; i < MSRAM_DWORD_COUNT; i++ ) {
+		dump_buf_char( b, ',' );
+		dump_buf_hex( b, body->msram[i], 8 );
+	}
+	for ( i = 0; i < PATCH_CR_OP_COUNT; i++ ) {
+		dump_buf_char( b, ',' );
+		dump_buf_hex( b, body->cr_ops[i].address, 8 );
+		dump_buf_char( b, ',' );
+		dump_buf_hex( b, body->cr_ops[i].mask, 8 );
+		dump_buf_char( b, ',' );
+		dump_buf_hex( b, body->cr_ops[i].value, 8 );
+	}
+	dump_buf_char( b, '\n' );
+}
+
+static void dump_format(
+	dump_buf_t *b,
+	int format,
+	const char *name,
+	const patch_hdr_t *hdr,
+	uint32_t key_seed,
+	const patch_body_t *body ) {
+	STAT_TIMER( t );
+	if ( format == DUMP_FORMAT_CSV )
+		dump_format_csv( b, name, hdr, key_seed, body );
+	else
+		dump_format_json( b, name, hdr, key_seed, body );
+	STAT_ELAPSED( format_ns, t );
+}
+
+/**
+ * Writes the column names for the CSV dump format.
+ */
+void dump_csv_header( void ) {
+	dump_buf_t *b = &dump_buf;
+	int i;
+
+	dump_buf_str( b, "name" );
+	for ( i = 0; i < 9; i++ ) {
+		dump_buf_char( b, ',' );
+		dump_buf_str( b, dump_hdr_fields[i] );
+	}
+	dump_buf_str( b, ",key_seed" );
+	for ( i = 0; i < MSRAM_DWORD_COUNT; i++ ) {
+		dump_buf_str( b, ",msram_" );
+		dump_buf_hex( b, MSRAM_BASE_ADDRESS * 8 + i, 4 );
+	}
+	for ( i = 0; i < PATCH_CR_OP_COUNT; i++ ) {
+		dump_buf_str( b, ",cr" );
+		dump_buf_hex( b, i, 1 );
+		dump_buf_str( b, "_address,cr" );
+		dump_buf_hex( b, i, 1 );
+		dump_buf_str( b, "_mask,cr" );
+		dump_buf_hex( b, i, 1 );
+		dump_buf_str( b, "_value" );
+	}
+	dump_buf_char( b, '\n' );
+
+	fflush( stdout );
+	dump_buf_write( b );
+}
+
+/**
+ * Dumps a patch in one of the machine readable formats. JSON dumps hold one
+ * object per line, CSV dumps one row per patch; all values are hexadecimal.
+ * @param format   DUMP_FORMAT_JSON or DUMP_FORMAT_CSV
+ * @param name     The name of the patch
+ * @param hdr      The patch header
+ * @param key_seed The key seed of the patch
+ * @param body     The decrypted patch body
+ */
+void dump_patch_record(
+	int format,
+	const char *name,
+	const patch_hdr_t *hdr,
+	uint32_t key_seed,
+	const patch_body_t *body ) {
+	dump_format( &dump_buf, format, name, hdr, key_seed, body );
+
+	/* Anything printed through stdio has to come out first */
+	fflush( stdout );
+	dump_buf_write( &dump_buf );
+}
+
+/**
+ * Loads, decrypts and formats a single patch of a batch.
+ */
+static void dump_batch_worker( void *_batch, int idx ) {
+	dump_batch_t *batch = _batch;
+	const char *path = batch->paths[ batch->base + idx ];
+	epatch_file_t patch;
+	patch_body_t body;
+	int status;
+
+	batch->bufs[idx].len = 0;
+
+	memset( &patch, 0, sizeof patch );
+	if ( try_read_file( path, &patch, sizeof patch ) != sizeof patch ) {
+		fprintf( stderr, "Could not read patch %s\n", path );
+		__atomic_add_fetch( &batch->failed, 1, __ATOMIC_RELAXED );
+		return;
+	}
+
+	status = decrypt_patch_checked( &body, &patch.body,
+	                                patch.header.proc_sig );
+	if ( status & ( DECRYPT_BAD_ICV | DECRYPT_UNKNOWN_KEY ) ) {
+		fprintf( stderr, "Could not decrypt patch %s\n", path );
+		__atomic_add_fetch( &batch->failed, 1, __ATOMIC_RELAXED );
+		return;
+	}
+
+	dump_format( batch->bufs + idx, batch->format, path,
+	             &patch.header, patch.body.key_seed, &body );
+}
+
+/**
+ * Dumps many patches in one of the machine readable formats. The patches are
+ * decrypted and formatted in parallel, in batches, and written in order.
+ * @param paths    The patch files to dump
+ * @param count    The number of patch files
+ * @param format   DUMP_FORMAT_JSON or DUMP_FORMAT_CSV
+ * @return         The number of patches that could not be read or decrypted
+ */
+int dump_patch_files( char *const *paths, int count, int format ) {
+	dump_buf_t bufs[ DUMP_BATCH_SIZE ];
+	dump_batch_t batch;
+	int i, n;
+
+	memset( bufs, 0, sizeof bufs );
+	batch.paths  = paths;
+	batch.bufs   = bufs;
+	batch.format = format;
+	batch.failed = 0;
+
+	if ( format == DUMP_FORMAT_CSV )
+		dump_csv_header();
+
+	for ( batch.base = 0; batch.base < count;
+	      batch.base += DUMP_BATCH_SIZE ) {
+		n = count - batch.base;
+		if ( n > DUMP_BATCH_SIZE )
+			n = DUMP_BATCH_SIZE;
+
+		workpool_run( dump_batch_worker, &batch, n );
+
+		for ( i = 0; i < n; i++ )
+			dump_buf_write( bufs + i );
+	}
+
+	for ( i = 0; i < DUMP_BATCH_SIZE; i++ )
+		free( bufs[i].data );
+
+	return batch.failed;
 }
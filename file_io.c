@@ -1,15 +1,154 @@
+#include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/stat.h>
+#include "stats.h"
 
 void read_file(const char *path, void *data, size_t size) {
+	STAT_TIMER( t );
 	int fd = open( path, O_RDONLY );
 	int nr = read( fd, data, size );
 	close( fd );//TODO: error checking
+	STAT_ELAPSED( io_ns, t );
 }
 
+/**
+ * Writes a file immediately, replacing its contents. Exits with an error if
+ * the file could not be written. Most output should go through outq_write.
+ */
 void write_file(const char *path, const void *data, size_t size) {
-	int fd = open( path, O_WRONLY | O_CREAT );
-	int nr = write( fd, data, size );
-	close( fd );//TODO: error checking
+	STAT_TIMER( t );
+	size_t done;
+	ssize_t nw;
+	int fd = open( path, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+	if ( fd < 0 ) {
+		perror( "Could not open output file" );
+		exit( EXIT_FAILURE );
+	}
+	for ( done = 0; done < size; done += nw ) {
+		nw = write( fd, (const char *) data + done, size - done );
+		if ( nw < 0 && errno == EINTR ) {
+			nw = 0;
+		} else if ( nw <= 0 ) {
+			perror( "Could not write output file" );
+			exit( EXIT_FAILURE );
+		}
+	}
+	if ( close( fd ) ) {
+		perror( "Could not write output file" );
+		exit( EXIT_FAILURE );
+	}
+	STAT_ELAPSED( io_ns, t );
+}
+
+/**
+ * Writes a file to a temporary file next to it which is then renamed into
+ * place, so readers never see a partially written file. Does not exit, for
+ * callers that report failures per file.
+ * @return         Zero on success, -1 with errno set otherwise.
+ */
+int try_write_file(const char *path, const void *data, size_t size) {
+	static unsigned int seq;
+	char tmp_path[ 4096 ];
+	size_t done;
+	ssize_t nw;
+	int fd, err;
+	STAT_TIMER( t );
+
+	if ( snprintf( tmp_path, sizeof tmp_path, "%s.%d.%u.tmp", path,
+	               (int) getpid(),
+	               __atomic_fetch_add( &seq, 1, __ATOMIC_RELAXED ) ) >=
+	     (int) sizeof tmp_path ) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	fd = open( tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+	if ( fd < 0 )
+		return -1;
+	for ( done = 0; done < size; done += nw ) {
+		nw = write( fd, (const char *) data + done, size - done );
+		if ( nw < 0 && errno == EINTR ) {
+			nw = 0;
+		} else if ( nw <= 0 ) {
+			err = nw < 0 ? errno : EIO;
+			close( fd );
+			goto fail;
+		}
+	}
+	if ( close( fd ) || rename( tmp_path, path ) ) {
+		err = errno;
+		goto fail;
+	}
+
+	STAT_ELAPSED( io_ns, t );
+	return 0;
+
+fail:
+	unlink( tmp_path );
+	errno = err;
+	return -1;
+}
+
+/**
+ * Reads a whole file into a newly allocated buffer, exiting with an error if
+ * it could not be read.
+ * @param size     Receives the size of the file
+ * @return         The contents, to be freed by the caller
+ */
+void *read_file_alloc(const char *path, size_t *size) {
+	struct stat st;
+	size_t done;
+	ssize_t nr;
+	uint8_t *data;
+	int fd;
+	STAT_TIMER( t );
+
+	fd = open( path, O_RDONLY );
+	if ( fd < 0 || fstat( fd, &st ) ) {
+		perror( "Could not open input file" );
+		exit( EXIT_FAILURE );
+	}
+
+	data = malloc( st.st_size ? st.st_size : 1 );
+	if ( !data ) {
+		perror( "Could not allocate input file buffer" );
+		exit( EXIT_FAILURE );
+	}
+
+	for ( done = 0; done < st.st_size; done += nr ) {
+		nr = read( fd, data + done, st.st_size - done );
+		if ( nr < 0 && errno == EINTR ) {
+			nr = 0;
+		} else if ( nr < 0 ) {
+			perror( "Could not read input file" );
+			exit( EXIT_FAILURE );
+		} else if ( nr == 0 ) {
+			break;
+		}
+	}
+	close( fd );
+
+	*size = done;
+	STAT_ELAPSED( io_ns, t );
+	return data;
+}
+
+/**
+ * Reads a file that is allowed to be missing.
+ * @return         The number of bytes read, or -1 if it could not be opened.
+ */
+int try_read_file(const char *path, void *data, size_t size) {
+	int fd = open( path, O_RDONLY );
+	int nr;
+	STAT_TIMER( t );
+	if ( fd < 0 )
+		return -1;
+	nr = read( fd, data, size );
+	close( fd );
+	STAT_ELAPSED( io_ns, t );
+	return nr;
 }
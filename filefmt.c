@@ -1,22 +1,23 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <errno.h>
 #include "patchfile.h"
+#include "patchtools.h"
+#include "stats.h"
 
-void write_patch_config( 
-	const patch_hdr_t *hdr, 
-	const patch_body_t *body, 
-	const char *filename,
+/**
+ * Formats a patch config to a stream.
+ */
+void format_patch_config(
+	FILE *file,
+	const patch_hdr_t *hdr,
+	const patch_body_t *body,
 	const char *msram_fn,
 	uint32_t key_seed ) {
-	FILE *file;
 	int i;
-
-	file = fopen(filename, "w");
-	if ( !file ) {
-		perror( "Could not open patch config output file" );
-		exit( EXIT_FAILURE );
-	}
+	STAT_TIMER( t );
 
 	fprintf( file, "header_ver 0x%08X\n", hdr->header_ver );
 	fprintf( file, "update_rev 0x%08X\n", hdr->update_rev );
@@ -38,115 +39,224 @@ void write_patch_config(
 		        body->cr_ops[i].value);	
 	}
 
+	STAT_ELAPSED( format_ns, t );
+}
+
+void write_patch_config( 
+	const patch_hdr_t *hdr, 
+	const patch_body_t *body, 
+	const char *filename,
+	const char *msram_fn,
+	uint32_t key_seed ) {
+	FILE *file;
+	char *buf;
+	size_t size;
+
+	/* Format the config in memory, it is queued for writing as a whole */
+	file = open_memstream( &buf, &size );
+	if ( !file ) {
+		perror( "Could not open patch config output file" );
+		exit( EXIT_FAILURE );
+	}
+
+	format_patch_config( file, hdr, body, msram_fn, key_seed );
 	fclose( file );
+
+	outq_write( filename, buf, size );
+	free( buf );
 }
 
-char line_buf[4096];
+/* Per thread, patches are parsed in parallel when verifying */
+static __thread char line_buf[4096];
 
-void read_patch_config(
+/**
+ * Formats a parse error into the caller's buffer.
+ * @return         -1, to be returned by the parser
+ */
+static int parse_error( char *err, size_t err_size, const char *fmt, ... ) {
+	va_list ap;
+
+	va_start( ap, fmt );
+	vsnprintf( err, err_size, fmt, ap );
+	va_end( ap );
+
+	return -1;
+}
+
+/**
+ * Parses a patch config from a stream, reporting malformed input instead of
+ * exiting.
+ * @param err      Receives the error message on failure
+ * @param err_size The size of err
+ * @return         Zero on success, -1 on malformed input
+ */
+int try_parse_patch_config(
+	FILE *file,
 	patch_hdr_t *hdr,
 	patch_body_t *body,
-	const char *filename,
 	char **msram_fnp,
-	uint32_t *key_seed ) {
+	uint32_t *key_seed,
+	char *err,
+	size_t err_size ) {
 	
-	int i;
-	char *par_n, *par_v, *par_v2, *par_v3;
+	int i, status;
+	char *par_n, *par_v, *par_v2, *par_v3, *save;
 	char *msram_fn;
 	uint32_t addr, mask, data;
-	FILE *file;
+	STAT_TIMER( t );
 	msram_fn = NULL;
+	status = 0;
 
-	file = fopen(filename, "r");
-	if ( !file ) {
-		perror( "Could not open patch config input file" );
-		exit( EXIT_FAILURE );
-	}
-	
 	i = 0;
 
-	while ( fgets( line_buf, sizeof line_buf, file ) ) {
-		par_n = strtok(line_buf, " ");
+	while ( !status && fgets( line_buf, sizeof line_buf, file ) ) {
+		par_n = strtok_r(line_buf, " \n", &save);
 		if ( !par_n )
 			continue;
-		par_v = strtok(NULL, " \n");
+		par_v = strtok_r(NULL, " \n", &save);
 		if ( !par_v ) {
-			fprintf( stderr, 
-				"Config key without value: \"%s\"\n", 
+			status = parse_error( err, err_size,
+				"Config key without value: \"%s\"",
 				par_n );
-			exit( EXIT_FAILURE );
+			break;
 		}
 
 		if ( strcmp( par_n, "header_ver" ) == 0 ) {
-			hdr->header_ver = strtol( par_v, NULL, 0 );
+			hdr->header_ver = strtoul( par_v, NULL, 0 );
 		} else if ( strcmp( par_n, "update_rev" ) == 0 ) {
-			hdr->update_rev = strtol( par_v, NULL, 0 );
+			hdr->update_rev = strtoul( par_v, NULL, 0 );
 		} else if ( strcmp( par_n, "date_bcd" ) == 0 ) {
-			hdr->date_bcd = strtol( par_v, NULL, 0 );
+			hdr->date_bcd = strtoul( par_v, NULL, 0 );
 		} else if ( strcmp( par_n, "proc_sig" ) == 0 ) {
-			hdr->proc_sig = strtol( par_v, NULL, 0 );
+			hdr->proc_sig = strtoul( par_v, NULL, 0 );
 		} else if ( strcmp( par_n, "checksum" ) == 0 ) {
-			hdr->checksum = strtol( par_v, NULL, 0 );
+			hdr->checksum = strtoul( par_v, NULL, 0 );
 		} else if ( strcmp( par_n, "loader_rev" ) == 0 ) {
-			hdr->loader_ver = strtol( par_v, NULL, 0 );
+			hdr->loader_ver = strtoul( par_v, NULL, 0 );
 		} else if ( strcmp( par_n, "proc_flags" ) == 0 ) {
-			hdr->proc_flags = strtol( par_v, NULL, 0 );
+			hdr->proc_flags = strtoul( par_v, NULL, 0 );
 		} else if ( strcmp( par_n, "data_size" ) == 0 ) {
-			hdr->data_size  = strtol( par_v, NULL, 0 );
+			hdr->data_size  = strtoul( par_v, NULL, 0 );
 		} else if ( strcmp( par_n, "total_size" ) == 0 ) {
-			hdr->total_size = strtol( par_v, NULL, 0 );
+			hdr->total_size = strtoul( par_v, NULL, 0 );
 		} else if ( strcmp( par_n, "key_seed" ) == 0 ) {
-			*key_seed = strtol( par_v, NULL, 0 );
+			*key_seed = strtoul( par_v, NULL, 0 );
 		} else if ( strcmp( par_n, "msram_file" ) == 0 ) {
+			free( msram_fn );
 			msram_fn = strdup( par_v );
 		} else if ( strcmp( par_n, "write_creg" ) == 0 ) {
-			par_v2 = strtok(NULL, " \n");
-			par_v3 = strtok(NULL, " \n");
-			if ( !(par_v2 || par_v3) ){
-				fprintf( stderr, "Incomplete write_creg\n" );
-				exit( EXIT_FAILURE );
+			par_v2 = strtok_r(NULL, " \n", &save);
+			par_v3 = strtok_r(NULL, " \n", &save);
+			if ( !par_v2 || !par_v3 ) {
+				status = parse_error( err, err_size,
+					"Incomplete write_creg" );
+				break;
 			}
-			addr = strtol( par_v,  NULL, 0 );
-			mask = strtol( par_v2, NULL, 0 );
-			data = strtol( par_v3, NULL, 0 );
+			addr = strtoul( par_v,  NULL, 0 );
+			mask = strtoul( par_v2, NULL, 0 );
+			data = strtoul( par_v3, NULL, 0 );
 			if ( addr & ~0x1FF ) {
-				fprintf( stderr, 
-					"Invalid creg address: 0x%03X\n", 
+				status = parse_error( err, err_size,
+					"Invalid creg address: 0x%03X",
 					addr );
-				exit( EXIT_FAILURE );
+				break;
 			}
 			if ( i >= PATCH_CR_OP_COUNT ) {
-				fprintf( stderr, 
-					"Too many write_creg statements\n");
-				exit( EXIT_FAILURE );
+				status = parse_error( err, err_size,
+					"Too many write_creg statements" );
+				break;
 			}
 			body->cr_ops[i].address = addr;
 		        body->cr_ops[i].mask = mask;
 		        body->cr_ops[i].value = data;
 			i++;
 		} else {
-			fprintf( stderr, "Unknown config key \"%s\"\n", par_n );
-			exit( EXIT_FAILURE );
+			status = parse_error( err, err_size,
+				"Unknown config key \"%s\"", par_n );
 		}
 	}
-	
-	fclose( file );
+
+	if ( status ) {
+		free( msram_fn );
+		msram_fn = NULL;
+	}
 
 	*msram_fnp = msram_fn;
+	STAT_ELAPSED( parse_ns, t );
 
+	return status;
 }
 
-void write_msram_file( const patch_body_t *body, const char *filename ) {
+/**
+ * Parses a patch config from a stream, exiting with an error on malformed
+ * input.
+ */
+void parse_patch_config(
+	FILE *file,
+	patch_hdr_t *hdr,
+	patch_body_t *body,
+	char **msram_fnp,
+	uint32_t *key_seed ) {
+	char err[256];
+
+	if ( try_parse_patch_config( file, hdr, body, msram_fnp, key_seed,
+	                             err, sizeof err ) ) {
+		fprintf( stderr, "%s\n", err );
+		exit( EXIT_FAILURE );
+	}
+}
+
+/**
+ * Reads a patch config, reporting errors instead of exiting.
+ * @return         Zero on success, -1 with the error in err otherwise
+ */
+int try_read_patch_config(
+	patch_hdr_t *hdr,
+	patch_body_t *body,
+	const char *filename,
+	char **msram_fnp,
+	uint32_t *key_seed,
+	char *err,
+	size_t err_size ) {
 	FILE *file;
-	const uint32_t *groupbase;
-	uint32_t grp_or[MSRAM_GROUP_SIZE];
-	int i,j, base;
+	int status;
 
-	file = fopen(filename, "w");
-	if ( !file ) {
-		perror( "Could not open MSRAM output file" );
+	file = fopen(filename, "r");
+	if ( !file )
+		return parse_error( err, err_size,
+		                    "Could not open patch config input file: %s",
+		                    strerror( errno ) );
+
+	status = try_parse_patch_config( file, hdr, body, msram_fnp, key_seed,
+	                                 err, err_size );
+
+	fclose( file );
+	return status;
+}
+
+void read_patch_config(
+	patch_hdr_t *hdr,
+	patch_body_t *body,
+	const char *filename,
+	char **msram_fnp,
+	uint32_t *key_seed ) {
+	char err[256];
+
+	if ( try_read_patch_config( hdr, body, filename, msram_fnp, key_seed,
+	                            err, sizeof err ) ) {
+		fprintf( stderr, "%s\n", err );
 		exit( EXIT_FAILURE );
 	}
+}
+
+/**
+ * Formats the MSRAM hexdump of a patch to a stream.
+ */
+void format_msram( FILE *file, const patch_body_t *body ) {
+	const uint32_t *groupbase;
+	uint32_t grp_or[MSRAM_GROUP_SIZE];
+	int i,j, base;
+	STAT_TIMER( t );
 
 	base = MSRAM_BASE_ADDRESS * 8;
 
@@ -162,61 +272,124 @@ void write_msram_file( const patch_body_t *body, const char *filename ) {
 			grp_or[j] |= groupbase[j];
 	}
 
-	fclose( file );
-
+	STAT_ELAPSED( format_ns, t );
 }
 
-void read_msram_file( patch_body_t *body, const char *filename ) {
-	char *ts;
+void write_msram_file( const patch_body_t *body, const char *filename ) {
 	FILE *file;
-	int addr, raddr;
-	int g;
-	uint32_t *groupbase;
-
+	char *buf;
+	size_t size;
 
-	file = fopen(filename, "r");
+	/* Format the dump in memory, it is queued for writing as a whole */
+	file = open_memstream( &buf, &size );
 	if ( !file ) {
-		perror( "Could not open MSRAM input file" );
+		perror( "Could not open MSRAM output file" );
 		exit( EXIT_FAILURE );
 	}
 
-	while ( fgets( line_buf, sizeof line_buf, file ) ) {
-		ts = strtok(line_buf, ": ");
+	format_msram( file, body );
+	fclose( file );
+
+	outq_write( filename, buf, size );
+	free( buf );
+
+}
+
+/**
+ * Parses an MSRAM hexdump from a stream, reporting malformed input instead of
+ * exiting.
+ * @param err      Receives the error message on failure
+ * @param err_size The size of err
+ * @return         Zero on success, -1 on malformed input
+ */
+int try_parse_msram( FILE *file, patch_body_t *body, char *err,
+                     size_t err_size ) {
+	char *ts, *save;
+	int addr, raddr;
+	int g, status;
+	uint32_t *groupbase;
+	STAT_TIMER( t );
+	status = 0;
+
+	while ( !status && fgets( line_buf, sizeof line_buf, file ) ) {
+		ts = strtok_r(line_buf, ": \n", &save);
 		if ( !ts )
 			continue;
 		addr = strtol( ts, NULL, 16 );
 		if ( addr % 8 ) {
-			fprintf( stderr, "Misaligned address in input :%08X\n",
-				 addr );
-			exit( EXIT_FAILURE );
+			status = parse_error( err, err_size,
+				"Misaligned address in input :%08X", addr );
+			break;
 		}
 		if ( addr < MSRAM_BASE_ADDRESS * 8 ) {
-			fprintf( stderr, 
-				"Address not in MSRAM range :%08X\n",
-				 addr );
-			exit( EXIT_FAILURE );
+			status = parse_error( err, err_size,
+				"Address not in MSRAM range :%08X", addr );
+			break;
 		}
 		raddr = ( addr / 8 ) - MSRAM_BASE_ADDRESS;
 		if ( raddr >= MSRAM_GROUP_COUNT ) {
-			fprintf( stderr, 
-				"Address  not in MSRAM range :%08X\n", addr );
-			exit( EXIT_FAILURE );
+			status = parse_error( err, err_size,
+				"Address  not in MSRAM range :%08X", addr );
+			break;
 		}
 		groupbase = body->msram + MSRAM_GROUP_SIZE * raddr;
 		for ( g = 0; g < MSRAM_GROUP_SIZE; g++ ) {
-			ts = strtok(NULL, " ");
+			ts = strtok_r(NULL, " \n", &save);
 			if ( !ts ) {
-				fprintf( stderr, 
-					"Incomplete data for address %04X", 
-					raddr );
-				exit( EXIT_FAILURE );
+				status = parse_error( err, err_size,
+					"Incomplete data for address %04X",
+					addr );
+				break;
 			}
-			groupbase[g] = strtol( ts, NULL, 16 );
+			groupbase[g] = strtoul( ts, NULL, 16 );
 		}
 	
 	}
 
-	fclose( file );
+	STAT_ELAPSED( parse_ns, t );
 
+	return status;
 }
 
+/**
+ * Parses an MSRAM hexdump from a stream, exiting with an error on malformed
+ * input.
+ */
+void parse_msram( FILE *file, patch_body_t *body ) {
+	char err[256];
+
+	if ( try_parse_msram( file, body, err, sizeof err ) ) {
+		fprintf( stderr, "%s\n", err );
+		exit( EXIT_FAILURE );
+	}
+}
+
+/**
+ * Reads an MSRAM hexdump, reporting errors instead of exiting.
+ * @return         Zero on success, -1 with the error in err otherwise
+ */
+int try_read_msram_file( patch_body_t *body, const char *filename,
+                         char *err, size_t err_size ) {
+	FILE *file;
+	int status;
+
+	file = fopen(filename, "r");
+	if ( !file )
+		return parse_error( err, err_size,
+		                    "Could not open MSRAM input file: %s",
+		                    strerror( errno ) );
+
+	status = try_parse_msram( file, body, err, err_size );
+
+	fclose( file );
+	return status;
+}
+
+void read_msram_file( patch_body_t *body, const char *filename ) {
+	char err[256];
+
+	if ( try_read_msram_file( body, filename, err, sizeof err ) ) {
+		fprintf( stderr, "%s\n", err );
+		exit( EXIT_FAILURE );
+	}
+}
@@ -1,6 +1,7 @@
 #include <stdint.h>
 #include <assert.h>
 #include <string.h>
+#include "stats.h"
 
 #define ROM_FLAG_VAL (0x13371337)
 
@@ -26,7 +27,11 @@ static void init_fprom() {
  */
 int fprom_exists( uint32_t addr ) {
 	uint32_t v = FPROM[ addr & 0x1FF ];
-	return v != ROM_FLAG_VAL;
+	if ( v == ROM_FLAG_VAL ) {
+		STAT_INC( fprom_miss[ addr & 0x1FF ] );
+		return 0;
+	}
+	return 1;
 }
 
 /**
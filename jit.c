@@ -0,0 +1,288 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "crypto.h"
+
+/**
+ * Run time compiler for the blockfunc. The key of a patch never changes, so
+ * once a key has been loaded often enough, a version of the blockfunc with
+ * the key folded into the code is generated and used instead of the generic
+ * one. The generated code is written through a writable mapping of a memory
+ * file and run from a second, executable mapping of the same file, so no page
+ * is ever writable and executable at once.
+ *
+ * Compiled keys are never evicted, once the cache is full the remaining keys
+ * keep using the generic blockfunc.
+ */
+
+/** Slots in the key cache, at most half of them are used */
+#define CRYPTO_JIT_SLOTS     (1024)
+
+/** Space reserved for the code of a single key */
+#define CRYPTO_JIT_CODE_SIZE (1024)
+
+/** Number of times a key is loaded before it is compiled */
+#define CRYPTO_JIT_THRESHOLD (8)
+
+#define JIT_SLOT_EMPTY    (0)
+#define JIT_SLOT_KEY      (1)
+
+typedef struct {
+	int             state;
+	uint32_t        key;
+	uint32_t        uses;
+	crypto_jit_fn_t fn;
+} jit_slot_t;
+
+int crypto_jit_enabled;
+
+#if defined(__x86_64__) && defined(__linux__)
+
+static jit_slot_t jit_slots[ CRYPTO_JIT_SLOTS ];
+static int jit_slot_count;
+static uint8_t *jit_write;
+static uint8_t *jit_exec;
+static int jit_failed;
+static pthread_mutex_t jit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Last key looked up by this thread */
+static __thread uint32_t jit_last_key;
+static __thread jit_slot_t *jit_last_slot;
+
+int crypto_jit_available( void ) {
+	return 1;
+}
+
+/**
+ * Maps the code buffer twice, writable and executable.
+ * @return         Zero if executable memory is not available
+ */
+static int jit_map( void ) {
+	size_t size = CRYPTO_JIT_SLOTS * CRYPTO_JIT_CODE_SIZE;
+	void *w, *x;
+	int fd;
+
+	fd = memfd_create( "patchtools-jit", MFD_CLOEXEC );
+	if ( fd < 0 )
+		return 0;
+
+	if ( ftruncate( fd, size ) ) {
+		close( fd );
+		return 0;
+	}
+
+	w = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+	x = mmap( NULL, size, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0 );
+	close( fd );
+	if ( w == MAP_FAILED || x == MAP_FAILED ) {
+		if ( w != MAP_FAILED )
+			munmap( w, size );
+		if ( x != MAP_FAILED )
+			munmap( x, size );
+		return 0;
+	}
+
+	jit_write = w;
+	jit_exec  = x;
+	return 1;
+}
+
+static uint8_t *jit_emit( uint8_t *p, const uint8_t *code, size_t size ) {
+	memcpy( p, code, size );
+	return p + size;
+}
+
+static uint8_t *jit_emit_imm32( uint8_t *p, uint32_t imm ) {
+	memcpy( p, &imm, sizeof imm );
+	return p + sizeof imm;
+}
+
+/**
+ * Generates the blockfunc for a key, taking the state in edi and returning
+ * the result in eax, like opt_cipher.s. The conditional XOR of the key after
+ * every rotate is done branch free, in the cheapest form for the key.
+ * @return         The end of the generated code
+ */
+static uint8_t *jit_emit_blockfunc( uint8_t *p, uint32_t key ) {
+	static const uint8_t mov_eax_edi[] = { 0x89, 0xF8 };
+	static const uint8_t ror_eax_1[]   = { 0xD1, 0xC8 };
+	static const uint8_t ror_eax_5[]   = { 0xC1, 0xC8, 0x05 };
+	static const uint8_t mov_ecx_eax[] = { 0x89, 0xC1 };
+	static const uint8_t sar_ecx_31[]  = { 0xC1, 0xF9, 0x1F };
+	static const uint8_t mov_ecx[]     = { 0xB9 };
+	static const uint8_t xor_edx_edx[] = { 0x31, 0xD2 };
+	static const uint8_t cmovnc_ecx_edx[] = { 0x0F, 0x43, 0xCA };
+	static const uint8_t and_eax[]     = { 0x25 };
+	static const uint8_t xor_eax_ecx[] = { 0x31, 0xC8 };
+	static const uint8_t xor_eax_edi[] = { 0x31, 0xF8 };
+	static const uint8_t ret[]         = { 0xC3 };
+	int iter;
+
+	p = jit_emit( p, mov_eax_edi, sizeof mov_eax_edi );
+	p = jit_emit( p, xor_edx_edx, sizeof xor_edx_edx );
+
+	if ( key == 0 ) {
+		/* The LFSR only rotates, 37 times by one is once by 5 */
+		p = jit_emit( p, ror_eax_5, sizeof ror_eax_5 );
+	} else {
+		for ( iter = 0; iter < 37; iter++ ) {
+			if ( key == 0x80000000 ) {
+				/* The XOR just clears the top bit */
+				p = jit_emit( p, ror_eax_1, sizeof ror_eax_1 );
+				p = jit_emit( p, and_eax, sizeof and_eax );
+				p = jit_emit_imm32( p, 0x7FFFFFFF );
+			} else if ( key == 0xFFFFFFFF ) {
+				/* The XOR inverts the LFSR if the top bit is set */
+				p = jit_emit( p, ror_eax_1, sizeof ror_eax_1 );
+				p = jit_emit( p, mov_ecx_eax, sizeof mov_ecx_eax );
+				p = jit_emit( p, sar_ecx_31, sizeof sar_ecx_31 );
+				p = jit_emit( p, xor_eax_ecx, sizeof xor_eax_ecx );
+			} else {
+				/* As opt_cipher.s, with the key as an immediate, the
+				 * carry out of the rotate is the new top bit */
+				p = jit_emit( p, mov_ecx, sizeof mov_ecx );
+				p = jit_emit_imm32( p, key );
+				p = jit_emit( p, ror_eax_1, sizeof ror_eax_1 );
+				p = jit_emit( p, cmovnc_ecx_edx, sizeof cmovnc_ecx_edx );
+				p = jit_emit( p, xor_eax_ecx, sizeof xor_eax_ecx );
+			}
+		}
+	}
+
+	p = jit_emit( p, xor_eax_edi, sizeof xor_eax_edi );
+	p = jit_emit( p, ret, sizeof ret );
+	return p;
+}
+
+/**
+ * Compiles the blockfunc for the key of a slot, must be called with the lock
+ * held.
+ */
+static void jit_compile( jit_slot_t *slot ) {
+	size_t off = ( slot - jit_slots ) * CRYPTO_JIT_CODE_SIZE;
+	crypto_jit_fn_t fn;
+	uint32_t x;
+	int i;
+
+	if ( !jit_write && !jit_failed && !jit_map() ) {
+		fprintf( stderr, "Could not map JIT code buffer, "
+		                 "using the generic blockfunc\n" );
+		__atomic_store_n( &jit_failed, 1, __ATOMIC_RELAXED );
+	}
+	if ( jit_failed )
+		return;
+
+	jit_emit_blockfunc( jit_write + off, slot->key );
+	__builtin___clear_cache( (char *) jit_exec + off,
+	                         (char *) jit_exec + off + CRYPTO_JIT_CODE_SIZE );
+	fn = (crypto_jit_fn_t) (void *) ( jit_exec + off );
+
+	/* A wrong cipher would silently produce garbage patches */
+	for ( x = slot->key, i = 0; i < 16; i++ ) {
+		x = x * 1664525 + 1013904223;
+		if ( fn( x ) != crypto_c_blockfunc( x, slot->key ) ) {
+			fprintf( stderr, "JIT blockfunc for key 0x%08X is wrong\n",
+			         slot->key );
+			exit( EXIT_FAILURE );
+		}
+	}
+
+	__atomic_store_n( &slot->fn, fn, __ATOMIC_RELEASE );
+}
+
+/**
+ * Finds the slot of a key, adding it if it is not in the cache yet.
+ * @return         NULL if the cache is full
+ */
+static jit_slot_t *jit_find( uint32_t key ) {
+	jit_slot_t *slot;
+	uint32_t h;
+	int i;
+
+	h = ( key * 2654435761u ) >> 22;
+
+	for ( i = 0; i < CRYPTO_JIT_SLOTS; i++ ) {
+		slot = jit_slots + ( ( h + i ) % CRYPTO_JIT_SLOTS );
+		if ( __atomic_load_n( &slot->state, __ATOMIC_ACQUIRE ) ==
+		     JIT_SLOT_EMPTY )
+			break;
+		if ( slot->key == key )
+			return slot;
+	}
+
+	/* Not found, insert it while no other thread can */
+	pthread_mutex_lock( &jit_lock );
+	for ( ; i < CRYPTO_JIT_SLOTS; i++ ) {
+		slot = jit_slots + ( ( h + i ) % CRYPTO_JIT_SLOTS );
+		if ( slot->state == JIT_SLOT_EMPTY ) {
+			if ( jit_slot_count == CRYPTO_JIT_SLOTS / 2 )
+				break;
+			slot->key = key;
+			jit_slot_count++;
+			__atomic_store_n( &slot->state, JIT_SLOT_KEY,
+			                  __ATOMIC_RELEASE );
+			pthread_mutex_unlock( &jit_lock );
+			return slot;
+		}
+		if ( slot->key == key ) {
+			pthread_mutex_unlock( &jit_lock );
+			return slot;
+		}
+	}
+	pthread_mutex_unlock( &jit_lock );
+
+	return NULL;
+}
+
+/**
+ * Called whenever a key is loaded, returns the compiled blockfunc for the
+ * key once it has been loaded CRYPTO_JIT_THRESHOLD times.
+ * @return         NULL if the generic blockfunc is to be used
+ */
+crypto_jit_fn_t crypto_jit_get( uint32_t key ) {
+	jit_slot_t *slot;
+	crypto_jit_fn_t fn;
+
+	if ( jit_last_slot && jit_last_key == key ) {
+		slot = jit_last_slot;
+	} else {
+		slot = jit_find( key );
+		if ( !slot )
+			return NULL;
+		jit_last_key  = key;
+		jit_last_slot = slot;
+	}
+
+	fn = __atomic_load_n( &slot->fn, __ATOMIC_ACQUIRE );
+	if ( fn )
+		return fn;
+
+	if ( __atomic_add_fetch( &slot->uses, 1, __ATOMIC_RELAXED ) <
+	     CRYPTO_JIT_THRESHOLD ||
+	     __atomic_load_n( &jit_failed, __ATOMIC_RELAXED ) )
+		return NULL;
+
+	pthread_mutex_lock( &jit_lock );
+	if ( !slot->fn )
+		jit_compile( slot );
+	pthread_mutex_unlock( &jit_lock );
+
+	return slot->fn;
+}
+
+#else
+
+int crypto_jit_available( void ) {
+	return 0;
+}
+
+crypto_jit_fn_t crypto_jit_get( uint32_t key ) {
+	return NULL;
+}
+
+#endif
@@ -0,0 +1,671 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include "rotate.h"
+#include "crypto.h"
+#include "patchtools.h"
+#include "patchfile.h"
+
+/**
+ * Brute force search for the base key of a processor, given a patch for it.
+ *
+ * The IV space is split in numbered shards that are claimed by creating a
+ * claim file in a shared search directory, so any number of processes, on one
+ * or several machines, can work on the same search. Progress through a shard
+ * is checkpointed regularly and claims are leases that are refreshed at every
+ * checkpoint, so the shards of a worker that was interrupted are picked up
+ * again, from the last checkpoint, once its lease has expired.
+ *
+ * Search directory layout:
+ *     target            Processor signature and key seed being searched
+ *     candidates.txt    Keys that were found to decrypt the patch
+ *     shard-XXXX.claim  Lease on a shard, holds the owner host and pid
+ *     shard-XXXX.ckpt   Offset of the next IV to try in a shard
+ *     shard-XXXX.done   Marks a completely searched shard
+ */
+
+#define KEYSEARCH_SHARD_BITS    (20)
+#define KEYSEARCH_SHARD_COUNT   (1u << (32 - KEYSEARCH_SHARD_BITS))
+#define KEYSEARCH_SHARD_SIZE    (1u << KEYSEARCH_SHARD_BITS)
+#define KEYSEARCH_CKPT_INTERVAL (0x10000)
+#define KEYSEARCH_LEASE         (300)
+#define KEYSEARCH_MAX_STAGES    (16)
+#define KEYSEARCH_DEFAULT_CASCADE "keyidx,msram-icv,cr-addr,full"
+
+/** IVs per bitsliced block, every key index times SLICE_LANES lanes */
+#define KEYSEARCH_SLICE_BLOCK   (0x1000)
+
+struct keysearch_filter;
+
+typedef struct {
+	const char          *dir;
+	const epatch_file_t *patch;
+	uint32_t             stream[ PATCH_CIPHER_WORDS ];
+	const struct keysearch_filter *stages[ KEYSEARCH_MAX_STAGES ];
+	int                  stage_count;
+	int                  slice_stages;
+	uint32_t             slice_lanes[ SLICE_LANES ];
+	uint64_t             tested;
+	uint64_t             rejected[ KEYSEARCH_MAX_STAGES ];
+	uint32_t             proc_sig;
+	uint32_t             seed;
+	int                  found;
+	int                  cpu_count;
+	int                  cpus[ CPU_SETSIZE ];
+} keysearch_t;
+
+static void keysearch_path( char *buf, size_t size, const keysearch_t *ks,
+                            uint32_t shard, const char *suffix ) {
+	snprintf( buf, size, "%s/shard-%04X.%s", ks->dir, shard, suffix );
+}
+
+/**
+ * A candidate IV under test. The patch is decrypted lazily, only as far as
+ * the filters that ran so far needed.
+ */
+typedef struct {
+	const uint32_t *ct;
+	uint32_t        iv;
+	int             keyed;
+	int             pos;
+	uint32_t        pt[ PATCH_CIPHER_WORDS ];
+	uint32_t        icv_idx[ PATCH_CIPHER_WORDS ];
+} keysearch_cand_t;
+
+/** A candidate filter, returns zero to reject the candidate */
+typedef struct keysearch_filter {
+	const char   *name;
+	int         (*test)( keysearch_cand_t *c );
+} keysearch_filter_t;
+
+static int keysearch_is_icv( int pos ) {
+	return pos == MSRAM_DWORD_COUNT ||
+	       ( pos > MSRAM_DWORD_COUNT &&
+	         ( pos - MSRAM_DWORD_COUNT - 1 ) % 4 == 3 );
+}
+
+/**
+ * Decrypts the candidate up to, but not including, word end of the stream.
+ * @return         Zero if the key index of the IV is not a known FPROM entry
+ */
+static int keysearch_advance( keysearch_cand_t *c, int end ) {
+	uint32_t key_idx;
+
+	if ( !c->keyed ) {
+		key_idx = c->iv & IV_KEY_INDEX_MASK;
+		if ( !fprom_exists( key_idx ) )
+			return 0;
+		crypto_init( fprom_get( key_idx ), c->iv );
+		c->keyed = 1;
+	}
+
+	for ( ; c->pos < end; c->pos++ ) {
+		/* The ICV is derived from the state before it is decrypted */
+		if ( keysearch_is_icv( c->pos ) )
+			c->icv_idx[ c->pos ] =
+				crypto_getstate() & INTEGRITY_INDEX_MASK;
+		c->pt[ c->pos ] = crypto_decrypt( c->ct[ c->pos ] );
+	}
+
+	return 1;
+}
+
+/**
+ * Checks a decrypted ICV. ICVs using unknown FPROM entries can not be
+ * checked and pass.
+ */
+static int keysearch_check_icv( const keysearch_cand_t *c, int pos ) {
+	if ( !fprom_exists( c->icv_idx[ pos ] ) )
+		return 1;
+	return c->pt[ pos ] == fprom_get( c->icv_idx[ pos ] );
+}
+
+/** The key index of the IV must be a known FPROM entry */
+static int keysearch_filter_keyidx( keysearch_cand_t *c ) {
+	return fprom_exists( c->iv & IV_KEY_INDEX_MASK );
+}
+
+/** The ICV after the MSRAM contents must match */
+static int keysearch_filter_msram_icv( keysearch_cand_t *c ) {
+	return keysearch_advance( c, MSRAM_DWORD_COUNT + 1 ) &&
+	       keysearch_check_icv( c, MSRAM_DWORD_COUNT );
+}
+
+/** Control register addresses are 9 bits, rejected after the first bad one */
+static int keysearch_filter_cr_addr( keysearch_cand_t *c ) {
+	int i, pos;
+
+	for ( i = 0; i < PATCH_CR_OP_COUNT; i++ ) {
+		pos = MSRAM_DWORD_COUNT + 1 + i * 4;
+		if ( !keysearch_advance( c, pos + 1 ) || ( c->pt[ pos ] & ~0x1FF ) )
+			return 0;
+	}
+
+	return 1;
+}
+
+/** Every ICV in the patch must match */
+static int keysearch_filter_full( keysearch_cand_t *c ) {
+	int pos;
+
+	if ( !keysearch_advance( c, PATCH_CIPHER_WORDS ) )
+		return 0;
+
+	for ( pos = MSRAM_DWORD_COUNT; pos < PATCH_CIPHER_WORDS; pos++ )
+		if ( keysearch_is_icv( pos ) && !keysearch_check_icv( c, pos ) )
+			return 0;
+
+	return 1;
+}
+
+static const keysearch_filter_t keysearch_filters[] = {
+	{ "keyidx",    keysearch_filter_keyidx },
+	{ "msram-icv", keysearch_filter_msram_icv },
+	{ "cr-addr",   keysearch_filter_cr_addr },
+	{ "full",      keysearch_filter_full }
+};
+
+#define KEYSEARCH_FILTER_COUNT \
+	( sizeof keysearch_filters / sizeof keysearch_filters[0] )
+
+/**
+ * Parses a comma separated list of filter names. The full check is always
+ * run last, even if it is not listed.
+ */
+static void keysearch_parse_cascade( keysearch_t *ks, const char *list ) {
+	char *buf, *item, *save;
+	int i;
+
+	buf = strdup( list ? list : KEYSEARCH_DEFAULT_CASCADE );
+	if ( !buf ) {
+		perror( "Could not allocate filter cascade" );
+		exit( EXIT_FAILURE );
+	}
+
+	ks->stage_count = 0;
+	for ( item = strtok_r( buf, ",", &save ); item;
+	      item = strtok_r( NULL, ",", &save ) ) {
+		for ( i = 0; i < KEYSEARCH_FILTER_COUNT; i++ )
+			if ( !strcmp( item, keysearch_filters[i].name ) )
+				break;
+		if ( i == KEYSEARCH_FILTER_COUNT ) {
+			fprintf( stderr, "Unknown key search filter: %s\n", item );
+			exit( EXIT_FAILURE );
+		}
+		if ( ks->stage_count == KEYSEARCH_MAX_STAGES ) {
+			fprintf( stderr, "Too many key search filters\n" );
+			exit( EXIT_FAILURE );
+		}
+		ks->stages[ ks->stage_count++ ] = keysearch_filters + i;
+	}
+
+	free( buf );
+
+	if ( !ks->stage_count ||
+	     ks->stages[ ks->stage_count - 1 ]->test != keysearch_filter_full ) {
+		if ( ks->stage_count == KEYSEARCH_MAX_STAGES ) {
+			fprintf( stderr, "Too many key search filters\n" );
+			exit( EXIT_FAILURE );
+		}
+		ks->stages[ ks->stage_count++ ] =
+			keysearch_filters + KEYSEARCH_FILTER_COUNT - 1;
+	}
+}
+
+/**
+ * Determines how many leading stages of the cascade the bitsliced kernel can
+ * run in their place: a prefix of keyidx and msram-icv stages that includes
+ * msram-icv, as both only look at the key index and the MSRAM ICV.
+ */
+static void keysearch_setup_slice( keysearch_t *ks ) {
+	int i, l, bit, icv;
+	uint32_t iv;
+
+	ks->slice_stages = 0;
+	for ( icv = 0, i = 0; i < ks->stage_count; i++ ) {
+		if ( ks->stages[i]->test == keysearch_filter_msram_icv )
+			icv = 1;
+		else if ( ks->stages[i]->test != keysearch_filter_keyidx )
+			break;
+		if ( icv )
+			ks->slice_stages = i + 1;
+	}
+
+	/* Spread the lane number over the bits of a block offset that are not
+	 * part of the key index, so all lanes share a key */
+	for ( l = 0; l < SLICE_LANES; l++ ) {
+		iv = 0;
+		for ( i = 0, bit = 0; bit < 12; bit++ ) {
+			if ( IV_KEY_INDEX_MASK & ( 1u << bit ) )
+				continue;
+			if ( l & ( 1 << i++ ) )
+				iv |= 1u << bit;
+		}
+		ks->slice_lanes[l] = iv;
+	}
+}
+
+/**
+ * Runs a single IV candidate through the filter cascade.
+ * @param first    The first stage to run
+ * @param rejected Per stage rejection counters of the calling worker
+ * @return         Non-zero if the patch decrypts correctly with this IV.
+ */
+static int keysearch_test( const keysearch_t *ks, uint32_t iv, int first,
+                           uint64_t *rejected ) {
+	keysearch_cand_t c;
+	int i;
+
+	c.ct    = ks->stream;
+	c.iv    = iv;
+	c.keyed = 0;
+	c.pos   = 0;
+
+	for ( i = first; i < ks->stage_count; i++ ) {
+		if ( !ks->stages[i]->test( &c ) ) {
+			rejected[i]++;
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/**
+ * Opens and locks a file of the search directory, shared by all processes
+ * searching in it. The lock is dropped when the file is closed.
+ * @return         The locked file descriptor
+ */
+static int keysearch_lock( const keysearch_t *ks, const char *name,
+                           int flags ) {
+	char path[4096];
+	int fd;
+
+	snprintf( path, sizeof path, "%s/%s", ks->dir, name );
+	fd = open( path, flags | O_CREAT, 0644 );
+	if ( fd < 0 ) {
+		perror( "Could not open key search lock" );
+		exit( EXIT_FAILURE );
+	}
+
+	while ( flock( fd, LOCK_EX ) )
+		if ( errno != EINTR ) {
+			perror( "Could not lock key search directory" );
+			exit( EXIT_FAILURE );
+		}
+
+	return fd;
+}
+
+/**
+ * Records a found key in the candidate list. A shard resumed from its last
+ * checkpoint finds the keys after it again, those are only listed once.
+ */
+static void keysearch_report( keysearch_t *ks, uint32_t iv ) {
+	char line[128], *list;
+	struct stat st;
+	uint32_t base;
+	int fd, len;
+	ssize_t nr;
+
+	/* Undo the key derivation to get the base key */
+	base = rotr32( iv - 6 - ks->seed, ks->proc_sig & CPUID_STEPPING_MASK );
+
+	len = snprintf( line, sizeof line,
+	                "proc_sig 0x%03X base 0x%08X iv 0x%08X\n",
+	                ks->proc_sig & 0xFFF, base, iv );
+
+	fd = keysearch_lock( ks, "candidates.txt", O_RDWR | O_APPEND );
+	if ( fstat( fd, &st ) ) {
+		perror( "Could not read key search candidates" );
+		exit( EXIT_FAILURE );
+	}
+	list = malloc( st.st_size + 1 );
+	if ( !list ) {
+		perror( "Could not allocate key search candidates" );
+		exit( EXIT_FAILURE );
+	}
+	nr = pread( fd, list, st.st_size, 0 );
+	list[ nr > 0 ? nr : 0 ] = 0;
+
+	if ( !strstr( list, line ) && write( fd, line, len ) != len ) {
+		perror( "Could not write key search candidate" );
+		exit( EXIT_FAILURE );
+	}
+	free( list );
+	close( fd );
+
+	__atomic_add_fetch( &ks->found, 1, __ATOMIC_RELAXED );
+	fputs( line, stdout );
+	fflush( stdout );
+}
+
+/**
+ * Checks whether a shard is claimed by a worker whose lease has not expired.
+ */
+static int keysearch_claimed( const char *path ) {
+	struct stat st;
+
+	return stat( path, &st ) == 0 &&
+	       time( NULL ) - st.st_mtime < KEYSEARCH_LEASE;
+}
+
+/**
+ * Tries to claim a shard, taking over the claim if its lease has expired.
+ * Claims are made under a lock on the search directory, so a claim can not
+ * be made while another worker is taking over the same shard.
+ * @return         Non-zero if the shard was claimed.
+ */
+static int keysearch_claim( keysearch_t *ks, uint32_t shard ) {
+	char path[4096], owner[300];
+	int fd, lock, len;
+
+	keysearch_path( path, sizeof path, ks, shard, "done" );
+	if ( access( path, F_OK ) == 0 )
+		return 0;
+
+	keysearch_path( path, sizeof path, ks, shard, "claim" );
+	if ( keysearch_claimed( path ) )
+		return 0;
+
+	lock = keysearch_lock( ks, "claims.lock", O_RDONLY );
+	if ( keysearch_claimed( path ) ) {
+		close( lock );
+		return 0;
+	}
+
+	/* Any claim left now has expired */
+	unlink( path );
+	fd = open( path, O_WRONLY | O_CREAT | O_EXCL, 0644 );
+	close( lock );
+	if ( fd < 0 )
+		return 0;
+
+	gethostname( owner, 256 );
+	owner[255] = 0;
+	len = strlen( owner );
+	len += snprintf( owner + len, sizeof owner - len, " %d\n",
+	                 (int) getpid() );
+	if ( write( fd, owner, len ) != len ) {
+		perror( "Could not write key search claim" );
+		exit( EXIT_FAILURE );
+	}
+	close( fd );
+
+	/* Re-check, the shard might have been finished while we claimed it */
+	keysearch_path( path, sizeof path, ks, shard, "done" );
+	return access( path, F_OK ) != 0;
+}
+
+static uint32_t keysearch_load_ckpt( keysearch_t *ks, uint32_t shard ) {
+	char path[4096], buf[32];
+	int nr;
+
+	keysearch_path( path, sizeof path, ks, shard, "ckpt" );
+	nr = try_read_file( path, buf, sizeof buf - 1 );
+	if ( nr <= 0 )
+		return 0;
+	buf[nr] = 0;
+
+	return strtoul( buf, NULL, 0 );
+}
+
+/**
+ * Saves the progress through a shard and renews the lease on it.
+ */
+static void keysearch_save_ckpt( keysearch_t *ks, uint32_t shard,
+                                 uint32_t offset ) {
+	char path[4096], tmp[4200], buf[32];
+	int len;
+
+	keysearch_path( path, sizeof path, ks, shard, "ckpt" );
+	snprintf( tmp, sizeof tmp, "%s.%d.tmp", path, (int) getpid() );
+	len = snprintf( buf, sizeof buf, "0x%08X\n", offset );
+	write_file( tmp, buf, len );
+	if ( rename( tmp, path ) ) {
+		perror( "Could not save key search checkpoint" );
+		exit( EXIT_FAILURE );
+	}
+
+	keysearch_path( path, sizeof path, ks, shard, "claim" );
+	utimensat( AT_FDCWD, path, NULL, 0 );
+}
+
+static void keysearch_finish( keysearch_t *ks, uint32_t shard ) {
+	char path[4096];
+
+	keysearch_path( path, sizeof path, ks, shard, "done" );
+	write_file( path, "", 0 );
+	keysearch_path( path, sizeof path, ks, shard, "ckpt" );
+	unlink( path );
+	keysearch_path( path, sizeof path, ks, shard, "claim" );
+	unlink( path );
+}
+
+/**
+ * Adds the rejection counters of a worker to the totals of this process.
+ */
+static void keysearch_count( keysearch_t *ks, uint64_t tested,
+                             uint64_t *rejected ) {
+	int i;
+
+	__atomic_add_fetch( &ks->tested, tested, __ATOMIC_RELAXED );
+	for ( i = 0; i < ks->stage_count; i++ ) {
+		__atomic_add_fetch( ks->rejected + i, rejected[i],
+		                    __ATOMIC_RELAXED );
+		rejected[i] = 0;
+	}
+}
+
+/**
+ * Runs an aligned block of KEYSEARCH_SLICE_BLOCK IVs through the leading
+ * stages of the cascade with the bitsliced cipher, and the survivors through
+ * the remaining stages one by one.
+ */
+static void keysearch_slice_block( keysearch_t *ks, uint32_t base,
+                                   uint64_t *rejected ) {
+	uint32_t iv[ SLICE_LANES ], key_idx, bit;
+	uint8_t pass[ SLICE_LANES ];
+	int l, icv_stage, passed;
+
+	for ( icv_stage = 0; ks->stages[ icv_stage ]->test !=
+	                     keysearch_filter_msram_icv; icv_stage++ )
+		;
+
+	/* Walk all values of the key index bits */
+	for ( key_idx = 0; ; ) {
+		/* The first stage rejects every IV with an unknown key */
+		if ( !fprom_exists( key_idx ) ) {
+			rejected[0] += SLICE_LANES;
+		} else {
+			for ( l = 0; l < SLICE_LANES; l++ )
+				iv[l] = base | key_idx | ks->slice_lanes[l];
+			passed = bitslice_msram_icv( ks->stream, fprom_get( key_idx ),
+			                             iv, pass );
+			rejected[ icv_stage ] += SLICE_LANES - passed;
+			for ( l = 0; passed && l < SLICE_LANES; l++ ) {
+				if ( pass[l] && keysearch_test( ks, iv[l],
+				                 ks->slice_stages, rejected ) )
+					keysearch_report( ks, iv[l] );
+			}
+		}
+
+		/* Increment the key index within the bits of its mask */
+		bit = ( key_idx | ~IV_KEY_INDEX_MASK ) + 1;
+		if ( !( bit & IV_KEY_INDEX_MASK ) )
+			break;
+		key_idx = bit & IV_KEY_INDEX_MASK;
+	}
+}
+
+static void keysearch_shard( keysearch_t *ks, uint32_t shard ) {
+	uint64_t rejected[ KEYSEARCH_MAX_STAGES ];
+	uint32_t offset, start;
+
+	memset( rejected, 0, sizeof rejected );
+
+	start = keysearch_load_ckpt( ks, shard );
+	for ( offset = start; offset < KEYSEARCH_SHARD_SIZE; offset++ ) {
+		if ( ks->slice_stages &&
+		     offset % KEYSEARCH_SLICE_BLOCK == 0 ) {
+			keysearch_slice_block( ks,
+			        ( shard << KEYSEARCH_SHARD_BITS ) | offset, rejected );
+			offset += KEYSEARCH_SLICE_BLOCK - 1;
+		} else if ( keysearch_test( ks,
+		                    ( shard << KEYSEARCH_SHARD_BITS ) | offset, 0,
+		                    rejected ) ) {
+			keysearch_report( ks,
+			                  ( shard << KEYSEARCH_SHARD_BITS ) | offset );
+		}
+		if ( ( offset + 1 ) % KEYSEARCH_CKPT_INTERVAL == 0 ) {
+			keysearch_save_ckpt( ks, shard, offset + 1 );
+			keysearch_count( ks, offset + 1 - start, rejected );
+			start = offset + 1;
+		}
+	}
+
+	keysearch_count( ks, offset - start, rejected );
+	keysearch_finish( ks, shard );
+}
+
+/**
+ * Worker thread, pinned to a CPU, that keeps claiming and searching shards
+ * until there are none left.
+ */
+static void keysearch_worker( void *_ks, int idx ) {
+	keysearch_t *ks = _ks;
+	cpu_set_t set;
+	uint32_t first, i, shard;
+
+	CPU_ZERO( &set );
+	CPU_SET( ks->cpus[ idx % ks->cpu_count ], &set );
+	pthread_setaffinity_np( pthread_self(), sizeof set, &set );
+
+	/* Spread the workers over the shards to avoid contending for claims */
+	first = ( (uint32_t) getpid() * 2654435761u + idx * 97 ) %
+	        KEYSEARCH_SHARD_COUNT;
+
+	for ( i = 0; i < KEYSEARCH_SHARD_COUNT; i++ ) {
+		shard = ( first + i ) % KEYSEARCH_SHARD_COUNT;
+		if ( keysearch_claim( ks, shard ) )
+			keysearch_shard( ks, shard );
+	}
+}
+
+/**
+ * Checks that the search directory is used to search for this patch.
+ */
+static void keysearch_check_target( keysearch_t *ks ) {
+	char path[4096], buf[128], cur[128];
+	int len, fd, nr;
+
+	len = snprintf( buf, sizeof buf, "proc_sig 0x%08X key_seed 0x%08X\n",
+	                ks->proc_sig, ks->seed );
+	snprintf( path, sizeof path, "%s/target", ks->dir );
+
+	fd = open( path, O_WRONLY | O_CREAT | O_EXCL, 0644 );
+	if ( fd >= 0 ) {
+		if ( write( fd, buf, len ) != len ) {
+			perror( "Could not write key search target" );
+			exit( EXIT_FAILURE );
+		}
+		close( fd );
+		return;
+	}
+
+	nr = try_read_file( path, cur, sizeof cur - 1 );
+	if ( nr != len || memcmp( cur, buf, len ) ) {
+		fprintf( stderr,
+		         "Key search directory %s is used for another patch\n",
+		         ks->dir );
+		exit( EXIT_FAILURE );
+	}
+}
+
+/**
+ * Searches for the base key of the processor a patch was made for. Found
+ * keys are printed and appended to candidates.txt in the search directory.
+ * Every IV runs through a cascade of filters, ordered from cheap to
+ * expensive, and the rejections of every stage are reported at the end.
+ * When the cascade starts with the key index and MSRAM ICV checks, these run
+ * bitsliced on SLICE_LANES IVs at a time.
+ * @param dir      The shared search directory
+ * @param patch    The encrypted patch to search the key for
+ * @param cascade  Comma separated filter names, NULL for the default
+ */
+void search_keys(
+	const char *dir,
+	const epatch_file_t *patch,
+	const char *cascade ) {
+	char path[4096];
+	keysearch_t ks;
+	cpu_set_t set;
+	uint64_t left;
+	int i, remaining;
+
+	memset( &ks, 0, sizeof ks );
+	ks.dir      = dir;
+	ks.patch    = patch;
+	ks.proc_sig = patch->header.proc_sig;
+	ks.seed     = patch->body.key_seed;
+
+	keysearch_parse_cascade( &ks, cascade );
+	keysearch_setup_slice( &ks );
+
+	if ( ks.slice_stages && !bitslice_selftest() ) {
+		fprintf( stderr, "Bitsliced cipher does not match the blockfunc\n" );
+		exit( EXIT_FAILURE );
+	}
+
+	patch_cipher_stream( &patch->body, ks.stream );
+
+	if ( mkdir( dir, 0755 ) && errno != EEXIST ) {
+		perror( "Could not create key search directory" );
+		exit( EXIT_FAILURE );
+	}
+
+	keysearch_check_target( &ks );
+
+	/* Pin the workers to the CPUs we are allowed to run on */
+	if ( sched_getaffinity( 0, sizeof set, &set ) == 0 ) {
+		for ( i = 0; i < CPU_SETSIZE; i++ ) {
+			if ( CPU_ISSET( i, &set ) )
+				ks.cpus[ ks.cpu_count++ ] = i;
+		}
+	}
+	if ( !ks.cpu_count )
+		ks.cpus[ ks.cpu_count++ ] = 0;
+
+	workpool_run( keysearch_worker, &ks, workpool_size() );
+
+	/* Shards can still be claimed by other workers */
+	for ( remaining = 0, i = 0; i < KEYSEARCH_SHARD_COUNT; i++ ) {
+		keysearch_path( path, sizeof path, &ks, i, "done" );
+		if ( access( path, F_OK ) )
+			remaining++;
+	}
+
+	printf( "Key search found %d candidates, %d shards remaining\n",
+	        ks.found, remaining );
+
+	/* Rejections of this process, by stage */
+	left = ks.tested;
+	for ( i = 0; i < ks.stage_count; i++ ) {
+		printf( "  %-10s %12llu tested %12llu rejected (%6.2f%%)\n",
+		        ks.stages[i]->name, (unsigned long long) left,
+		        (unsigned long long) ks.rejected[i],
+		        left ? 100.0 * ks.rejected[i] / left : 0.0 );
+		left -= ks.rejected[i];
+	}
+}
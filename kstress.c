@@ -0,0 +1,358 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "crypto.h"
+#include "patchtools.h"
+#include "patchfile.h"
+
+/**
+ * Stress test of every blockfunc implementation compiled into the program
+ * against crypto_c_blockfunc. All pairs of edge case states and keys, those
+ * that exercise the rotate and the conditional XOR at their limits, are
+ * checked first, followed by random pairs on every worker thread until the
+ * requested number of pairs has been checked or a kernel disagrees.
+ */
+
+/** Pairs checked per kernel call, a full batch of bitsliced lanes */
+#define KSTRESS_BATCH     (SLICE_LANES)
+
+/** Random keys that are reused, so the JIT kernel can compile them */
+#define KSTRESS_POOL      (256)
+
+/** Random pairs checked when no count is given */
+#define KSTRESS_DEFAULT_PAIRS (1ull << 32)
+
+typedef struct {
+	const char *name;
+	/* Returns zero if the kernel can not handle this key right now */
+	int       (*run)( uint32_t *out, const uint32_t *state, uint32_t key );
+} kstress_kernel_t;
+
+static int kstress_c( uint32_t *out, const uint32_t *state, uint32_t key ) {
+	int i;
+
+	for ( i = 0; i < KSTRESS_BATCH; i++ )
+		out[i] = crypto_c_blockfunc( state[i], key );
+	return 1;
+}
+
+#ifndef USE_C_BLOCKFUNC
+static int kstress_asm( uint32_t *out, const uint32_t *state, uint32_t key ) {
+	int i;
+
+	for ( i = 0; i < KSTRESS_BATCH; i++ )
+		out[i] = crypto_blockfunc( state[i], key );
+	return 1;
+}
+#endif
+
+/**
+ * A decrypt step of a zero word from a zero LastCWord is just the blockfunc.
+ */
+static int kstress_lanes( uint32_t *out, const uint32_t *state, uint32_t key ) {
+	crypto_lanes_ctx_t ctx;
+	crypto_lanes_t zero;
+	uint32_t keys[ CRYPTO_LANES ];
+	int i, l;
+
+	for ( l = 0; l < CRYPTO_LANES; l++ )
+		keys[l] = key;
+
+	for ( i = 0; i < KSTRESS_BATCH; i += CRYPTO_LANES ) {
+		crypto_lanes_init( &ctx, keys, state + i );
+		zero = ctx.state ^ ctx.state;
+		crypto_lanes_decrypt( &ctx, &zero );
+		memcpy( out + i, &ctx.state, sizeof ctx.state );
+	}
+	return 1;
+}
+
+static int kstress_bitslice( uint32_t *out, const uint32_t *state,
+                             uint32_t key ) {
+	slice_t s[32];
+
+	bitslice_load( s, state );
+	bitslice_blockfunc( s, key );
+	bitslice_store( out, s, 32 );
+	return 1;
+}
+
+static int kstress_jit( uint32_t *out, const uint32_t *state, uint32_t key ) {
+	crypto_jit_fn_t fn;
+	int i;
+
+	/* Keys are compiled once they have been asked for often enough */
+	for ( fn = NULL, i = 0; !fn && i < 16; i++ )
+		fn = crypto_jit_get( key );
+	if ( !fn )
+		return 0;
+
+	for ( i = 0; i < KSTRESS_BATCH; i++ )
+		out[i] = fn( state[i] );
+	return 1;
+}
+
+static const kstress_kernel_t kstress_kernels[] = {
+	{ "c",        kstress_c },
+#ifndef USE_C_BLOCKFUNC
+	{ "asm",      kstress_asm },
+#endif
+	{ "lanes",    kstress_lanes },
+	{ "bitslice", kstress_bitslice },
+	{ "jit",      kstress_jit }
+};
+
+#define KSTRESS_KERNEL_COUNT \
+	( sizeof kstress_kernels / sizeof kstress_kernels[0] )
+
+typedef struct {
+	uint64_t pairs;
+	uint64_t ns;
+} kstress_count_t;
+
+typedef struct {
+	uint64_t        per_worker;
+	uint32_t        pool[ KSTRESS_POOL ];
+	int             failed;
+	int             fail_kernel;
+	uint32_t        fail_state;
+	uint32_t        fail_key;
+	uint32_t        fail_got;
+	kstress_count_t counts[ KSTRESS_KERNEL_COUNT ];
+} kstress_t;
+
+static uint64_t kstress_ns( void ) {
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * The splitmix64 generator.
+ */
+static uint64_t kstress_rand( uint64_t *state ) {
+	uint64_t z;
+
+	z = ( *state += 0x9E3779B97F4A7C15ull );
+	z = ( z ^ ( z >> 30 ) ) * 0xBF58476D1CE4E5B9ull;
+	z = ( z ^ ( z >> 27 ) ) * 0x94D049BB133111EBull;
+	return z ^ ( z >> 31 );
+}
+
+/**
+ * Runs every kernel on a batch and compares it against the reference.
+ * @param counts   Per kernel counters of the calling worker
+ * @return         Zero if a kernel disagreed
+ */
+static int kstress_batch( kstress_t *ks, const uint32_t *state, uint32_t key,
+                          kstress_count_t *counts ) {
+	uint32_t ref[ KSTRESS_BATCH ], out[ KSTRESS_BATCH ];
+	uint64_t start;
+	int k, i;
+
+	kstress_c( ref, state, key );
+
+	for ( k = 1; k < KSTRESS_KERNEL_COUNT; k++ ) {
+		start = kstress_ns();
+		if ( !kstress_kernels[k].run( out, state, key ) )
+			continue;
+		counts[k].ns    += kstress_ns() - start;
+		counts[k].pairs += KSTRESS_BATCH;
+
+		for ( i = 0; i < KSTRESS_BATCH; i++ ) {
+			if ( out[i] == ref[i] )
+				continue;
+			if ( __atomic_exchange_n( &ks->failed, 1,
+			                          __ATOMIC_ACQ_REL ) )
+				return 0;
+			ks->fail_kernel = k;
+			ks->fail_state  = state[i];
+			ks->fail_key    = key;
+			ks->fail_got    = out[i];
+			return 0;
+		}
+	}
+
+	/* Time the reference separately, the comparisons need its output */
+	start = kstress_ns();
+	kstress_c( out, state, key );
+	counts[0].ns    += kstress_ns() - start;
+	counts[0].pairs += KSTRESS_BATCH;
+
+	return 1;
+}
+
+/**
+ * Adds the counters of a worker to the totals.
+ */
+static void kstress_merge( kstress_t *ks, kstress_count_t *counts ) {
+	int k;
+
+	for ( k = 0; k < KSTRESS_KERNEL_COUNT; k++ ) {
+		__atomic_add_fetch( &ks->counts[k].pairs, counts[k].pairs,
+		                    __ATOMIC_RELAXED );
+		__atomic_add_fetch( &ks->counts[k].ns, counts[k].ns,
+		                    __ATOMIC_RELAXED );
+	}
+}
+
+/**
+ * Builds the edge case values: zero, all ones, single bits, single holes and
+ * the values around the top and bottom bits.
+ * @return         The number of values
+ */
+static int kstress_edges( uint32_t *v ) {
+	int n = 0, b;
+
+	v[ n++ ] = 0;
+	v[ n++ ] = 0xFFFFFFFF;
+	v[ n++ ] = 0x7FFFFFFF;
+	v[ n++ ] = 0xFFFFFFFE;
+	v[ n++ ] = 0x80000001;
+	v[ n++ ] = 0x55555555;
+	v[ n++ ] = 0xAAAAAAAA;
+	for ( b = 0; b < 32; b++ ) {
+		v[ n++ ] = 1u << b;
+		v[ n++ ] = ~( 1u << b );
+	}
+
+	return n;
+}
+
+/**
+ * Checks all pairs of edge case states and keys.
+ */
+static int kstress_exhaustive( kstress_t *ks, kstress_count_t *counts ) {
+	uint32_t edges[ 80 ], state[ KSTRESS_BATCH ];
+	int n, k, s, i;
+
+	n = kstress_edges( edges );
+
+	for ( k = 0; k < n; k++ ) {
+		for ( s = 0; s < n; s += KSTRESS_BATCH ) {
+			/* Pad the batch by repeating the edge states */
+			for ( i = 0; i < KSTRESS_BATCH; i++ )
+				state[i] = edges[ ( s + i ) % n ];
+			if ( !kstress_batch( ks, state, edges[k], counts ) )
+				return 0;
+		}
+	}
+
+	return 1;
+}
+
+static void kstress_worker( void *_ks, int idx ) {
+	kstress_t *ks = _ks;
+	kstress_count_t counts[ KSTRESS_KERNEL_COUNT ];
+	uint32_t state[ KSTRESS_BATCH ], key;
+	uint64_t rng, done, r;
+	int i;
+
+	memset( counts, 0, sizeof counts );
+	rng = 0x6B73747265737300ull + idx;
+
+	for ( done = 0; done < ks->per_worker; done += KSTRESS_BATCH ) {
+		if ( __atomic_load_n( &ks->failed, __ATOMIC_RELAXED ) )
+			break;
+
+		/* Mix pooled keys, which the JIT kernel can compile, random
+		   keys and random keys with few or many bits set */
+		r = kstress_rand( &rng );
+		switch ( r & 3 ) {
+			case 0:
+				key = ks->pool[ ( r >> 8 ) % KSTRESS_POOL ];
+				break;
+			case 1:
+				key = ( r >> 32 ) & ( r >> 8 ) & ( r >> 16 );
+				break;
+			case 2:
+				key = ( r >> 32 ) | ( r >> 8 ) | ( r >> 16 );
+				break;
+			default:
+				key = r >> 32;
+				break;
+		}
+
+		for ( i = 0; i < KSTRESS_BATCH; i += 2 ) {
+			r = kstress_rand( &rng );
+			state[i]     = r;
+			state[i + 1] = r >> 32;
+		}
+
+		if ( !kstress_batch( ks, state, key, counts ) )
+			break;
+	}
+
+	kstress_merge( ks, counts );
+}
+
+/**
+ * Runs the kernel stress test and prints the throughput of every kernel.
+ * @param pairs    The number of random (state, key) pairs to check, 0 for
+ *                 the default
+ * @return         Non-zero if a kernel disagreed with crypto_c_blockfunc
+ */
+int kernel_stress( uint64_t pairs ) {
+	kstress_t ks;
+	kstress_count_t counts[ KSTRESS_KERNEL_COUNT ];
+	uint64_t rng = 0x706F6F6Cull;
+	uint32_t edges[ 80 ];
+	int k, n, threads;
+
+	memset( &ks, 0, sizeof ks );
+	memset( counts, 0, sizeof counts );
+
+	/* The pool starts with the edge keys and the FPROM entries */
+	n = kstress_edges( edges );
+	for ( k = 0; k < KSTRESS_POOL; k++ ) {
+		if ( k < n )
+			ks.pool[k] = edges[k];
+		else if ( fprom_exists( k - n ) )
+			ks.pool[k] = fprom_get( k - n );
+		else
+			ks.pool[k] = kstress_rand( &rng );
+	}
+
+	/* Compile the pool before random keys fill the JIT cache */
+	for ( k = 0; k < KSTRESS_POOL; k++ )
+		for ( n = 0; n < 16; n++ )
+			crypto_jit_get( ks.pool[k] );
+
+	if ( !pairs )
+		pairs = KSTRESS_DEFAULT_PAIRS;
+
+	threads = workpool_size();
+	ks.per_worker = ( pairs + threads - 1 ) / threads;
+
+	printf( "Checking %d kernels against crypto_c_blockfunc on %d threads\n",
+	        (int) KSTRESS_KERNEL_COUNT - 1, threads );
+	fflush( stdout );
+
+	if ( kstress_exhaustive( &ks, counts ) ) {
+		kstress_merge( &ks, counts );
+		workpool_run( kstress_worker, &ks, threads );
+	}
+
+	if ( ks.failed ) {
+		printf( "Kernel %s disagrees for state 0x%08X key 0x%08X: "
+		        "got 0x%08X, expected 0x%08X\n",
+		        kstress_kernels[ ks.fail_kernel ].name,
+		        ks.fail_state, ks.fail_key, ks.fail_got,
+		        crypto_c_blockfunc( ks.fail_state, ks.fail_key ) );
+		return 1;
+	}
+
+	for ( k = 0; k < KSTRESS_KERNEL_COUNT; k++ ) {
+		printf( "  %-10s %14llu pairs %10.2f Mpairs/s per thread\n",
+		        kstress_kernels[k].name,
+		        (unsigned long long) ks.counts[k].pairs,
+		        ks.counts[k].ns ?
+		        1e3 * ks.counts[k].pairs / ks.counts[k].ns : 0.0 );
+	}
+
+	printf( "All kernels agree\n" );
+	return 0;
+}
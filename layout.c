@@ -0,0 +1,416 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include "rotate.h"
+#include "crypto.h"
+#include "patchtools.h"
+#include "patchfile.h"
+#include "stats.h"
+#include "trace.h"
+
+#define LAYOUT_MAX_COUNT  (256)
+#define LAYOUT_MAX_WORDS  (0x10000)
+#define PROBE_ROTATIONS   (CPUID_STEPPING_MASK + 1)
+
+/** The layout of epatch_body_t */
+const patch_layout_t patch_layout_default = {
+	.name               = "default",
+	.msram_dword_count  = MSRAM_DWORD_COUNT,
+	.msram_base         = MSRAM_BASE_ADDRESS,
+	.msram_icv_interval = 0,
+	.msram_pad          = 1,
+	.cr_op_count        = PATCH_CR_OP_COUNT,
+	.cr_op_words        = 3,
+	.iv_key_mask        = IV_KEY_INDEX_MASK,
+	.icv_mask           = INTEGRITY_INDEX_MASK
+};
+
+/** Variations on the default layout probed when no layout file is given */
+static const struct {
+	const char *name;
+	int         msram_icv_interval;
+	int         msram_pad;
+	uint32_t    iv_key_mask;
+} layout_guesses[] = {
+	{ "nopad",         -1,               0,  0    },
+	{ "grouped",       MSRAM_GROUP_SIZE, -1, 0    },
+	{ "grouped-nopad", MSRAM_GROUP_SIZE, 0,  0    },
+	{ "ivmask-ff",     -1,               -1, 0xFF }
+};
+
+#define LAYOUT_GUESS_COUNT \
+	( 1 + sizeof layout_guesses / sizeof layout_guesses[0] )
+
+/** Fields that can be set in a layout file */
+static const struct {
+	const char *name;
+	size_t      offset;
+} layout_fields[] = {
+	{ "msram",        offsetof( patch_layout_t, msram_dword_count ) },
+	{ "msram_base",   offsetof( patch_layout_t, msram_base ) },
+	{ "icv_interval", offsetof( patch_layout_t, msram_icv_interval ) },
+	{ "msram_pad",    offsetof( patch_layout_t, msram_pad ) },
+	{ "cr_ops",       offsetof( patch_layout_t, cr_op_count ) },
+	{ "cr_op_words",  offsetof( patch_layout_t, cr_op_words ) },
+	{ "iv_mask",      offsetof( patch_layout_t, iv_key_mask ) },
+	{ "icv_mask",     offsetof( patch_layout_t, icv_mask ) }
+};
+
+typedef struct {
+	int           status;
+	int           checked;
+	uint32_t      iv;
+} probe_result_t;
+
+typedef struct {
+	const uint32_t       *words;
+	int                   word_count;
+	uint32_t              proc_sig;
+	uint32_t              seed;
+	const patch_layout_t *layouts;
+	int                   layout_count;
+	const cpukey_t       *keys;
+	int                   key_count;
+	probe_result_t       *results;
+} probe_t;
+
+static char layout_line_buf[4096];
+
+/**
+ * Computes the number of ICVs in a patch body with the given layout.
+ */
+static int layout_icv_count( const patch_layout_t *layout ) {
+	int icvs;
+
+	if ( layout->msram_icv_interval > 0 )
+		icvs = ( layout->msram_dword_count +
+		         layout->msram_icv_interval - 1 ) /
+		       layout->msram_icv_interval;
+	else
+		icvs = 1;
+
+	return icvs + layout->cr_op_count;
+}
+
+/**
+ * Computes the number of encrypted words, including ICVs and padding, of a
+ * patch body with the given layout.
+ */
+int layout_word_count( const patch_layout_t *layout ) {
+	return layout->msram_dword_count + layout_icv_count( layout ) +
+	       layout->msram_pad + layout->cr_op_count * layout->cr_op_words;
+}
+
+/**
+ * Decrypts and validates an ICV using the masks of a layout.
+ * @param pt       Output parameter for the decrypted ICV
+ * @param checked  Incremented when the ICV could be checked
+ */
+static int layout_verify_icv(
+	const patch_layout_t *layout,
+	uint32_t ct,
+	uint32_t *pt,
+	int *checked ) {
+	uint32_t integrity_idx;
+
+	integrity_idx = crypto_getstate() & layout->icv_mask;
+	TRACE_ICV( integrity_idx );
+	*pt = crypto_decrypt( ct );
+
+	if ( !fprom_exists( integrity_idx ) )
+		return DECRYPT_MISSING_FPROM;
+
+	(*checked)++;
+	if ( *pt != fprom_get( integrity_idx ) ) {
+		STAT_INC( icv_fail );
+		return DECRYPT_BAD_ICV;
+	}
+
+	STAT_INC( icv_pass );
+	return DECRYPT_OK;
+}
+
+/**
+ * Decrypts the encrypted words of a patch body with an arbitrary layout.
+ * @param out      The buffer to write the decrypted words to, padding words
+ *                 are copied unchanged. Must hold layout_word_count words.
+ * @param in       The encrypted words, following the key seed
+ * @param layout   The layout of the patch body
+ * @param iv       The initialization vector to use.
+ * @param key      The key to use.
+ * @param checked  Output parameter for the number of ICVs that were checked
+ * @return         The DECRYPT_ flags of all ICVs in the patch combined
+ */
+int decrypt_layout(
+	uint32_t *out,
+	const uint32_t *in,
+	const patch_layout_t *layout,
+	uint32_t iv,
+	uint32_t key,
+	int *checked ) {
+	int i, j, p, status, last;
+
+	*checked = 0;
+	status = DECRYPT_OK;
+	p = 0;
+
+	crypto_init( key, iv );
+
+	/* MSRAM contents, with their ICVs */
+	for ( i = 0; i < layout->msram_dword_count; i++ ) {
+		out[p] = crypto_decrypt( in[p] );
+		p++;
+		last = i + 1 == layout->msram_dword_count;
+		if ( !last && ( layout->msram_icv_interval <= 0 ||
+		                ( i + 1 ) % layout->msram_icv_interval ) )
+			continue;
+		status |= layout_verify_icv( layout, in[p], out + p, checked );
+		p++;
+	}
+
+	for ( i = 0; i < layout->msram_pad; i++, p++ )
+		out[p] = in[p];
+
+	/* Control register operations, each followed by an ICV */
+	for ( i = 0; i < layout->cr_op_count; i++ ) {
+		for ( j = 0; j < layout->cr_op_words; j++, p++ )
+			out[p] = crypto_decrypt( in[p] );
+		status |= layout_verify_icv( layout, in[p], out + p, checked );
+		p++;
+	}
+
+	return status;
+}
+
+/**
+ * Builds the default layout and its variations in layout_guesses, fields
+ * that are -1 or 0 there are kept from the default layout.
+ */
+static void guess_layouts( patch_layout_t *layouts ) {
+	patch_layout_t *l;
+	int i;
+
+	layouts[0] = patch_layout_default;
+	for ( i = 1; i < LAYOUT_GUESS_COUNT; i++ ) {
+		l  = layouts + i;
+		*l = patch_layout_default;
+		l->name = layout_guesses[ i - 1 ].name;
+		if ( layout_guesses[ i - 1 ].msram_icv_interval >= 0 )
+			l->msram_icv_interval =
+				layout_guesses[ i - 1 ].msram_icv_interval;
+		if ( layout_guesses[ i - 1 ].msram_pad >= 0 )
+			l->msram_pad = layout_guesses[ i - 1 ].msram_pad;
+		if ( layout_guesses[ i - 1 ].iv_key_mask )
+			l->iv_key_mask = layout_guesses[ i - 1 ].iv_key_mask;
+	}
+}
+
+/**
+ * Reads layout descriptors from a file. Every line describes one layout as
+ * its name followed by the fields that differ from the default layout:
+ *
+ *     <name> [<field>=<value> ...]
+ *
+ * Where <field> is one of msram, msram_base, icv_interval, msram_pad, cr_ops,
+ * cr_op_words, iv_mask and icv_mask.
+ * @return         The number of layouts read
+ */
+static int read_layouts( patch_layout_t *layouts, const char *filename ) {
+	FILE *file;
+	patch_layout_t *l;
+	char *par_n, *par_v, *val, *save;
+	int count, i;
+
+	file = fopen( filename, "r" );
+	if ( !file ) {
+		perror( "Could not open layout input file" );
+		exit( EXIT_FAILURE );
+	}
+
+	count = 0;
+	while ( fgets( layout_line_buf, sizeof layout_line_buf, file ) ) {
+		par_n = strtok_r( layout_line_buf, " \t\n", &save );
+		if ( !par_n || par_n[0] == '#' )
+			continue;
+
+		if ( count >= LAYOUT_MAX_COUNT ) {
+			fprintf( stderr, "Too many layouts\n" );
+			exit( EXIT_FAILURE );
+		}
+		l = layouts + count++;
+		memcpy( l, &patch_layout_default, sizeof(patch_layout_t) );
+		l->name = strdup( par_n );
+
+		while ( ( par_v = strtok_r( NULL, " \t\n", &save ) ) ) {
+			val = strchr( par_v, '=' );
+			if ( val )
+				*val++ = 0;
+			for ( i = 0; val && i < sizeof layout_fields /
+			                       sizeof layout_fields[0]; i++ ) {
+				if ( strcmp( par_v, layout_fields[i].name ) )
+					continue;
+				*(uint32_t *)( (char *) l + layout_fields[i].offset ) =
+					strtoul( val, NULL, 0 );
+				break;
+			}
+			if ( !val || i == sizeof layout_fields /
+			                  sizeof layout_fields[0] ) {
+				fprintf( stderr, "Invalid layout field \"%s\"\n",
+				         par_v );
+				exit( EXIT_FAILURE );
+			}
+		}
+
+		/* Bound every count first so the word count can not overflow */
+		if ( (unsigned) l->msram_dword_count > LAYOUT_MAX_WORDS ||
+		     (unsigned) l->msram_icv_interval > LAYOUT_MAX_WORDS ||
+		     (unsigned) l->msram_pad > LAYOUT_MAX_WORDS ||
+		     (unsigned) l->cr_op_count > LAYOUT_MAX_WORDS ||
+		     (unsigned) l->cr_op_words > LAYOUT_MAX_WORDS ||
+		     layout_word_count( l ) > LAYOUT_MAX_WORDS ) {
+			fprintf( stderr, "Invalid layout \"%s\"\n", l->name );
+			exit( EXIT_FAILURE );
+		}
+	}
+
+	fclose( file );
+	return count;
+}
+
+/**
+ * Tests a single layout, key and rotation hypothesis.
+ */
+static void probe_worker( void *_probe, int idx ) {
+	probe_t *probe = _probe;
+	probe_result_t *res = probe->results + idx;
+	const patch_layout_t *layout;
+	const cpukey_t *key;
+	uint32_t *out, key_idx;
+	int rot;
+
+	layout = probe->layouts + idx / ( probe->key_count * PROBE_ROTATIONS );
+	key    = probe->keys + ( idx / PROBE_ROTATIONS ) % probe->key_count;
+	rot    = idx % PROBE_ROTATIONS;
+
+	/* Same key derivation as derive_key, with the stepping rotation and
+	 * key index mask being part of the hypothesis */
+	res->iv = rotl32( key->base, rot ) + 6 + probe->seed;
+	key_idx = res->iv & layout->iv_key_mask;
+
+	res->status = DECRYPT_MISSING_FPROM;
+	if ( layout_word_count( layout ) > probe->word_count ||
+	     !fprom_exists( key_idx ) )
+		return;
+
+	out = malloc( layout_word_count( layout ) * sizeof(uint32_t) );
+	if ( !out ) {
+		perror( "Could not allocate probe buffer" );
+		exit( EXIT_FAILURE );
+	}
+
+	res->status = decrypt_layout( out, probe->words, layout, res->iv,
+	                              fprom_get( key_idx ), &res->checked );
+
+	free( out );
+}
+
+/**
+ * Tests every combination of patch layout, known key and stepping rotation
+ * against an encrypted patch, and prints the ones for which all ICVs that can
+ * be checked are valid.
+ * @param data        The encrypted patch file
+ * @param size        The size of the patch file
+ * @param layout_file A file with the layouts to try, or NULL to try a list of
+ *                    variations on the default layout.
+ */
+void probe_patch( const void *data, size_t size, const char *layout_file ) {
+	patch_layout_t *layouts = NULL, guesses[ LAYOUT_GUESS_COUNT ];
+	const patch_layout_t *layout;
+	const cpukey_t *key;
+	patch_hdr_t hdr;
+	probe_result_t *res;
+	uint32_t known, prefix[2];
+	probe_t probe;
+	int i, count, matches, has_known;
+
+	if ( size < sizeof(patch_hdr_t) + sizeof prefix ) {
+		fprintf( stderr, "Patch file is too short to probe\n" );
+		exit( EXIT_FAILURE );
+	}
+
+	memset( &probe, 0, sizeof probe );
+	memcpy( &hdr, data, sizeof hdr );
+	memcpy( prefix, (const uint8_t *) data + sizeof hdr, sizeof prefix );
+
+	probe.proc_sig   = hdr.proc_sig;
+	probe.seed       = prefix[0];
+	probe.word_count = ( size - sizeof hdr - sizeof prefix ) /
+	                   sizeof(uint32_t);
+	probe.words      = malloc( probe.word_count * sizeof(uint32_t) + 1 );
+	if ( !probe.words ) {
+		perror( "Could not allocate probe input" );
+		exit( EXIT_FAILURE );
+	}
+	memcpy( (uint32_t *) probe.words,
+	        (const uint8_t *) data + sizeof hdr + sizeof prefix,
+	        probe.word_count * sizeof(uint32_t) );
+
+	if ( layout_file ) {
+		layouts = calloc( LAYOUT_MAX_COUNT, sizeof(patch_layout_t) );
+		if ( !layouts ) {
+			perror( "Could not allocate layouts" );
+			exit( EXIT_FAILURE );
+		}
+		probe.layouts      = layouts;
+		probe.layout_count = read_layouts( layouts, layout_file );
+	} else {
+		guess_layouts( guesses );
+		probe.layouts      = guesses;
+		probe.layout_count = LAYOUT_GUESS_COUNT;
+	}
+
+	probe.keys = cpukeys_list( &probe.key_count );
+	has_known  = cpukeys_lookup( probe.proc_sig, &known );
+
+	count = probe.layout_count * probe.key_count * PROBE_ROTATIONS;
+	probe.results = calloc( count, sizeof(probe_result_t) );
+	if ( !probe.results ) {
+		perror( "Could not allocate probe results" );
+		exit( EXIT_FAILURE );
+	}
+
+	workpool_run( probe_worker, &probe, count );
+
+	matches = 0;
+	for ( i = 0; i < count; i++ ) {
+		res = probe.results + i;
+		if ( ( res->status & DECRYPT_BAD_ICV ) || !res->checked )
+			continue;
+
+		layout = probe.layouts + i / ( probe.key_count * PROBE_ROTATIONS );
+		key    = probe.keys + ( i / PROBE_ROTATIONS ) % probe.key_count;
+
+		printf( "layout %-16s key %-14s base 0x%08X rotate %2d "
+		        "iv 0x%08X icvs %d/%d%s\n",
+		        layout->name, key->name, key->base,
+		        i % PROBE_ROTATIONS, res->iv, res->checked,
+		        layout_icv_count( layout ),
+		        has_known && key->base == known &&
+		        i % PROBE_ROTATIONS ==
+		            ( probe.proc_sig & CPUID_STEPPING_MASK ) ?
+		            " (current)" : "" );
+		matches++;
+	}
+
+	printf( "Probed %d hypotheses, %d matched\n", count, matches );
+
+	if ( layouts ) {
+		for ( i = 0; i < probe.layout_count; i++ )
+			free( (char *) layouts[i].name );
+		free( layouts );
+	}
+	free( probe.results );
+	free( (uint32_t *) probe.words );
+}
@@ -0,0 +1,250 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <libgen.h>
+#include "patchtools.h"
+#include "patchfile.h"
+
+/**
+ * Bulk patch creation from a manifest. Every line of a manifest describes a
+ * patch to build:
+ *
+ *     <config> <output> [<seed> [<proc_sig>]]
+ *
+ * The seed and processor signature override the ones in the config, a seed
+ * of - keeps the one from the config. Relative paths are relative to the
+ * directory of the manifest, empty lines and lines starting with # are
+ * ignored.
+ *
+ * Every entry is built by a worker thread using the parsers that report
+ * malformed input instead of exiting, so a failing entry only records its
+ * error message for the summary. Outputs are renamed into place once
+ * written, an entry that fails never leaves a truncated patch behind.
+ */
+
+#define MANIFEST_ERROR_SIZE (256)
+
+typedef struct {
+	int       line;
+	char     *config;
+	char     *output;
+	int       has_seed;
+	uint32_t  seed;
+	int       has_sig;
+	uint32_t  proc_sig;
+	int       ok;
+	uint32_t  used_seed;
+	char      error[ MANIFEST_ERROR_SIZE ];
+} manifest_entry_t;
+
+typedef struct {
+	manifest_entry_t *entries;
+	int               count;
+} manifest_t;
+
+/**
+ * Makes a manifest path relative to the manifest directory.
+ */
+static char *manifest_join( const char *dir, const char *path ) {
+	char *out;
+
+	if ( path[0] == '/' )
+		out = strdup( path );
+	else if ( asprintf( &out, "%s/%s", dir, path ) < 0 )
+		out = NULL;
+
+	if ( !out ) {
+		perror( "Could not allocate manifest path" );
+		exit( EXIT_FAILURE );
+	}
+
+	return out;
+}
+
+/**
+ * Reads a manifest, exiting with an error if it is malformed.
+ */
+static void manifest_read( manifest_t *m, const char *path ) {
+	char *line = NULL, *fields[4], *tok, *save, *buf, *dir, *end;
+	manifest_entry_t *e;
+	size_t size = 0;
+	int n, lineno, cap = 0;
+	FILE *file;
+
+	file = fopen( path, "r" );
+	if ( !file ) {
+		perror( "Could not open manifest" );
+		exit( EXIT_FAILURE );
+	}
+
+	buf = strdup( path );
+	if ( !buf ) {
+		perror( "Could not allocate manifest path" );
+		exit( EXIT_FAILURE );
+	}
+	dir = dirname( buf );
+
+	for ( lineno = 1; getline( &line, &size, file ) >= 0; lineno++ ) {
+		for ( n = 0, tok = strtok_r( line, " \t\r\n", &save ); tok;
+		      tok = strtok_r( NULL, " \t\r\n", &save ), n++ )
+			if ( n < 4 )
+				fields[n] = tok;
+		if ( n == 0 || fields[0][0] == '#' )
+			continue;
+		if ( n < 2 || n > 4 ) {
+			fprintf( stderr, "%s:%d: expected <config> <output> "
+			         "[<seed> [<proc_sig>]]\n", path, lineno );
+			exit( EXIT_FAILURE );
+		}
+
+		if ( m->count == cap ) {
+			cap = cap ? cap * 2 : 64;
+			m->entries = realloc( m->entries, cap * sizeof *e );
+			if ( !m->entries ) {
+				perror( "Could not allocate manifest" );
+				exit( EXIT_FAILURE );
+			}
+		}
+
+		e = m->entries + m->count++;
+		memset( e, 0, sizeof *e );
+		e->line   = lineno;
+		e->config = manifest_join( dir, fields[0] );
+		e->output = manifest_join( dir, fields[1] );
+
+		if ( n > 2 && strcmp( fields[2], "-" ) ) {
+			e->has_seed = 1;
+			e->seed     = strtoul( fields[2], &end, 0 );
+			if ( *end ) {
+				fprintf( stderr, "%s:%d: invalid seed: %s\n",
+				         path, lineno, fields[2] );
+				exit( EXIT_FAILURE );
+			}
+		}
+
+		if ( n > 3 ) {
+			e->has_sig  = 1;
+			e->proc_sig = strtoul( fields[3], &end, 0 );
+			if ( *end ) {
+				fprintf( stderr, "%s:%d: invalid processor "
+				         "signature: %s\n", path, lineno, fields[3] );
+				exit( EXIT_FAILURE );
+			}
+		}
+	}
+
+	free( line );
+	free( buf );
+	fclose( file );
+}
+
+/**
+ * Builds a single entry, recording the error message if it fails.
+ * @return         Zero on success, -1 if the entry failed
+ */
+static int manifest_build( manifest_entry_t *e ) {
+	epatch_file_t out;
+	patch_body_t body;
+	char *msram_fn = NULL, *dir = NULL, *path = NULL;
+	uint32_t seed = 0, base;
+	int status = -1;
+
+	memset( &out, 0, sizeof out );
+	memset( &body, 0, sizeof body );
+	if ( try_read_patch_config( &out.header, &body, e->config, &msram_fn,
+	                            &seed, e->error, sizeof e->error ) )
+		goto done;
+	if ( !msram_fn ) {
+		snprintf( e->error, sizeof e->error, "missing data path" );
+		goto done;
+	}
+
+	/* The MSRAM file is relative to the config */
+	dir  = strdup( e->config );
+	path = dir ? manifest_join( dirname( dir ), msram_fn ) : NULL;
+	if ( !path ) {
+		snprintf( e->error, sizeof e->error,
+		          "Could not allocate MSRAM path" );
+		goto done;
+	}
+	if ( try_read_msram_file( &body, path, e->error, sizeof e->error ) )
+		goto done;
+
+	if ( e->has_seed )
+		seed = e->seed;
+	if ( e->has_sig )
+		out.header.proc_sig = e->proc_sig;
+
+	if ( !cpukeys_lookup( out.header.proc_sig, &base ) ) {
+		snprintf( e->error, sizeof e->error,
+		          "Unknown cpu key for CPUID: %03X",
+		          out.header.proc_sig & 0xFFF );
+		goto done;
+	}
+
+	encrypt_patch_body( &out.body, &body, out.header.proc_sig, seed );
+	if ( try_write_file( e->output, &out, sizeof out ) ) {
+		snprintf( e->error, sizeof e->error,
+		          "Could not write %s: %s", e->output,
+		          strerror( errno ) );
+		goto done;
+	}
+
+	e->used_seed = out.body.key_seed;
+	status = 0;
+
+done:
+	free( path );
+	free( dir );
+	free( msram_fn );
+	return status;
+}
+
+/**
+ * Builds a manifest entry and records the outcome.
+ */
+static void manifest_worker( void *_m, int idx ) {
+	manifest_t *m = _m;
+	manifest_entry_t *e = m->entries + idx;
+
+	e->ok = manifest_build( e ) == 0;
+}
+
+/**
+ * Builds every patch listed in a manifest on the worker pool and prints a
+ * summary with the outcome of every entry.
+ * @param path     The manifest
+ * @return         The number of entries that failed
+ */
+int create_manifest( const char *path ) {
+	manifest_t m;
+	manifest_entry_t *e;
+	int i, failed;
+
+	memset( &m, 0, sizeof m );
+	manifest_read( &m, path );
+
+	workpool_run( manifest_worker, &m, m.count );
+
+	for ( failed = 0, i = 0; i < m.count; i++ ) {
+		e = m.entries + i;
+		if ( e->ok )
+			printf( "%4d ok      %s (seed 0x%08X)\n",
+			        e->line, e->output, e->used_seed );
+		else
+			printf( "%4d FAILED  %s: %s\n",
+			        e->line, e->config, e->error );
+		failed += !e->ok;
+		free( e->config );
+		free( e->output );
+	}
+
+	printf( "Built %d of %d patches, %d failed\n",
+	        m.count - failed, m.count, failed );
+
+	free( m.entries );
+	return failed;
+}
@@ -0,0 +1,262 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libgen.h>
+#include "patchtools.h"
+#include "patchfile.h"
+
+/**
+ * Merging of patches for the same processor. Every overlay is compared to
+ * the baseline patch, one MSRAM group and one control register op at a time,
+ * giving a bitmap of the groups and ops it modifies. An overlay replaces the
+ * groups and ops it modifies in the baseline. Two overlays that modify the
+ * same group or op differently conflict, as does a modified op that writes
+ * the same control register as another op of the merged patch. Conflicts are
+ * all reported before exiting, without producing a patch.
+ */
+
+/** A MSRAM group, compared as a whole */
+typedef uint32_t merge_group_t
+	__attribute__(( vector_size( MSRAM_GROUP_SIZE * sizeof(uint32_t) ) ));
+
+/** The addresses of all control register ops of a patch */
+typedef uint32_t merge_addr_t
+	__attribute__(( vector_size( PATCH_CR_OP_COUNT * sizeof(uint32_t) ) ));
+
+typedef struct {
+	const char   *path;
+	patch_hdr_t   header;
+	patch_body_t  body;
+	uint32_t      groups;
+	uint32_t      cr_ops;
+} merge_input_t;
+
+/**
+ * Loads an overlay, decrypting it if it is a patch file, or reading its
+ * config and MSRAM file otherwise.
+ */
+static void merge_load( merge_input_t *in ) {
+	epatch_file_t patch;
+	char *msram_fn, *dup, *path;
+	const char *ext;
+	uint32_t seed;
+
+	ext = strrchr( in->path, '.' );
+	if ( ext && strcmp( ext, ".dat" ) == 0 ) {
+		if ( try_read_file( in->path, &patch, sizeof patch ) !=
+		     sizeof patch ) {
+			fprintf( stderr, "Could not read patch %s\n", in->path );
+			exit( EXIT_FAILURE );
+		}
+		memcpy( &in->header, &patch.header, sizeof(patch_hdr_t) );
+		decrypt_patch_body( &in->body, &patch.body,
+		                    patch.header.proc_sig );
+		return;
+	}
+
+	read_patch_config( &in->header, &in->body, in->path, &msram_fn, &seed );
+	if ( !msram_fn ) {
+		fprintf( stderr, "%s: missing data path\n", in->path );
+		exit( EXIT_FAILURE );
+	}
+
+	/* The MSRAM file is relative to the config */
+	dup = strdup( in->path );
+	if ( !dup )
+		path = NULL;
+	else if ( msram_fn[0] == '/' )
+		path = strdup( msram_fn );
+	else if ( asprintf( &path, "%s/%s", dirname( dup ), msram_fn ) < 0 )
+		path = NULL;
+	if ( !path ) {
+		perror( "Could not allocate MSRAM path" );
+		exit( EXIT_FAILURE );
+	}
+
+	read_msram_file( &in->body, path );
+
+	free( path );
+	free( dup );
+	free( msram_fn );
+}
+
+/**
+ * Compares two MSRAM groups as vectors, reducing the lane comparison in
+ * place so no vector is passed by value.
+ */
+static int merge_group_differs( const uint32_t *a, const uint32_t *b ) {
+	merge_group_t va, vb, ne;
+	uint32_t r = 0;
+	int i;
+
+	memcpy( &va, a, sizeof va );
+	memcpy( &vb, b, sizeof vb );
+	ne = va != vb;
+	for ( i = 0; i < MSRAM_GROUP_SIZE; i++ )
+		r |= ne[i];
+
+	return r != 0;
+}
+
+static int merge_cr_op_differs( const patch_cr_op_t *a,
+                                const patch_cr_op_t *b ) {
+	return a->address != b->address || a->mask != b->mask ||
+	       a->value != b->value;
+}
+
+/**
+ * Computes the bitmaps of the groups and control register ops an overlay
+ * modifies.
+ */
+static void merge_diff( merge_input_t *in, const patch_body_t *base ) {
+	int g, i;
+
+	in->groups = 0;
+	for ( g = 0; g < MSRAM_GROUP_COUNT; g++ )
+		if ( merge_group_differs( in->body.msram + g * MSRAM_GROUP_SIZE,
+		                          base->msram + g * MSRAM_GROUP_SIZE ) )
+			in->groups |= 1u << g;
+
+	in->cr_ops = 0;
+	for ( i = 0; i < PATCH_CR_OP_COUNT; i++ )
+		if ( merge_cr_op_differs( in->body.cr_ops + i, base->cr_ops + i ) )
+			in->cr_ops |= 1u << i;
+}
+
+/**
+ * Reports the groups and ops modified differently by two overlays.
+ * @return         The number of conflicts
+ */
+static int merge_overlaps( const merge_input_t *a, const merge_input_t *b ) {
+	uint32_t both;
+	int conflicts = 0, i;
+
+	/* Only groups both modify can differ, identical changes are fine */
+	for ( both = a->groups & b->groups; both; both &= both - 1 ) {
+		i = __builtin_ctz( both );
+		if ( !merge_group_differs( a->body.msram + i * MSRAM_GROUP_SIZE,
+		                           b->body.msram + i * MSRAM_GROUP_SIZE ) )
+			continue;
+		fprintf( stderr, "MSRAM group %d is modified by both %s and %s\n",
+		         i, a->path, b->path );
+		conflicts++;
+	}
+
+	for ( both = a->cr_ops & b->cr_ops; both; both &= both - 1 ) {
+		i = __builtin_ctz( both );
+		if ( !merge_cr_op_differs( a->body.cr_ops + i, b->body.cr_ops + i ) )
+			continue;
+		fprintf( stderr, "CR op %d is modified by both %s and %s\n",
+		         i, a->path, b->path );
+		conflicts++;
+	}
+
+	return conflicts;
+}
+
+/**
+ * Reports modified control register ops of the merged patch that write the
+ * same register as another op, all addresses are compared at once.
+ * @param owner    The overlay that modified each op, NULL for the baseline
+ * @return         The number of conflicts
+ */
+static int merge_collisions( const patch_body_t *body,
+                             const merge_input_t **owner ) {
+	merge_addr_t addr, same;
+	int conflicts = 0, i, j;
+
+	for ( i = 0; i < PATCH_CR_OP_COUNT; i++ )
+		addr[i] = body->cr_ops[i].address;
+
+	for ( i = 0; i < PATCH_CR_OP_COUNT; i++ ) {
+		if ( !owner[i] )
+			continue;
+		same = addr == body->cr_ops[i].address;
+		for ( j = 0; j < PATCH_CR_OP_COUNT; j++ ) {
+			/* Report every pair once, and repeated ops are fine */
+			if ( !same[j] || j == i || ( owner[j] && j < i ) ||
+			     !merge_cr_op_differs( body->cr_ops + i,
+			                           body->cr_ops + j ) )
+				continue;
+			fprintf( stderr, "CR op %d from %s and CR op %d from %s "
+			         "both write register 0x%03X\n",
+			         i, owner[i]->path, j,
+			         owner[j] ? owner[j]->path : "the baseline",
+			         body->cr_ops[i].address );
+			conflicts++;
+		}
+	}
+
+	return conflicts;
+}
+
+/**
+ * Merges patches into a baseline patch, exiting with a list of the conflicts
+ * if they can not be merged.
+ * @param hdr      The header of the baseline
+ * @param body     The baseline body, receives the merged body
+ * @param paths    The patches to merge, encrypted .dat files or configs
+ * @param count    The number of patches to merge
+ */
+void merge_patches(
+	const patch_hdr_t *hdr,
+	patch_body_t *body,
+	char *const *paths,
+	int count ) {
+	const merge_input_t *owner[ PATCH_CR_OP_COUNT ];
+	merge_input_t *in;
+	uint32_t map;
+	int conflicts = 0, i, j, g;
+
+	in = calloc( count, sizeof *in );
+	if ( !in ) {
+		perror( "Could not allocate merge inputs" );
+		exit( EXIT_FAILURE );
+	}
+
+	for ( i = 0; i < count; i++ ) {
+		in[i].path = paths[i];
+		merge_load( in + i );
+		if ( in[i].header.proc_sig != hdr->proc_sig ) {
+			fprintf( stderr, "%s is for processor 0x%08X, "
+			         "not 0x%08X\n", paths[i],
+			         in[i].header.proc_sig, hdr->proc_sig );
+			exit( EXIT_FAILURE );
+		}
+		merge_diff( in + i, body );
+	}
+
+	for ( i = 0; i < count; i++ )
+		for ( j = i + 1; j < count; j++ )
+			conflicts += merge_overlaps( in + i, in + j );
+
+	/* Apply every overlay */
+	memset( owner, 0, sizeof owner );
+	for ( i = 0; i < count; i++ ) {
+		for ( map = in[i].groups; map; map &= map - 1 ) {
+			g = __builtin_ctz( map );
+			memcpy( body->msram + g * MSRAM_GROUP_SIZE,
+			        in[i].body.msram + g * MSRAM_GROUP_SIZE,
+			        MSRAM_GROUP_SIZE * sizeof(uint32_t) );
+		}
+		for ( map = in[i].cr_ops; map; map &= map - 1 ) {
+			j = __builtin_ctz( map );
+			body->cr_ops[j] = in[i].body.cr_ops[j];
+			owner[j] = in + i;
+		}
+		printf( "%s: MSRAM groups 0x%06X, CR ops 0x%04X\n",
+		        in[i].path, in[i].groups, in[i].cr_ops );
+	}
+
+	conflicts += merge_collisions( body, owner );
+
+	if ( conflicts ) {
+		fprintf( stderr, "Could not merge patches, %d conflict%s\n",
+		         conflicts, conflicts == 1 ? "" : "s" );
+		exit( EXIT_FAILURE );
+	}
+
+	free( in );
+}
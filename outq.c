@@ -0,0 +1,305 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+#include "patchtools.h"
+#include "stats.h"
+
+/** Number of queued files at which the queue is flushed automatically */
+#define OUTQ_MAX_PENDING (1024)
+
+/** Number of files submitted to the io_uring at once */
+#define OUTQ_RING_FILES  (64)
+
+#define OUTQ_MODE        (0644)
+
+/**
+ * A queued output file. The data is written to a temporary file next to the
+ * destination which is then renamed into place.
+ */
+typedef struct outq_ent {
+	struct outq_ent *next;
+	char            *path;
+	char            *tmp_path;
+	void            *data;
+	size_t           size;
+	const char      *failed_op;
+	int              error;
+} outq_ent_t;
+
+typedef struct {
+	outq_ent_t     **ents;
+	int              count;
+} outq_batch_t;
+
+static outq_ent_t *outq_head, **outq_tail = &outq_head;
+static int outq_pending;
+static unsigned int outq_seq;
+static pthread_mutex_t outq_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Writes a single queued file using plain system calls.
+ */
+static void outq_write_sync( void *_batch, int index ) {
+	outq_batch_t *batch = _batch;
+	outq_ent_t *ent = batch->ents[index];
+	size_t done;
+	ssize_t nw;
+	int fd;
+
+	fd = open( ent->tmp_path, O_WRONLY | O_CREAT | O_TRUNC, OUTQ_MODE );
+	if ( fd < 0 ) {
+		ent->failed_op = "open";
+		ent->error = errno;
+		return;
+	}
+
+	for ( done = 0; done < ent->size; done += nw ) {
+		nw = pwrite( fd, (char *) ent->data + done, ent->size - done, done );
+		if ( nw < 0 && errno == EINTR ) {
+			nw = 0;
+		} else if ( nw <= 0 ) {
+			ent->failed_op = "write";
+			ent->error = nw < 0 ? errno : EIO;
+			close( fd );
+			unlink( ent->tmp_path );
+			return;
+		}
+	}
+
+	if ( close( fd ) ) {
+		ent->failed_op = "close";
+		ent->error = errno;
+		unlink( ent->tmp_path );
+		return;
+	}
+
+	if ( rename( ent->tmp_path, ent->path ) ) {
+		ent->failed_op = "rename";
+		ent->error = errno;
+		unlink( ent->tmp_path );
+	}
+}
+
+#ifdef HAVE_LIBURING
+
+static const char *outq_ring_ops[] = { "open", "write", "close", "rename" };
+
+/**
+ * Writes a batch of queued files through io_uring. Every file is written by
+ * a linked chain of open, write, close and rename operations using direct
+ * descriptors, so that no per-file system calls are needed.
+ * @return         Zero on success, non-zero if io_uring is not usable.
+ */
+static int outq_write_ring( outq_batch_t *batch ) {
+	struct io_uring ring;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	outq_ent_t *ent;
+	int base, n, i, op, status;
+	uintptr_t tag;
+
+	if ( io_uring_queue_init( OUTQ_RING_FILES * 4, &ring, 0 ) < 0 )
+		return -1;
+
+	if ( io_uring_register_files_sparse( &ring, OUTQ_RING_FILES ) < 0 ) {
+		io_uring_queue_exit( &ring );
+		return -1;
+	}
+
+	for ( base = 0; base < batch->count; base += OUTQ_RING_FILES ) {
+		n = batch->count - base;
+		if ( n > OUTQ_RING_FILES )
+			n = OUTQ_RING_FILES;
+
+		for ( i = 0; i < n; i++ ) {
+			ent = batch->ents[ base + i ];
+
+			sqe = io_uring_get_sqe( &ring );
+			io_uring_prep_openat_direct( sqe, AT_FDCWD, ent->tmp_path,
+			       O_WRONLY | O_CREAT | O_TRUNC, OUTQ_MODE, i );
+			io_uring_sqe_set_flags( sqe, IOSQE_IO_LINK );
+			io_uring_sqe_set_data( sqe, (void *)(uintptr_t)( i * 4 ) );
+
+			sqe = io_uring_get_sqe( &ring );
+			io_uring_prep_write( sqe, i, ent->data, ent->size, 0 );
+			io_uring_sqe_set_flags( sqe,
+			                        IOSQE_IO_LINK | IOSQE_FIXED_FILE );
+			io_uring_sqe_set_data( sqe, (void *)(uintptr_t)( i * 4 + 1 ) );
+
+			sqe = io_uring_get_sqe( &ring );
+			io_uring_prep_close_direct( sqe, i );
+			io_uring_sqe_set_flags( sqe, IOSQE_IO_LINK );
+			io_uring_sqe_set_data( sqe, (void *)(uintptr_t)( i * 4 + 2 ) );
+
+			sqe = io_uring_get_sqe( &ring );
+			io_uring_prep_renameat( sqe, AT_FDCWD, ent->tmp_path,
+			                        AT_FDCWD, ent->path, 0 );
+			io_uring_sqe_set_data( sqe, (void *)(uintptr_t)( i * 4 + 3 ) );
+		}
+
+		status = io_uring_submit_and_wait( &ring, n * 4 );
+		if ( status < 0 ) {
+			io_uring_queue_exit( &ring );
+			return -1;
+		}
+
+		for ( i = 0; i < n * 4; i++ ) {
+			if ( io_uring_wait_cqe( &ring, &cqe ) < 0 )
+				break;
+			tag = (uintptr_t) io_uring_cqe_get_data( cqe );
+			ent = batch->ents[ base + tag / 4 ];
+			op  = tag % 4;
+
+			/* Report the first failure of a chain, the rest of
+			 * the chain is cancelled because of it */
+			if ( !ent->failed_op && cqe->res < 0 ) {
+				ent->failed_op = outq_ring_ops[op];
+				ent->error = -cqe->res;
+			} else if ( !ent->failed_op && op == 1 &&
+			            (size_t) cqe->res != ent->size ) {
+				ent->failed_op = outq_ring_ops[op];
+				ent->error = EIO;
+			}
+
+			io_uring_cqe_seen( &ring, cqe );
+		}
+	}
+
+	io_uring_queue_exit( &ring );
+
+	for ( i = 0; i < batch->count; i++ ) {
+		if ( batch->ents[i]->failed_op )
+			unlink( batch->ents[i]->tmp_path );
+	}
+
+	return 0;
+}
+
+#endif
+
+/**
+ * Writes a list of queued files and frees it.
+ * @return         The number of files that could not be written.
+ */
+static int outq_write_list( outq_ent_t *list, int count ) {
+	outq_batch_t batch;
+	outq_ent_t *ent, *next;
+	int i, failed;
+
+	if ( !count )
+		return 0;
+
+	STAT_TIMER( t );
+
+	batch.count = count;
+	batch.ents = calloc( count, sizeof(outq_ent_t *) );
+	if ( !batch.ents ) {
+		perror( "Could not allocate output queue" );
+		exit( EXIT_FAILURE );
+	}
+	for ( i = 0, ent = list; ent; ent = ent->next )
+		batch.ents[i++] = ent;
+
+#ifdef HAVE_LIBURING
+	if ( outq_write_ring( &batch ) )
+#endif
+		workpool_run( outq_write_sync, &batch, batch.count );
+
+	failed = 0;
+	for ( ent = list; ent; ent = next ) {
+		next = ent->next;
+		if ( ent->failed_op ) {
+			fprintf( stderr, "Could not %s output file %s: %s\n",
+			         ent->failed_op, ent->path, strerror( ent->error ) );
+			failed++;
+		}
+		free( ent->path );
+		free( ent->tmp_path );
+		free( ent->data );
+		free( ent );
+	}
+
+	free( batch.ents );
+
+	STAT_ELAPSED( io_ns, t );
+	return failed;
+}
+
+/**
+ * Queues a file to be written. The data is copied, the file will be written
+ * atomically on the next flush of the queue, which may happen immediately if
+ * many files are already queued.
+ * @param path     The path of the file
+ * @param data     The file contents
+ * @param size     The size of the file contents
+ */
+void outq_write( const char *path, const void *data, size_t size ) {
+	outq_ent_t *ent, *list;
+	int count;
+	size_t len;
+
+	ent = calloc( 1, sizeof(outq_ent_t) );
+	len = strlen( path ) + 32;
+	if ( ent ) {
+		ent->path = strdup( path );
+		ent->tmp_path = malloc( len );
+		ent->data = malloc( size ? size : 1 );
+	}
+	if ( !ent || !ent->path || !ent->tmp_path || !ent->data ) {
+		perror( "Could not allocate output queue entry" );
+		exit( EXIT_FAILURE );
+	}
+	memcpy( ent->data, data, size );
+	ent->size = size;
+
+	pthread_mutex_lock( &outq_lock );
+
+	snprintf( ent->tmp_path, len, "%s.%d.%u.tmp",
+	          path, (int) getpid(), outq_seq++ );
+	*outq_tail = ent;
+	outq_tail = &ent->next;
+
+	/* Write out the queue if it is getting long */
+	list = NULL;
+	count = 0;
+	if ( ++outq_pending >= OUTQ_MAX_PENDING ) {
+		list = outq_head;
+		count = outq_pending;
+		outq_head = NULL;
+		outq_tail = &outq_head;
+		outq_pending = 0;
+	}
+
+	pthread_mutex_unlock( &outq_lock );
+
+	if ( outq_write_list( list, count ) )
+		exit( EXIT_FAILURE );
+}
+
+/**
+ * Writes all queued files, exits with an error if any of them could not be
+ * written.
+ */
+void outq_flush( void ) {
+	outq_ent_t *list;
+	int count;
+
+	pthread_mutex_lock( &outq_lock );
+	list = outq_head;
+	count = outq_pending;
+	outq_head = NULL;
+	outq_tail = &outq_head;
+	outq_pending = 0;
+	pthread_mutex_unlock( &outq_lock );
+
+	if ( outq_write_list( list, count ) )
+		exit( EXIT_FAILURE );
+}
@@ -0,0 +1,395 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "patchtools.h"
+#include "patchfile.h"
+
+/** Free space at which a pack is compacted, if it is also a third of the file */
+#define PACK_COMPACT_MIN (64 * 1024)
+
+/** A range of a pack file that nothing on disk refers to */
+typedef struct {
+	uint64_t      offset;
+	uint64_t      size;
+} pack_gap_t;
+
+/**
+ * An open pack file. Packs opened for reading are mapped into memory as a
+ * whole, packs opened for writing keep their index in memory until they are
+ * closed.
+ *
+ * Writers never overwrite anything the header on disk refers to: new and
+ * replaced entries go into the free ranges of the file, left behind by old
+ * indexes and replaced entries, or are appended to it. The new index is
+ * placed the same way when the pack is closed, before the header is switched
+ * over to it. A writer that dies before closing the pack leaves the previous
+ * contents intact. Writers hold an exclusive lock on the file while it is
+ * open, and rewrite it without any free ranges once they make up too much of
+ * it.
+ */
+struct pack {
+	int           fd;
+	int           writable;
+	const char   *path;
+	uint8_t      *map;
+	size_t        map_size;
+	pack_hdr_t    hdr;
+	pack_index_t *index;
+	uint64_t      data_end;
+	pack_gap_t   *gaps;
+	int           gap_count;
+};
+
+static void pack_error( const pack_t *pack, const char *what ) {
+	fprintf( stderr, "Pack file %s: %s\n", pack->path, what );
+	exit( EXIT_FAILURE );
+}
+
+static void pack_pwrite( pack_t *pack, const void *data, size_t size,
+                         uint64_t offset ) {
+	if ( pwrite( pack->fd, data, size, offset ) != size )
+		pack_error( pack, strerror( errno ) );
+}
+
+/**
+ * Opens a pack file for reading, the file is mapped into memory so the
+ * entries can be accessed directly.
+ * @param path     The path of the pack file
+ * @return         The opened pack, exits with an error on failure.
+ */
+pack_t *pack_open( const char *path ) {
+	struct stat st;
+	pack_t *pack;
+
+	pack = calloc( 1, sizeof(pack_t) );
+	if ( !pack ) {
+		perror( "Could not allocate pack" );
+		exit( EXIT_FAILURE );
+	}
+	pack->path = path;
+
+	pack->fd = open( path, O_RDONLY );
+	if ( pack->fd < 0 || fstat( pack->fd, &st ) )
+		pack_error( pack, strerror( errno ) );
+	if ( st.st_size < sizeof(pack_hdr_t) )
+		pack_error( pack, "not a pack file" );
+
+	pack->map_size = st.st_size;
+	pack->map = mmap( NULL, pack->map_size, PROT_READ, MAP_SHARED,
+	                  pack->fd, 0 );
+	if ( pack->map == MAP_FAILED )
+		pack_error( pack, strerror( errno ) );
+
+	/* Entries are going to be read in order, most of the time */
+	madvise( pack->map, pack->map_size, MADV_SEQUENTIAL );
+
+	memcpy( &pack->hdr, pack->map, sizeof(pack_hdr_t) );
+	if ( pack->hdr.magic != PACK_MAGIC ||
+	     pack->hdr.version != PACK_VERSION )
+		pack_error( pack, "not a pack file" );
+	if ( pack->hdr.index_offset > pack->map_size ||
+	     ( pack->map_size - pack->hdr.index_offset ) /
+	       sizeof(pack_index_t) < pack->hdr.count )
+		pack_error( pack, "truncated index" );
+
+	pack->index = (pack_index_t *)( pack->map + pack->hdr.index_offset );
+
+	return pack;
+}
+
+static int pack_range_cmp( const void *_a, const void *_b ) {
+	const pack_gap_t *a = _a, *b = _b;
+
+	return a->offset < b->offset ? -1 : a->offset > b->offset;
+}
+
+/**
+ * Finds the ranges of a pack opened for writing that neither the header, the
+ * index nor any entry occupy. Anything after the last of them is free too.
+ */
+static void pack_find_gaps( pack_t *pack ) {
+	pack_gap_t *used;
+	uint64_t end;
+	int i, n;
+
+	n = pack->hdr.count + 1;
+	used = malloc( n * sizeof(pack_gap_t) );
+	pack->gaps = malloc( ( n + 1 ) * sizeof(pack_gap_t) );
+	if ( !used || !pack->gaps )
+		pack_error( pack, "could not allocate free list" );
+
+	for ( i = 0; i < pack->hdr.count; i++ ) {
+		used[i].offset = pack->index[i].offset;
+		used[i].size   = sizeof(pack_entry_t);
+	}
+	used[i].offset = pack->hdr.index_offset;
+	used[i].size   = pack->hdr.count * sizeof(pack_index_t);
+	qsort( used, n, sizeof(pack_gap_t), pack_range_cmp );
+
+	pack->gap_count = 0;
+	end = sizeof(pack_hdr_t);
+	for ( i = 0; i < n; i++ ) {
+		if ( used[i].offset > end ) {
+			pack->gaps[ pack->gap_count ].offset = end;
+			pack->gaps[ pack->gap_count ].size = used[i].offset - end;
+			pack->gap_count++;
+		}
+		if ( used[i].offset + used[i].size > end )
+			end = used[i].offset + used[i].size;
+	}
+	pack->data_end = end;
+
+	free( used );
+}
+
+/**
+ * Finds room for size bytes in a pack opened for writing, in the first free
+ * range that is large enough or at the end of the file.
+ * @return         The offset to write at
+ */
+static uint64_t pack_alloc( pack_t *pack, uint64_t size ) {
+	uint64_t offset;
+	int i;
+
+	for ( i = 0; i < pack->gap_count; i++ ) {
+		if ( pack->gaps[i].size < size )
+			continue;
+		offset = pack->gaps[i].offset;
+		pack->gaps[i].offset += size;
+		pack->gaps[i].size   -= size;
+		return offset;
+	}
+
+	offset = pack->data_end;
+	pack->data_end += size;
+	return offset;
+}
+
+/**
+ * Rewrites a pack opened for writing without free ranges, to a temporary file
+ * which then replaces it. The header on disk must already be up to date.
+ * @param index_size The size of the index
+ */
+static void pack_compact( pack_t *pack, uint64_t index_size ) {
+	pack_entry_t entry;
+	pack_hdr_t hdr;
+	char tmp_path[4096];
+	uint64_t offset;
+	int fd, i;
+
+	snprintf( tmp_path, sizeof tmp_path, "%s.%d.tmp", pack->path,
+	          (int) getpid() );
+	fd = open( tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+	if ( fd < 0 )
+		pack_error( pack, strerror( errno ) );
+
+	memcpy( &hdr, &pack->hdr, sizeof(pack_hdr_t) );
+	hdr.index_offset = sizeof(pack_hdr_t) +
+	                   (uint64_t) hdr.count * sizeof(pack_entry_t);
+
+	offset = sizeof(pack_hdr_t);
+	for ( i = 0; i < hdr.count; i++ ) {
+		if ( pread( pack->fd, &entry, sizeof entry,
+		            pack->index[i].offset ) != sizeof entry ||
+		     pwrite( fd, &entry, sizeof entry, offset ) != sizeof entry )
+			pack_error( pack, "could not compact" );
+		pack->index[i].offset = offset;
+		offset += sizeof entry;
+	}
+
+	if ( pwrite( fd, pack->index, index_size, offset ) != index_size ||
+	     pwrite( fd, &hdr, sizeof hdr, 0 ) != sizeof hdr ||
+	     fdatasync( fd ) || close( fd ) ||
+	     rename( tmp_path, pack->path ) ) {
+		unlink( tmp_path );
+		pack_error( pack, "could not compact" );
+	}
+}
+
+/**
+ * Opens a pack file for adding entries, creating it if it does not exist.
+ * The index is written when the pack is closed.
+ * @param path     The path of the pack file
+ * @return         The opened pack, exits with an error on failure.
+ */
+pack_t *pack_open_write( const char *path ) {
+	struct stat st, path_st;
+	pack_t *pack;
+	ssize_t nr;
+	size_t size;
+
+	pack = calloc( 1, sizeof(pack_t) );
+	if ( !pack ) {
+		perror( "Could not allocate pack" );
+		exit( EXIT_FAILURE );
+	}
+	pack->path = path;
+	pack->writable = 1;
+
+	/* Only one writer at a time, the lock is dropped when fd is closed.
+	   A writer that compacted the pack while we waited replaced the
+	   file, so lock the new one instead */
+	for ( ;; ) {
+		pack->fd = open( path, O_RDWR | O_CREAT, 0644 );
+		if ( pack->fd < 0 )
+			pack_error( pack, strerror( errno ) );
+		while ( flock( pack->fd, LOCK_EX ) )
+			if ( errno != EINTR )
+				pack_error( pack, strerror( errno ) );
+		if ( fstat( pack->fd, &st ) || stat( path, &path_st ) )
+			pack_error( pack, strerror( errno ) );
+		if ( st.st_dev == path_st.st_dev &&
+		     st.st_ino == path_st.st_ino )
+			break;
+		close( pack->fd );
+	}
+
+	nr = pread( pack->fd, &pack->hdr, sizeof(pack_hdr_t), 0 );
+	if ( nr == 0 ) {
+		/* New pack, entries start right after the header */
+		pack->hdr.magic = PACK_MAGIC;
+		pack->hdr.version = PACK_VERSION;
+		pack->hdr.index_offset = sizeof(pack_hdr_t);
+		/* Written right away, so the pack is valid even if the
+		   writer never gets to close it */
+		pack_pwrite( pack, &pack->hdr, sizeof(pack_hdr_t), 0 );
+	} else if ( nr != sizeof(pack_hdr_t) ||
+	            pack->hdr.magic != PACK_MAGIC ||
+	            pack->hdr.version != PACK_VERSION ) {
+		pack_error( pack, "not a pack file" );
+	}
+
+	size = pack->hdr.count * sizeof(pack_index_t);
+	pack->index = malloc( size ? size : 1 );
+	if ( !pack->index )
+		pack_error( pack, "could not allocate index" );
+	if ( pread( pack->fd, pack->index, size, pack->hdr.index_offset )
+	     != size )
+		pack_error( pack, "truncated index" );
+
+	pack_find_gaps( pack );
+
+	return pack;
+}
+
+/**
+ * Closes a pack file, writing the index if it was opened for writing. The
+ * header only points at the new index once the index and the entries are on
+ * disk.
+ */
+void pack_close( pack_t *pack ) {
+	uint64_t size, end, live;
+	int i;
+
+	if ( pack->writable ) {
+		size = pack->hdr.count * sizeof(pack_index_t);
+		pack->hdr.index_offset = pack_alloc( pack, size );
+		pack_pwrite( pack, pack->index, size, pack->hdr.index_offset );
+		if ( fdatasync( pack->fd ) )
+			pack_error( pack, strerror( errno ) );
+		pack_pwrite( pack, &pack->hdr, sizeof(pack_hdr_t), 0 );
+		if ( fdatasync( pack->fd ) )
+			pack_error( pack, strerror( errno ) );
+
+		/* Whatever follows the last entry or the index is unused now */
+		end = pack->hdr.index_offset + size;
+		for ( i = 0; i < pack->hdr.count; i++ )
+			if ( pack->index[i].offset + sizeof(pack_entry_t) > end )
+				end = pack->index[i].offset +
+				      sizeof(pack_entry_t);
+		if ( ftruncate( pack->fd, end ) )
+			pack_error( pack, strerror( errno ) );
+
+		live = sizeof(pack_hdr_t) + size +
+		       (uint64_t) pack->hdr.count * sizeof(pack_entry_t);
+		if ( end - live >= PACK_COMPACT_MIN && ( end - live ) * 3 >= end )
+			pack_compact( pack, size );
+
+		free( pack->index );
+		free( pack->gaps );
+	} else {
+		munmap( pack->map, pack->map_size );
+	}
+	if ( close( pack->fd ) )
+		pack_error( pack, strerror( errno ) );
+	free( pack );
+}
+
+int pack_count( const pack_t *pack ) {
+	return pack->hdr.count;
+}
+
+const char *pack_name( const pack_t *pack, int idx ) {
+	return pack->index[idx].name;
+}
+
+/**
+ * Finds an entry in a pack by name.
+ * @return         The index of the entry, or -1 if it is not in the pack.
+ */
+int pack_find( const pack_t *pack, const char *name ) {
+	int i;
+
+	for ( i = 0; i < pack->hdr.count; i++ ) {
+		if ( strncmp( pack->index[i].name, name, PACK_NAME_SIZE ) == 0 )
+			return i;
+	}
+
+	return -1;
+}
+
+/**
+ * Gets an entry of a pack that was opened for reading.
+ * @param pack     The pack to get the entry from
+ * @param idx      The index of the entry
+ * @return         A pointer to the entry in the mapped pack file
+ */
+const pack_entry_t *pack_entry( const pack_t *pack, int idx ) {
+	uint64_t offset = pack->index[idx].offset;
+
+	if ( offset > pack->map_size ||
+	     pack->map_size - offset < sizeof(pack_entry_t) )
+		pack_error( pack, "truncated entry" );
+
+	return (const pack_entry_t *)( pack->map + offset );
+}
+
+/**
+ * Adds an entry to a pack that was opened for writing. An existing entry with
+ * the same name is replaced, the new contents are placed like those of a new
+ * entry, so the old ones stay valid until the pack is closed.
+ * @param pack     The pack to add the entry to
+ * @param name     The name of the entry
+ * @param entry    The decrypted patch to store
+ */
+void pack_add( pack_t *pack, const char *name, const pack_entry_t *entry ) {
+	pack_index_t *ent;
+	uint64_t offset;
+	int idx;
+
+	if ( strlen( name ) >= PACK_NAME_SIZE )
+		pack_error( pack, "entry name too long" );
+
+	idx = pack_find( pack, name );
+	if ( idx < 0 ) {
+		pack->index = realloc( pack->index,
+		                (pack->hdr.count + 1) * sizeof(pack_index_t) );
+		if ( !pack->index )
+			pack_error( pack, "could not allocate index" );
+		idx = pack->hdr.count++;
+		ent = pack->index + idx;
+		memset( ent, 0, sizeof(pack_index_t) );
+		strcpy( ent->name, name );
+	}
+
+	offset = pack_alloc( pack, sizeof(pack_entry_t) );
+	pack_pwrite( pack, entry, sizeof(pack_entry_t), offset );
+	pack->index[idx].offset = offset;
+}
@@ -2,16 +2,18 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include "rotate.h"
 #include "crypto.h"
 #include "patchtools.h"
 #include "patchfile.h"
+#include "stats.h"
+#include "trace.h"
 
-#define ENCRYPT_MISSING_FPROM   (1)
-#define ENCRYPT_OK              (0)
-#define IV_KEY_INDEX_MASK       (0x9C)
-#define INTEGRITY_INDEX_MASK    (0xFF)
-#define CPUID_STEPPING_MASK     (0xF)
+static int decrypt_check_integrity(
+	uint32_t integrity_idx,
+	uint32_t pt_integ,
+	int fatal );
 
 /**
  * Decrypts and validates an integrity check word based on the current
@@ -21,28 +23,57 @@
  * is not complete.
  *
  * @param ct_integ   The encrypted ICV to validate
+ * @param fatal      If zero, failures are only reported through the return
+ *                   value instead of printing them and exiting.
+ * @return           DECRYPT_OK when the ICV is valid
+ * @error            DECRYPT_MISSING_FPROM : The ICV uses an unknown FPROM entry
+ *                   DECRYPT_BAD_ICV : The ICV did not match (only if !fatal)
  */
-void decrypt_verify_integrity( uint32_t ct_integ ) {
-	uint32_t integrity_idx, pt_integ, exp_integ;
+int decrypt_verify_integrity( uint32_t ct_integ, int fatal ) {
+	uint32_t integrity_idx, pt_integ;
 
 	/* The ICV is derived from the crypto state before it is encrypted, so
 	 * compute it first. The current state of the ciphermode is masked and
 	 * indexed into the FPROM to get the check value */
 	integrity_idx = crypto_getstate() & INTEGRITY_INDEX_MASK;
+	TRACE_ICV( integrity_idx );
 
 	/* Decrypt the ICV from the input */
 	pt_integ = crypto_decrypt( ct_integ );
 
+	return decrypt_check_integrity( integrity_idx, pt_integ, fatal );
+}
+
+/**
+ * Validates a decrypted integrity check word.
+ *
+ * @param integrity_idx The FPROM index the ICV is derived from
+ * @param pt_integ      The decrypted ICV
+ * @param fatal         If zero, failures are only reported through the
+ *                      return value instead of printing them and exiting.
+ * @return              DECRYPT_OK when the ICV is valid
+ * @error               DECRYPT_MISSING_FPROM : The ICV uses an unknown FPROM
+ *                      entry
+ *                      DECRYPT_BAD_ICV : The ICV did not match (only if
+ *                      !fatal)
+ */
+static int decrypt_check_integrity(
+	uint32_t integrity_idx,
+	uint32_t pt_integ,
+	int fatal ) {
+	uint32_t exp_integ;
+
 	/* Check that the FPROM entry used to derive the ICV is mapped in the
 	 * program's table */
 	if ( !fprom_exists( integrity_idx ) ) {
 		/* Assuming correct decryption, this tells us a new FPROM table
 		 * entry */
-		fprintf( stderr,
-		"Integrity check uses unknown FPROM[0x%02X] = 0x%08X\n",
-		integrity_idx,
-		pt_integ );
-		return;
+		if ( fatal )
+			fprintf( stderr,
+			"Integrity check uses unknown FPROM[0x%02X] = 0x%08X\n",
+			integrity_idx,
+			pt_integ );
+		return DECRYPT_MISSING_FPROM;
 	}
 
 	/* Compute the expected ICV */
@@ -51,6 +82,9 @@ void decrypt_verify_integrity( uint32_t ct_integ ) {
 	/* Compare it against the stored, decrypted ICV */
 	if ( pt_integ != exp_integ ) {
 		/* Assuming correct decryption, this means our table was wrong*/
+		STAT_INC( icv_fail );
+		if ( !fatal )
+			return DECRYPT_BAD_ICV;
 		fprintf( stderr,
 		"Integrity check failed, got 0x%08X expected 0x%08X\n",
 		pt_integ,
@@ -58,6 +92,9 @@ void decrypt_verify_integrity( uint32_t ct_integ ) {
 		exit( EXIT_FAILURE );
 	}
 
+	STAT_INC( icv_pass );
+	return DECRYPT_OK;
+
 }
 
 /**
@@ -87,6 +124,7 @@ uint32_t encrypt_generate_integrity( int *status ) {
 
 	/* Generate and encrypt the ICV */
 	pt_integ = fprom_get( integrity_idx );
+	TRACE_ICV( integrity_idx );
 
 	*status = ENCRYPT_OK;
 	return crypto_encrypt( pt_integ );
@@ -136,20 +174,55 @@ int derive_key(
 }
 
 /**
- * Decrypts an encrypted microcode patch using a given IV and key
- * @param out      The buffer to write the decrypted patch body to.
- * @param in       The encrypted patch body to decrypt.
- * @param iv       The initialization vector to use.
- * @param key      The key to use.
+ * Finds the seeds for which derive_key finds the key in the FPROM table. The
+ * key index only depends on the low 8 bits of the IV, and so on the low 8
+ * bits of the seed, so every seed with a usable residue modulo 256 is usable.
+ * Only used as a diagnostic, the shipped FPROM table is complete.
+ * @param usable   Receives a bitmap of the usable residues
+ * @return         The number of usable residues
+ */
+int seed_residues( uint32_t proc_sig, uint64_t *usable ) {
+	uint32_t iv, key;
+	int r, count;
+
+	memset( usable, 0, 256 / 8 );
+	for ( count = 0, r = 0; r < 256; r++ ) {
+		if ( derive_key( &iv, &key, proc_sig, r ) != ENCRYPT_OK )
+			continue;
+		usable[ r / 64 ] |= 1ull << ( r % 64 );
+		count++;
+	}
+
+	return count;
+}
+
+/**
+ * Gathers the encrypted words of a patch body in cipher order. The cipher runs
+ * over the body without the unencrypted word after the MSRAM ICV.
+ * @param stream   Receives PATCH_CIPHER_WORDS words
+ */
+void patch_cipher_stream( const epatch_body_t *in, uint32_t *stream ) {
+	const uint8_t *raw = (const uint8_t *) in;
+
+	memcpy( stream, raw + offsetof( epatch_body_t, msram ),
+	        ( MSRAM_DWORD_COUNT + 1 ) * sizeof(uint32_t) );
+	memcpy( stream + MSRAM_DWORD_COUNT + 1,
+	        raw + offsetof( epatch_body_t, cr_ops ),
+	        PATCH_CR_OP_COUNT * sizeof(patch_cr_op_t) );
+}
+
+/**
+ * Decrypts an encrypted microcode patch one word after the other, through the
+ * thread cipher state, so that every step can be traced.
  */
-void _decrypt_patch(
+static int _decrypt_patch_serial(
 	patch_body_t *out,
 	const epatch_body_t *in,
 	uint32_t iv,
-	uint32_t key ) {
+	uint32_t key,
+	int fatal ) {
 
-	uint32_t integrity_idx;
-	int i;
+	int i, status;
 
 	/* Zero out the output buffer to prevent leaking memory contents */
 	memset( out, 0, sizeof(patch_body_t) );
@@ -163,7 +236,7 @@ void _decrypt_patch(
 	}
 
 	/* Validate the patch MSRAM contents */
-	decrypt_verify_integrity( in->msram_integrity );
+	status = decrypt_verify_integrity( in->msram_integrity, fatal );
 
 	/* Decrypt the patch control register operations */
 	for ( i = 0; i < PATCH_CR_OP_COUNT; i++ ) {
@@ -176,58 +249,107 @@ void _decrypt_patch(
 			crypto_decrypt( in->cr_ops[i].value );
 
 		/* Validate operation */
-		decrypt_verify_integrity( in->cr_ops[i].integrity );
+		status |= decrypt_verify_integrity(
+			in->cr_ops[i].integrity, fatal );
 	}
 
+	return status;
+
 }
 
 /**
- * Encrypts a patch body using a given processor signature and key seed.
- * Due to a possibly incomplete FPROM table not all seeds may be usable. If
- * the chosen seeds results in an unknown FPROM entry being used, this function
- * will report an error.
+ * Decrypts an encrypted microcode patch using a given IV and key. The cipher
+ * chain is evaluated as a parallel prefix scan by crypto_scan_decrypt, the
+ * ICVs are checked afterwards from the recorded cipher states.
+ * @param out      The buffer to write the decrypted patch body to.
+ * @param in       The encrypted patch body to decrypt.
+ * @param iv       The initialization vector to use.
+ * @param key      The key to use.
+ * @param fatal    If non-zero, exit with an error when an ICV does not match
+ * @return         The DECRYPT_ flags of all ICVs in the patch combined
+ */
+int _decrypt_patch(
+	patch_body_t *out,
+	const epatch_body_t *in,
+	uint32_t iv,
+	uint32_t key,
+	int fatal ) {
+
+	uint32_t ct[ PATCH_CIPHER_WORDS ], pt[ PATCH_CIPHER_WORDS ];
+	uint32_t state[ PATCH_CIPHER_WORDS ];
+	int i, pos, status;
+
+	if ( TRACE_ACTIVE() )
+		return _decrypt_patch_serial( out, in, iv, key, fatal );
+
+	patch_cipher_stream( in, ct );
+
+	crypto_scan_decrypt( key, iv, ct, pt, state, PATCH_CIPHER_WORDS );
+
+	/* Zero out the output buffer to prevent leaking memory contents */
+	memset( out, 0, sizeof(patch_body_t) );
+
+	memcpy( out->msram, pt, MSRAM_DWORD_COUNT * sizeof(uint32_t) );
+	status = decrypt_check_integrity(
+		state[ MSRAM_DWORD_COUNT ] & INTEGRITY_INDEX_MASK,
+		pt[ MSRAM_DWORD_COUNT ], fatal );
+
+	for ( i = 0; i < PATCH_CR_OP_COUNT; i++ ) {
+		pos = MSRAM_DWORD_COUNT + 1 + i * 4;
+		out->cr_ops[i].address = pt[ pos ];
+		out->cr_ops[i].mask    = pt[ pos + 1 ];
+		out->cr_ops[i].value   = pt[ pos + 2 ];
+		status |= decrypt_check_integrity(
+			state[ pos + 3 ] & INTEGRITY_INDEX_MASK,
+			pt[ pos + 3 ], fatal );
+	}
+
+	return status;
+
+}
+
+/**
+ * Encrypts a patch body, starting at a given checkpoint. The cipher state must
+ * have been set up for that checkpoint and the output must already contain
+ * the ciphertext for everything before it.
  *
  * @param out      The buffer to write the encrypted patch body to
  * @param in       The plaintext patch body
- * @param proc_sig The CPUID/processor signature to encrypt for
- * @param seed     The seed to be tried
+ * @param ckpt     If not NULL, receives the cipher state at every checkpoint
+ * @param start    The checkpoint to start at, 0 to encrypt the whole body
  * @return         ENCRYPT_OK when successful
  * @error          ENCRYPT_MISSING_FPROM : A location in the FPROM was ref'd
  *                 that was not correctly set in the
  */
-int _encrypt_patch(
+static int _encrypt_patch_from(
 	epatch_body_t *out,
 	const patch_body_t *in,
-	uint32_t proc_sig,
-	uint32_t seed ) {
-
-	uint32_t integrity_idx, iv, key_idx, key;
-	int i, status;
-
-	/* Zero out the output buffer to prevent leaking memory contents */
-	memset( out, 0, sizeof(epatch_body_t) );
-	out->key_seed = seed;
-
-	/* Derive the IV and key */
-	status = derive_key( &iv, &key, proc_sig, seed );
-	if ( status != ENCRYPT_OK )
-		return status;
+	patch_ckpt_t *ckpt,
+	int start ) {
 
-	/* Load the IV and key into the cipher implementation */
-	crypto_init( key, iv );
+	int g, i, status;
 
 	/* Encrypt the MSRAM contents */
-	for ( i = 0; i < MSRAM_DWORD_COUNT; i++ ) {
-		out->msram[i] = crypto_encrypt( in->msram[i] );
+	for ( g = start; g < MSRAM_GROUP_COUNT; g++ ) {
+		if ( ckpt )
+			crypto_save( ckpt->state + g );
+		for ( i = g * MSRAM_GROUP_SIZE; i < (g + 1) * MSRAM_GROUP_SIZE; i++ )
+			out->msram[i] = crypto_encrypt( in->msram[i] );
 	}
 
 	/* Try to calculate ICV for the MSRAM */
-	out->msram_integrity = encrypt_generate_integrity( &status );
-	if ( status != ENCRYPT_OK )
-		return status;
+	if ( start < MSRAM_GROUP_COUNT ) {
+		out->msram_integrity = encrypt_generate_integrity( &status );
+		if ( status != ENCRYPT_OK )
+			return status;
+		start = MSRAM_GROUP_COUNT;
+	}
 
 	/* Encrypt the control register operations */
-	for ( i = 0; i < PATCH_CR_OP_COUNT; i++ ) {
+	for ( i = start - MSRAM_GROUP_COUNT; i < PATCH_CR_OP_COUNT; i++ ) {
+		if ( ckpt )
+			crypto_save( ckpt->state + MSRAM_GROUP_COUNT + i );
+
 		/* Encrypt operation fields */
 		out->cr_ops[i].address =
 			crypto_encrypt( in->cr_ops[i].address );
@@ -246,6 +368,68 @@ int _encrypt_patch(
 	return ENCRYPT_OK;
 }
 
+/**
+ * Encrypts a patch body using a given processor signature and key seed.
+ * Due to a possibly incomplete FPROM table not all seeds may be usable. If
+ * the chosen seeds results in an unknown FPROM entry being used, this function
+ * will report an error.
+ *
+ * @param out      The buffer to write the encrypted patch body to
+ * @param in       The plaintext patch body
+ * @param proc_sig The CPUID/processor signature to encrypt for
+ * @param seed     The seed to be tried
+ * @param ckpt     If not NULL, receives the cipher state at every checkpoint
+ * @return         ENCRYPT_OK when successful
+ * @error          ENCRYPT_MISSING_FPROM : A location in the FPROM was ref'd
+ *                 that was not correctly set in the
+ */
+static int _encrypt_patch_ckpt(
+	epatch_body_t *out,
+	const patch_body_t *in,
+	uint32_t proc_sig,
+	uint32_t seed,
+	patch_ckpt_t *ckpt ) {
+
+	uint32_t iv, key;
+	int status;
+
+	/* Zero out the output buffer to prevent leaking memory contents */
+	memset( out, 0, sizeof(epatch_body_t) );
+	out->key_seed = seed;
+
+	/* Derive the IV and key */
+	status = derive_key( &iv, &key, proc_sig, seed );
+	if ( status != ENCRYPT_OK )
+		return status;
+
+	/* Load the IV and key into the cipher implementation */
+	crypto_init( key, iv );
+
+	return _encrypt_patch_from( out, in, ckpt, 0 );
+}
+
+/**
+ * Encrypts a patch body using a given processor signature and key seed.
+ * Due to a possibly incomplete FPROM table not all seeds may be usable. If
+ * the chosen seeds results in an unknown FPROM entry being used, this function
+ * will report an error.
+ *
+ * @param out      The buffer to write the encrypted patch body to
+ * @param in       The plaintext patch body
+ * @param proc_sig The CPUID/processor signature to encrypt for
+ * @param seed     The seed to be tried
+ * @return         ENCRYPT_OK when successful
+ * @error          ENCRYPT_MISSING_FPROM : A location in the FPROM was ref'd
+ *                 that was not correctly set in the
+ */
+int _encrypt_patch(
+	epatch_body_t *out,
+	const patch_body_t *in,
+	uint32_t proc_sig,
+	uint32_t seed ) {
+	return _encrypt_patch_ckpt( out, in, proc_sig, seed, NULL );
+}
+
 /**
  * Encrypts a patch body using a given processor signature and key seed.
  * Due to a possibly incomplete FPROM table not all seeds may be usable, to
@@ -263,11 +447,100 @@ void encrypt_patch_body(
 	uint32_t proc_sig,
 	uint32_t seed )
 {
+	STAT_INC( seed_attempts );
 	while( _encrypt_patch( out, in, proc_sig, seed ) != ENCRYPT_OK ) {
+		STAT_INC( seed_attempts );
 		seed++;
 	}
 }
 
+/**
+ * Finds the first checkpoint at which two plaintext patch bodies differ.
+ * @return         The checkpoint index, PATCH_CKPT_COUNT if they are equal.
+ */
+static int patch_first_change( const patch_body_t *a, const patch_body_t *b ) {
+	int i;
+
+	for ( i = 0; i < MSRAM_GROUP_COUNT; i++ ) {
+		if ( memcmp( a->msram + i * MSRAM_GROUP_SIZE,
+		             b->msram + i * MSRAM_GROUP_SIZE,
+		             MSRAM_GROUP_SIZE * sizeof(uint32_t) ) )
+			return i;
+	}
+
+	for ( i = 0; i < PATCH_CR_OP_COUNT; i++ ) {
+		if ( a->cr_ops[i].address != b->cr_ops[i].address ||
+		     a->cr_ops[i].mask    != b->cr_ops[i].mask ||
+		     a->cr_ops[i].value   != b->cr_ops[i].value )
+			return MSRAM_GROUP_COUNT + i;
+	}
+
+	return PATCH_CKPT_COUNT;
+}
+
+/**
+ * Encrypts a patch body, reusing the ciphertext and cipher state recorded in a
+ * checkpoint for the part of the body that did not change since then. The
+ * checkpoint is only used when it was made for the same processor signature
+ * and initial seed, and that seed was usable for it. This way the result is
+ * always identical to that of encrypt_patch_body. If the edited part turns
+ * out to need a different seed the whole body is encrypted again.
+ *
+ * @param out      The buffer to write the encrypted patch body to
+ * @param in       The plaintext patch body
+ * @param proc_sig The CPUID/processor signature to encrypt for
+ * @param seed     The initial key seed to be tried
+ * @param ckpt     The checkpoint to resume from, updated for the new body
+ * @param valid    Non-zero if ckpt holds a previously saved checkpoint
+ * @return         The checkpoint the encryption was resumed from
+ */
+int encrypt_patch_incremental(
+	epatch_body_t *out,
+	const patch_body_t *in,
+	uint32_t proc_sig,
+	uint32_t seed,
+	patch_ckpt_t *ckpt,
+	int valid ) {
+
+	uint32_t try_seed;
+	int start;
+
+	if ( valid &&
+	     ckpt->magic == PATCH_CKPT_MAGIC &&
+	     ckpt->proc_sig == proc_sig &&
+	     ckpt->seed == seed &&
+	     ckpt->cipher.key_seed == seed ) {
+
+		/* Everything before the first edit encrypts the same */
+		start = patch_first_change( in, &ckpt->plain );
+		memcpy( out, &ckpt->cipher, sizeof(epatch_body_t) );
+
+		if ( start < PATCH_CKPT_COUNT )
+			crypto_restore( ckpt->state + start );
+
+		if ( start == PATCH_CKPT_COUNT ||
+		     _encrypt_patch_from( out, in, ckpt, start ) == ENCRYPT_OK )
+			goto done;
+	}
+
+	start = 0;
+	try_seed = seed;
+	STAT_INC( seed_attempts );
+	while ( _encrypt_patch_ckpt( out, in, proc_sig, try_seed, ckpt )
+	        != ENCRYPT_OK ) {
+		STAT_INC( seed_attempts );
+		try_seed++;
+	}
+
+done:
+	ckpt->magic    = PATCH_CKPT_MAGIC;
+	ckpt->proc_sig = proc_sig;
+	ckpt->seed     = seed;
+	memcpy( &ckpt->plain,  in,  sizeof(patch_body_t) );
+	memcpy( &ckpt->cipher, out, sizeof(epatch_body_t) );
+	return start;
+}
+
 /**
  * Decrypts an encrypted microcode patch using a given proc. sig and key seed.
  * @param out      The buffer to write the decrypted patch body to.
@@ -290,6 +563,36 @@ void decrypt_patch_body(
 	}
 
 	/* Actually decrypt the patch */
-	_decrypt_patch( out, in, iv, key );
+	_decrypt_patch( out, in, iv, key, 1 );
+
+}
+
+/**
+ * Decrypts an encrypted microcode patch without printing errors or exiting
+ * when it can not be decrypted or is corrupt, for use in batch operations.
+ * @param out      The buffer to write the decrypted patch body to.
+ * @param in       The encrypted patch body to decrypt
+ * @param proc_sig The CPUID/processor signature to decrypt for
+ * @return         DECRYPT_OK when all ICVs are valid, otherwise a combination
+ *                 of the DECRYPT_ flags
+ */
+int decrypt_patch_checked(
+	patch_body_t *out,
+	const epatch_body_t *in,
+	uint32_t proc_sig ) {
+
+	uint32_t iv, key, base;
+
+	if ( !cpukeys_lookup( proc_sig, &base ) ) {
+		memset( out, 0, sizeof(patch_body_t) );
+		return DECRYPT_UNKNOWN_KEY;
+	}
+
+	if ( derive_key( &iv, &key, proc_sig, in->key_seed ) != ENCRYPT_OK ) {
+		memset( out, 0, sizeof(patch_body_t) );
+		return DECRYPT_MISSING_FPROM;
+	}
+
+	return _decrypt_patch( out, in, iv, key, 0 );
 
 }
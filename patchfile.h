@@ -1,6 +1,7 @@
 #ifndef __patchfile_h__
 #define __patchfile_h__
 #include <stdint.h>
+#include "crypto.h"
 
 #define MSRAM_QWORD_COUNT (0x54)
 #define MSRAM_DWORD_COUNT (MSRAM_QWORD_COUNT * 2)
@@ -8,6 +9,23 @@
 #define MSRAM_GROUP_COUNT (MSRAM_DWORD_COUNT/8)
 #define PATCH_CR_OP_COUNT (0x10)
 #define MSRAM_BASE_ADDRESS (0xFEB)
+#define IV_KEY_INDEX_MASK       (0x9C)
+#define INTEGRITY_INDEX_MASK    (0xFF)
+#define CPUID_STEPPING_MASK     (0xF)
+#define PATCH_CKPT_COUNT  (MSRAM_GROUP_COUNT + PATCH_CR_OP_COUNT)
+/* Encrypted words of a patch body in cipher order, without reserved words */
+#define PATCH_CIPHER_WORDS (MSRAM_DWORD_COUNT + 1 + PATCH_CR_OP_COUNT * 4)
+#define PATCH_CKPT_MAGIC  (0x4B435450)
+#define PACK_MAGIC        (0x4B505450)
+#define PACK_VERSION      (1)
+#define PACK_NAME_SIZE    (64)
+#define BITSTATS_MAGIC    (0x53544942)
+#define TRACE_MAGIC       (0x43525450)
+#define TRACE_VERSION     (1)
+#define TRACE_INDEX_INIT  (0xFFFFFFFF)
+#define TRACE_NO_FPROM    (0xFFFFFFFF)
+#define TRACE_ENCRYPT     (1)
+#define TRACE_RESTORE     (2)
 
 typedef struct __attribute__((packed)) {
 	uint32_t      header_ver;
@@ -48,4 +66,111 @@ typedef struct __attribute__((packed)) {
 	epatch_body_t body;
 } epatch_file_t;
 
+/**
+ * Describes the layout of the encrypted words of a patch body, which follow
+ * the key seed and its reserved word. The MSRAM words come first, with an ICV
+ * after every msram_icv_interval of them (only after the last one if zero),
+ * followed by msram_pad unencrypted words. Then come the control register
+ * ops of cr_op_words words each, every one followed by an ICV.
+ * The layout of epatch_body_t is described by patch_layout_default.
+ */
+typedef struct {
+	const char   *name;
+	int           msram_dword_count;
+	uint32_t      msram_base;
+	int           msram_icv_interval;
+	int           msram_pad;
+	int           cr_op_count;
+	int           cr_op_words;
+	uint32_t      iv_key_mask;
+	uint32_t      icv_mask;
+} patch_layout_t;
+
+/**
+ * Cipher checkpoints of an encrypted patch. The first MSRAM_GROUP_COUNT
+ * entries of state hold the cipher state before each MSRAM group, the others
+ * the state before each control register op.
+ */
+typedef struct {
+	uint32_t      magic;
+	uint32_t      proc_sig;
+	uint32_t      seed;
+	uint32_t      resvd_0;
+	patch_body_t  plain;
+	epatch_body_t cipher;
+	crypto_ctx_t  state[ PATCH_CKPT_COUNT ];
+} patch_ckpt_t;
+
+/**
+ * Pack file header. A pack stores many decrypted patches, one entry each,
+ * followed by an index of the entries at index_offset.
+ */
+typedef struct __attribute__((packed)) {
+	uint32_t      magic;
+	uint32_t      version;
+	uint32_t      count;
+	uint32_t      resvd_0;
+	uint64_t      index_offset;
+} pack_hdr_t;
+
+typedef struct __attribute__((packed)) {
+	char          name[ PACK_NAME_SIZE ];
+	uint64_t      offset;
+} pack_index_t;
+
+typedef struct {
+	patch_hdr_t   header;
+	uint32_t      key_seed;
+	uint32_t      resvd_0;
+	patch_body_t  body;
+} pack_entry_t;
+
+/**
+ * Header of a binary MSRAM bit statistics file. It is followed by these
+ * uint32_t matrices:
+ *     word_bits[ word_count ][ 32 ]        Patches with each bit set
+ *     word_and[ word_count ]               AND of each word over all patches
+ *     word_or[ word_count ]                OR of each word over all patches
+ *     word_xor[ word_count ]               XOR of each word over all patches
+ *     column_bits[ group_size ][ 32 ]      Words with each bit set, per
+ *                                          column of the MSRAM groups
+ *     popcount[ group_size ][ 33 ]         Words with each popcount, per
+ *                                          column of the MSRAM groups
+ */
+typedef struct __attribute__((packed)) {
+	uint32_t      magic;
+	uint32_t      patch_count;
+	uint32_t      word_count;
+	uint32_t      group_size;
+} bitstats_hdr_t;
+
+/**
+ * Header of a binary cipher trace file, followed by trace_record_t records.
+ * Records are written in per-thread blocks, so the steps of different chains
+ * are interleaved; sort by (chain, index) to follow one chain.
+ */
+typedef struct __attribute__((packed)) {
+	uint32_t      magic;
+	uint32_t      version;
+	uint32_t      record_size;
+	uint32_t      resvd_0;
+} trace_hdr_t;
+
+/**
+ * A single cipher step. Every chain starts with a record with index
+ * TRACE_INDEX_INIT holding the key in ciphertext and the initial state and
+ * LastCWord, as loaded by crypto_init or, with TRACE_RESTORE set, by
+ * crypto_restore.
+ */
+typedef struct __attribute__((packed)) {
+	uint32_t      chain;       /* Sequence number of the chain */
+	uint32_t      index;       /* Step number within the chain */
+	uint32_t      ciphertext;
+	uint32_t      state;       /* Cipher state after the step */
+	uint32_t      last_cword;  /* LastCWord used by the step */
+	uint32_t      plaintext;
+	uint32_t      fprom_idx;   /* FPROM index of an ICV or TRACE_NO_FPROM */
+	uint32_t      flags;       /* TRACE_ENCRYPT, TRACE_RESTORE */
+} trace_record_t;
+
 #endif
@@ -7,7 +7,10 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <libgen.h>
+#include <getopt.h>
 #include "patchtools.h"
+#include "stats.h"
+#include "trace.h"
 
 char fmt_buf[4096];
 char *patch_filename;
@@ -15,15 +18,39 @@ char *patch_name;
 epatch_file_t *patch_in;
 patch_body_t patch_body;
 epatch_file_t epatch_out;
+patch_ckpt_t patch_ckpt;
 uint8_t data_in[2048];
 
 /* Command line flags */
 int extract_patch_flag, dump_patch_flag, create_patch_flag, help_flag;
+int checkpoint_flag, stats_flag;
 
 /* Command line arguments */
 char *patch_path;
 char *config_path;
 char *msram_path;
+char *sweep_path;
+char *stats_path;
+char *trace_path;
+char *pack_path;
+char *keysearch_path;
+char *cascade_list;
+char *layout_path;
+int probe_flag;
+char *bitstats_prefix;
+char *generate_spec;
+char *watch_path;
+int dump_format = DUMP_FORMAT_TEXT;
+int verify_flag;
+int kstress_flag;
+uint64_t kstress_pairs;
+char *archive_path;
+char *targets_list;
+char *manifest_path;
+int merge_flag;
+char *const *merge_paths;
+int merge_count;
+char *seeds_sig;
 uint32_t patch_seed;
 
 void usage( const char *reason ) {
@@ -31,7 +58,22 @@ void usage( const char *reason ) {
 	fprintf( stderr,
 	"\tpatchtools -h\n" );
 	fprintf( stderr,
-	"\tpatchtools [-dec] [-p <patch.dat>] [-i <config.txt>]\n\n" );
+	"\tpatchtools [-deck] [-p <patch.dat>] [-i <config.txt>]\n"
+	"\t           [-P <pack.ptp>] [-s <sweep.txt>] [-j <threads>]\n"
+	"\t           [-f text|json|csv] [-t <sig[:flags],...>]\n"
+	"\t           [--stats[=<file>]] [--keysearch <dir>]\n"
+	"\t           [--cascade <filter,...>]\n"
+	"\t           [--probe[=<layouts>]] [--trace <file>] [--jit]\n"
+	"\tpatchtools -d -f json|csv <patch.dat> ...\n"
+	"\tpatchtools -e --archive <archive|-> [-P <pack.ptp>]\n"
+	"\tpatchtools --verify <patch.dat> ...\n"
+	"\tpatchtools --bitstats <prefix> [-P <pack.ptp>] [<patch.dat> ...]\n"
+	"\tpatchtools --generate <count>[:<seed>[:<pattern>]] <prefix>\n"
+	"\tpatchtools -c --watch <dir>\n"
+	"\tpatchtools -c -m <manifest.txt> [-j <threads>]\n"
+	"\tpatchtools -c -i <base.txt> --merge <patch> ...\n"
+	"\tpatchtools --kstress[=<pairs>] [-j <threads>]\n"
+	"\tpatchtools --seeds <proc_sig>\n\n" );
 
 	if ( !help_flag )
 		exit( EXIT_FAILURE );
@@ -51,6 +93,11 @@ void usage( const char *reason ) {
 	"\t\t-c                Create a patch from a configuration and\n"
 	"\t\t                  MSRAM hexdump file\n"
 	"\t\t\n"
+	"\t\t-k                When creating a patch, keep cipher     \n"
+	"\t\t                  checkpoints in <patch.dat>.ckpt and use\n"
+	"\t\t                  them to only re-encrypt the part of the\n"
+	"\t\t                  patch that changed since the last run. \n"
+	"\t\t\n"
 	"\t\t-d                Dump the patch contents and keys to the\n"
 	"\t\t                  console after encrypting or decrypting.\n"
 	"\t\t\n"
@@ -64,19 +111,209 @@ void usage( const char *reason ) {
 	"\t\t                  to use or extract. When extracting this\n"
 	"\t\t                  option is not required as the program  \n"
 	"\t\t                  will use the path of the patch file to \n"
-	"\t\t                  generate the output path.\n");
+	"\t\t                  generate the output path.\n"
+	"\t\t\n"
+	"\t\t-P <pack.ptp>     Use a pack file holding many extracted \n"
+	"\t\t                  patches instead of config and MSRAM    \n"
+	"\t\t                  files. When extracting, the patch is   \n"
+	"\t\t                  added to the pack. When creating or    \n"
+	"\t\t                  dumping, -i selects the entry to use,  \n"
+	"\t\t                  without it all entries are processed.  \n"
+	"\t\t\n"
+	"\t\t-s <sweep.txt>    When creating a patch, create a variant \n"
+	"\t\t                  for every combination of the values in \n"
+	"\t\t                  the sweep specification. The variants  \n"
+	"\t\t                  are written to <name>_<n>.dat.\n"
+	"\t\t\n"
+	"\t\t-j <threads>      Number of worker threads to use, the   \n"
+	"\t\t                  default is one per online CPU.\n"
+	"\t\t\n"
+	"\t\t-t <targets>      Create the patch for several processors,\n"
+	"\t\t                  given as a comma separated list of     \n"
+	"\t\t                  signatures, each optionally followed by\n"
+	"\t\t                  :<proc_flags>. Writes one patch per    \n"
+	"\t\t                  target, <name>_<sig>[_<flags>].dat, or \n"
+	"\t\t                  all of them concatenated to -p if given.\n"
+	"\t\t\n"
+	"\t\t-m <manifest.txt> Create every patch listed in a manifest,\n"
+	"\t\t                  one per line as <config> <output>     \n"
+	"\t\t                  [<seed> [<proc_sig>]], and summarize  \n"
+	"\t\t                  which ones failed. \n"
+	"\t\t\n"
+	"\t\t-f <format>       Format of the dump made by -d: text, \n"
+	"\t\t                  json (one object per line) or csv. \n"
+	"\t\t                  The json and csv formats also accept a\n"
+	"\t\t                  list of patch files to dump.\n"
+	"\t\t\n"
+	"\t\t--stats[=<file>]  Write hot path counters and timers as  \n"
+	"\t\t                  JSON to the given file or stderr. Only \n"
+	"\t\t                  available when built with STATS=1.\n"
+	"\t\t\n"
+	"\t\t--trace <file>    Record every cipher step to a binary \n"
+	"\t\t                  trace file. Only available when built \n"
+	"\t\t                  with TRACE=1.\n"
+	"\t\t\n"
+	"\t\t--keysearch <dir> Search for the base key of the processor\n"
+	"\t\t                  the patch given by -p is for. The search\n"
+	"\t\t                  is split in shards that can be worked on\n"
+	"\t\t                  by several processes sharing <dir>, and \n"
+	"\t\t                  continues where it left off when rerun. \n"
+	"\t\t\n"
+	"\t\t--cascade <list>  Filters every key search candidate runs \n"
+	"\t\t                  through, in order: keyidx, msram-icv, \n"
+	"\t\t                  cr-addr and full. full is always last. \n"
+	"\t\t\n"
+	"\t\t--probe[=<file>]  Try every combination of patch layout, \n"
+	"\t\t                  known key and stepping rotation on the \n"
+	"\t\t                  patch given by -p, and list the ones that\n"
+	"\t\t                  pass the ICVs. The layouts are read from\n"
+	"\t\t                  <file> if given. \n"
+	"\t\t\n"
+	"\t\t--archive <file>  Extract all patches in a tar or cpio \n"
+	"\t\t                  archive, - reads it from stdin. The \n"
+	"\t\t                  outputs are named after the members, or\n"
+	"\t\t                  stored in the pack given by -P. \n"
+	"\t\t\n"
+	"\t\t--verify         Check that patches are re-created bit for\n"
+	"\t\t                  bit when extracted and created again. \n"
+	"\t\t                  Takes -p or a list of patch files. \n"
+	"\t\t\n"
+	"\t\t--bitstats <prefix>\n"
+	"\t\t                  Compute MSRAM bit statistics over all \n"
+	"\t\t                  patches given as arguments and in the \n"
+	"\t\t                  pack given by -P. \n"
+	"\t\t\n"
+	"\t\t--generate <count>[:<seed>[:<pattern>]]\n"
+	"\t\t                  Generate a corpus of valid encrypted \n"
+	"\t\t                  patches to <prefix>.dat and their \n"
+	"\t\t                  plaintexts to <prefix>.plain. The \n"
+	"\t\t                  pattern is random or pattern. \n"
+	"\t\t\n"
+	"\t\t--watch <dir>     Rebuild the patch of every config in \n"
+	"\t\t                  <dir> and below whenever the config or\n"
+	"\t\t                  its MSRAM file changes. \n"
+	"\t\t\n"
+	"\t\t--jit             Generate a blockfunc specialized for every\n"
+	"\t\t                  key that is used repeatedly. \n"
+	"\t\t\n"
+	"\t\t--kstress[=<pairs>]\n"
+	"\t\t                  Check every blockfunc implementation \n"
+	"\t\t                  against the C reference on edge cases \n"
+	"\t\t                  and <pairs> random inputs, default 2^32,\n"
+	"\t\t                  and report their throughput. \n"
+	"\t\t\n"
+	"\t\t--merge           Merge the MSRAM groups and CR ops that \n"
+	"\t\t                  the patches given as arguments, .dat  \n"
+	"\t\t                  files or configs, change relative to \n"
+	"\t\t                  the baseline given by -i, and create \n"
+	"\t\t                  the merged patch. Fails on conflicts. \n"
+	"\t\t\n"
+	"\t\t--seeds <proc_sig> List the key seeds whose key is in the \n"
+	"\t\t                  FPROM table for a processor. \n");
 }
 
+static const struct option long_options[] = {
+	{ "stats", optional_argument, NULL, 'S' },
+	{ "trace", required_argument, NULL, 'T' },
+	{ "keysearch", required_argument, NULL, 'K' },
+	{ "cascade", required_argument, NULL, 'C' },
+	{ "probe", optional_argument, NULL, 'L' },
+	{ "bitstats", required_argument, NULL, 'B' },
+	{ "verify", no_argument, NULL, 'V' },
+	{ "archive", required_argument, NULL, 'A' },
+	{ "generate", required_argument, NULL, 'G' },
+	{ "watch", required_argument, NULL, 'W' },
+	{ "jit", no_argument, NULL, 'J' },
+	{ "kstress", optional_argument, NULL, 'X' },
+	{ "merge", no_argument, NULL, 'M' },
+	{ "seeds", required_argument, NULL, 'E' },
+	{ NULL, 0, NULL, 0 }
+};
+
 void parse_args( int argc, char *const *argv ) {
-	char opt;
-	while ( (opt = getopt( argc, argv, ":p:i:dech" )) != -1 ) {
+	int opt;
+	while ( (opt = getopt_long( argc, argv, ":p:i:s:j:P:f:t:m:deckh",
+	                            long_options, NULL )) != -1 ) {
 		switch( opt ) {
+			case 'S':
+				stats_flag = 1;
+				if ( optarg )
+					stats_path = strdup( optarg );
+				break;
+			case 'T':
+				trace_path = strdup( optarg );
+				break;
+			case 'K':
+				keysearch_path = strdup( optarg );
+				break;
+			case 'C':
+				cascade_list = strdup( optarg );
+				break;
+			case 't':
+				targets_list = strdup( optarg );
+				break;
+			case 'm':
+				manifest_path = strdup( optarg );
+				break;
+			case 'A':
+				archive_path = strdup( optarg );
+				break;
+			case 'V':
+				verify_flag = 1;
+				break;
+			case 'B':
+				bitstats_prefix = strdup( optarg );
+				break;
+			case 'G':
+				generate_spec = strdup( optarg );
+				break;
+			case 'W':
+				watch_path = strdup( optarg );
+				break;
+			case 'J':
+				crypto_jit_enabled = 1;
+				break;
+			case 'X':
+				kstress_flag = 1;
+				if ( optarg )
+					kstress_pairs = strtoull( optarg, NULL, 0 );
+				break;
+			case 'M':
+				merge_flag = 1;
+				break;
+			case 'E':
+				seeds_sig = strdup( optarg );
+				break;
+			case 'L':
+				probe_flag = 1;
+				if ( optarg )
+					layout_path = strdup( optarg );
+				break;
 			case 'p':
 				patch_path = strdup( optarg );
 				break;
 			case 'i':
 				config_path = strdup( optarg );
 				break;
+			case 's':
+				sweep_path = strdup( optarg );
+				break;
+			case 'P':
+				pack_path = strdup( optarg );
+				break;
+			case 'j':
+				workpool_threads = strtol( optarg, NULL, 0 );
+				break;
+			case 'f':
+				if ( strcmp( optarg, "text" ) == 0 )
+					dump_format = DUMP_FORMAT_TEXT;
+				else if ( strcmp( optarg, "json" ) == 0 )
+					dump_format = DUMP_FORMAT_JSON;
+				else if ( strcmp( optarg, "csv" ) == 0 )
+					dump_format = DUMP_FORMAT_CSV;
+				else
+					usage("unknown dump format");
+				break;
 			case 'd':
 				dump_patch_flag = 1;
 				break;
@@ -86,6 +323,9 @@ void parse_args( int argc, char *const *argv ) {
 			case 'c':
 				create_patch_flag = 1;
 				break;
+			case 'k':
+				checkpoint_flag = 1;
+				break;
 			case 'h':
 				help_flag = 1;
 				break;
@@ -101,6 +341,26 @@ void parse_args( int argc, char *const *argv ) {
 }
 
 
+/**
+ * Returns a copy of a file name without its extension, the part from the last
+ * '.' on, so that "foo.v2.txt" becomes "foo.v2".
+ */
+static char *strip_extension( const char *fn ) {
+	char *name, *dot;
+
+	name = strdup( fn );
+	if ( !name ) {
+		perror( "Could not allocate patch name" );
+		exit( EXIT_FAILURE );
+	}
+
+	dot = strrchr( name, '.' );
+	if ( dot && dot != name )
+		*dot = 0;
+
+	return name;
+}
+
 void load_input_patch( void ) {
 	char *patch_fn;
 
@@ -118,9 +378,7 @@ void load_input_patch( void ) {
 	patch_filename = strdup( patch_fn );
 
 	/* Get the patch name */
-	strncpy( fmt_buf, patch_filename, sizeof fmt_buf );
-	patch_name = strtok( patch_filename, "." );
-	patch_name = strdup( patch_name );
+	patch_name = strip_extension( patch_filename );
 
 	/* Decrypt the patch */
 	decrypt_patch_body(
@@ -133,25 +391,105 @@ void load_input_patch( void ) {
 
 }
 
-void write_output_patch( void ) {
+/**
+ * Encrypts the patch, resuming from the checkpoints of the previous run
+ */
+void encrypt_output_checkpointed( void ) {
+	size_t s;
+	int valid;
 
-	/* Ensure we have a path */
-	if ( !patch_path )
-		usage("missing patch path");
+	s = snprintf( fmt_buf, sizeof fmt_buf, "%s.ckpt", patch_path );
+	if ( s < 0 )  {
+		fprintf( stderr, "Could not generate checkpoint path!\n" );
+		exit( EXIT_FAILURE );
+	}
+
+	/* Load the checkpoints of the previous run, if any */
+	valid = try_read_file( fmt_buf, &patch_ckpt, sizeof patch_ckpt )
+	        == sizeof patch_ckpt;
 
 	/* Encrypt the patch */
-	encrypt_patch_body(
+	encrypt_patch_incremental(
 		&epatch_out.body,
 		&patch_body,
 		patch_in->header.proc_sig,
-		patch_seed);
+		patch_seed,
+		&patch_ckpt,
+		valid );
+
+	/* Save the checkpoints for the next run */
+	outq_write( fmt_buf, &patch_ckpt, sizeof patch_ckpt );
+}
+
+void write_output_patch( void ) {
+
+	/* Ensure we have a path */
+	if ( !patch_path )
+		usage("missing patch path");
+
+	if ( checkpoint_flag ) {
+		/* Encrypt the patch, reusing the unchanged part */
+		encrypt_output_checkpointed();
+	} else {
+		/* Encrypt the patch */
+		encrypt_patch_body(
+			&epatch_out.body,
+			&patch_body,
+			patch_in->header.proc_sig,
+			patch_seed);
+	}
 
 	/* Assemble the header */
 	memcpy( &epatch_out.header, &patch_in->header, sizeof(patch_hdr_t) );
 
 	/* Write the file */
-	write_file( patch_path, &epatch_out, sizeof(epatch_file_t) );
+	outq_write( patch_path, &epatch_out, sizeof(epatch_file_t) );
+
+}
+
+/**
+ * Tries layout and key hypotheses against the input patch
+ */
+void probe_input_patch( void ) {
+	void *data;
+	size_t size;
+
+	/* Ensure we have a path */
+	if ( !patch_path )
+		usage("missing patch path");
+
+	/* Patches in other formats may differ in size */
+	data = read_file_alloc( patch_path, &size );
+	probe_patch( data, size, layout_path );
+	free( data );
+}
 
+/**
+ * Lists the key seeds whose key is in the FPROM table for a processor
+ */
+void list_seeds( void ) {
+	uint64_t usable[ 256 / 64 ];
+	uint32_t proc_sig;
+	char *end;
+	int r, n, count;
+
+	proc_sig = strtoul( seeds_sig, &end, 0 );
+	if ( *end )
+		usage("invalid processor signature");
+
+	count = seed_residues( proc_sig, usable );
+	printf( "Processor 0x%08X: %d of 256 seed residues usable\n",
+	        proc_sig, count );
+	if ( count )
+		printf( "Seeds are usable when their low 8 bits are one of:\n" );
+
+	for ( n = 0, r = 0; r < 256; r++ ) {
+		if ( !( ( usable[ r / 64 ] >> ( r % 64 ) ) & 1 ) )
+			continue;
+		printf( n % 16 ? " 0x%02X" : "\t0x%02X", r );
+		if ( ++n % 16 == 0 || n == count )
+			printf( "\n" );
+	}
 }
 
 void cleanup( void ) {
@@ -165,9 +503,64 @@ void cleanup( void ) {
 		free( config_path );
 	if ( msram_path )
 		free( msram_path );
+	if ( sweep_path )
+		free( sweep_path );
+	if ( stats_path )
+		free( stats_path );
+	if ( trace_path )
+		free( trace_path );
+	if ( pack_path )
+		free( pack_path );
+	if ( keysearch_path )
+		free( keysearch_path );
+	if ( cascade_list )
+		free( cascade_list );
+	if ( layout_path )
+		free( layout_path );
+	if ( bitstats_prefix )
+		free( bitstats_prefix );
+	if ( generate_spec )
+		free( generate_spec );
+	if ( watch_path )
+		free( watch_path );
+	if ( archive_path )
+		free( archive_path );
+	if ( targets_list )
+		free( targets_list );
+	if ( seeds_sig )
+		free( seeds_sig );
+}
+
+/**
+ * Writes the hot path statistics, if requested
+ */
+void report_stats( void ) {
+	FILE *file;
+
+	if ( !stats_flag )
+		return;
+
+	file = stats_path ? fopen( stats_path, "w" ) : stderr;
+	if ( !file ) {
+		perror( "Could not open statistics output file" );
+		exit( EXIT_FAILURE );
+	}
+
+	stats_report( file );
+
+	if ( stats_path )
+		fclose( file );
 }
 
 void dump_patch( void ) {
+	if ( dump_format != DUMP_FORMAT_TEXT ) {
+		if ( dump_format == DUMP_FORMAT_CSV )
+			dump_csv_header();
+		dump_patch_record( dump_format,
+		                   patch_path ? patch_path : config_path,
+		                   &patch_in->header, patch_seed, &patch_body );
+		return;
+	}
 	dump_patch_header( &patch_in->header );
 	printf("Key seed: 0x%08X\n", patch_seed);
 	dump_patch_body( &patch_body );
@@ -207,13 +600,136 @@ void extract_patch( void ) {
 
 }
 
+/**
+ * Adds the decrypted patch to a pack file
+ */
+void extract_patch_pack( void ) {
+	pack_entry_t entry;
+	pack_t *pack;
+
+	memset( &entry, 0, sizeof entry );
+	memcpy( &entry.header, &patch_in->header, sizeof(patch_hdr_t) );
+	memcpy( &entry.body, &patch_body, sizeof(patch_body_t) );
+	entry.key_seed = patch_seed;
+
+	pack = pack_open_write( pack_path );
+	pack_add( pack, config_path ? config_path : patch_name, &entry );
+	pack_close( pack );
+}
+
+/**
+ * Loads the contents of a new patch from a pack file entry
+ */
+void load_pack_entry( void ) {
+	const pack_entry_t *entry;
+	pack_t *pack;
+	size_t s;
+	int idx;
+
+	/* Ensure we have an entry name */
+	if ( !config_path )
+		usage("missing pack entry name");
+
+	pack = pack_open( pack_path );
+	idx = pack_find( pack, config_path );
+	if ( idx < 0 ) {
+		fprintf( stderr, "Pack entry \"%s\" not found\n", config_path );
+		exit( EXIT_FAILURE );
+	}
+	entry = pack_entry( pack, idx );
+
+	/* Set the patch data pointer */
+	patch_in = (epatch_file_t *) data_in;
+
+	memcpy( &patch_in->header, &entry->header, sizeof(patch_hdr_t) );
+	memcpy( &patch_body, &entry->body, sizeof(patch_body_t) );
+	patch_seed = entry->key_seed;
+	patch_name = strdup( config_path );
+
+	pack_close( pack );
+
+	/* Determine patchfile path */
+	if ( !patch_path ) {
+		s = snprintf( fmt_buf, sizeof fmt_buf, "%s.dat", patch_name );
+		if ( s < 0 )  {
+			fprintf( stderr, "Could not generate output path!\n" );
+			exit( EXIT_FAILURE );
+		}
+		patch_path = strdup( fmt_buf );
+	}
+}
+
+static void create_pack_entry( void *_pack, int idx ) {
+	pack_t *pack = _pack;
+	const pack_entry_t *entry;
+	epatch_file_t out;
+	char path[4096];
+
+	stats_patch_begin();
+
+	entry = pack_entry( pack, idx );
+	encrypt_patch_body(
+		&out.body,
+		&entry->body,
+		entry->header.proc_sig,
+		entry->key_seed );
+	memcpy( &out.header, &entry->header, sizeof(patch_hdr_t) );
+
+	snprintf( path, sizeof path, "%s.dat", pack_name( pack, idx ) );
+	outq_write( path, &out, sizeof out );
+
+	stats_patch_end( path );
+}
+
+/**
+ * Creates a patch for every entry in a pack file
+ */
+void create_pack_patches( void ) {
+	pack_t *pack;
+
+	pack = pack_open( pack_path );
+	workpool_run( create_pack_entry, pack, pack_count( pack ) );
+
+	/* The output queue holds copies, the pack can be closed */
+	pack_close( pack );
+}
+
+/**
+ * Dumps the contents of the entries in a pack file
+ */
+void dump_pack_patches( void ) {
+	const pack_entry_t *entry;
+	pack_t *pack;
+	int i;
+
+	pack = pack_open( pack_path );
+	if ( dump_format == DUMP_FORMAT_CSV )
+		dump_csv_header();
+	for ( i = 0; i < pack_count( pack ); i++ ) {
+		if ( config_path && strcmp( config_path, pack_name( pack, i ) ) )
+			continue;
+		entry = pack_entry( pack, i );
+		if ( dump_format != DUMP_FORMAT_TEXT ) {
+			dump_patch_record( dump_format, pack_name( pack, i ),
+			                   &entry->header, entry->key_seed,
+			                   &entry->body );
+			continue;
+		}
+		printf("Pack entry: %s\n", pack_name( pack, i ) );
+		dump_patch_header( &entry->header );
+		printf("Key seed: 0x%08X\n", entry->key_seed);
+		dump_patch_body( &entry->body );
+	}
+	pack_close( pack );
+}
+
 /** current directory buffer for use by create_patch */
 char current_dir[4096];
 
 /**
- * Creates a new patch
+ * Loads the configuration and MSRAM contents of a new patch
  */
-void create_patch( void ) {
+void load_patch_config( void ) {
 	size_t s;
 	char *config_fn, *config_dir;
 
@@ -227,8 +743,8 @@ void create_patch( void ) {
 	config_fn = strdup(config_fn);
 
 	/* Get the patch name */
-	patch_name = strtok( config_fn, "." );
-	patch_name = strdup( patch_name );
+	patch_name = strip_extension( config_fn );
+	free( config_fn );
 
 	/* Get the config directory */
 	strncpy( fmt_buf, config_path, sizeof fmt_buf );
@@ -274,21 +790,176 @@ void create_patch( void ) {
 
 	free( config_dir );
 
+}
+
+/**
+ * Creates a new patch
+ */
+void create_patch( void ) {
+	char *concat_path;
+
+	/* An explicit output path selects a multi-update file for targets */
+	concat_path = patch_path ? strdup( patch_path ) : NULL;
+
+	/* Parse the configuration and MSRAM contents */
+	if ( pack_path )
+		load_pack_entry();
+	else
+		load_patch_config();
+
+	if ( merge_flag ) {
+		/* Apply the changes of the other patches to the baseline */
+		merge_patches(
+			&patch_in->header,
+			&patch_body,
+			merge_paths,
+			merge_count );
+	}
+
+	if ( targets_list ) {
+		/* Encode and encrypt the patch for every target, sharing the
+		   parsed inputs */
+		if ( sweep_path || checkpoint_flag )
+			usage("-t can not be combined with -s or -k");
+		create_targets(
+			&patch_in->header,
+			&patch_body,
+			patch_seed,
+			targets_list,
+			patch_name,
+			concat_path );
+		free( concat_path );
+		return;
+	}
+	free( concat_path );
+
+	if ( sweep_path ) {
+		/* Encode and encrypt every variant of the patch */
+		create_sweep(
+			&patch_in->header,
+			&patch_body,
+			patch_seed,
+			sweep_path,
+			patch_name );
+		return;
+	}
+
 	/* Encode and encrypt the patch */
 	write_output_patch();
 
 }
 
 int main( int argc, char * const *argv ) {
+	int failed = 0;
+
 	/* Parse the command line arguments */
 	parse_args( argc, argv );
 
+	if ( stats_flag && !stats_enabled() )
+		usage("statistics are not available in this build");
+
+	if ( trace_path && !trace_enabled() )
+		usage("tracing is not available in this build");
+
+	if ( trace_path )
+		trace_open( trace_path );
+
+	if ( crypto_jit_enabled && !crypto_jit_available() )
+		usage("--jit is not available on this platform");
+
 	if ( help_flag ) {
 		/* The user requested the built in documentation */
 		usage("");
 
+	} else if ( archive_path ) {
+		/* The user requested to extract all patches in an archive */
+		if ( !extract_patch_flag || create_patch_flag || dump_patch_flag )
+			usage("--archive can only be used with -e");
+		extract_archive( archive_path, pack_path );
+
+	} else if ( verify_flag ) {
+		/* The user requested a round trip check of patches */
+		if ( patch_path && optind < argc )
+			usage("give either -p or a list of patches");
+		if ( patch_path )
+			failed = verify_patches( &patch_path, 1 );
+		else if ( optind < argc )
+			failed = verify_patches( argv + optind, argc - optind );
+		else
+			usage("missing patch path");
+
+	} else if ( watch_path ) {
+		/* The user requested patches to be rebuilt as they are edited */
+		if ( !create_patch_flag || dump_patch_flag || extract_patch_flag )
+			usage("--watch can only be used with -c");
+		watch_configs( watch_path );
+
+	} else if ( kstress_flag ) {
+		/* The user requested the cipher kernels to be checked */
+		failed = kernel_stress( kstress_pairs );
+
+	} else if ( seeds_sig ) {
+		/* The user requested the usable key seeds of a processor */
+		list_seeds();
+
+	} else if ( manifest_path ) {
+		/* The user requested every patch in a manifest to be built */
+		if ( !create_patch_flag || dump_patch_flag || extract_patch_flag )
+			usage("-m can only be used with -c");
+		failed = create_manifest( manifest_path ) != 0;
+
+	} else if ( generate_spec ) {
+		/* The user requested a synthetic corpus */
+		if ( optind + 1 != argc )
+			usage("--generate takes a single output prefix");
+		generate_corpus( generate_spec, argv[ optind ] );
+
+	} else if ( bitstats_prefix ) {
+		/* The user requested statistics over a corpus of patches */
+		if ( optind >= argc && !pack_path )
+			usage("missing corpus");
+		corpus_bitstats( argv + optind, argc - optind, pack_path,
+		                 bitstats_prefix );
+
+	} else if ( probe_flag ) {
+		/* The user requested to probe a patch of unknown format */
+		probe_input_patch();
+
+	} else if ( keysearch_path ) {
+		/* The user requested a key search for a patch */
+		if ( !patch_path )
+			usage("missing patch path");
+		read_file( patch_path, data_in, sizeof data_in );
+		search_keys( keysearch_path, (epatch_file_t *) data_in,
+		             cascade_list );
+
+	} else if ( merge_flag && ( !create_patch_flag || extract_patch_flag ||
+	            !config_path || optind >= argc ) ) {
+		usage("--merge requires -c, a baseline given by -i and the "
+		      "patches to merge");
+
+	} else if ( create_patch_flag && !extract_patch_flag &&
+	            pack_path && !config_path ) {
+		/* We are to create a patch for every entry in a pack */
+		create_pack_patches();
+
+	} else if ( dump_patch_flag && !create_patch_flag &&
+	            !extract_patch_flag && optind < argc ) {
+		/* The user requested a dump of many patches */
+		if ( dump_format == DUMP_FORMAT_TEXT || patch_path || pack_path )
+			usage("patch list requires -f json or -f csv, without -p or -P");
+		failed = dump_patch_files( argv + optind, argc - optind,
+		                           dump_format );
+
+	} else if ( dump_patch_flag && !create_patch_flag &&
+	            !extract_patch_flag && pack_path && !patch_path ) {
+		/* The user requested a dump of the patches in a pack */
+		dump_pack_patches();
+
 	} else if ( create_patch_flag && !extract_patch_flag ) {
 		/* We are to create a new patch */
+		merge_paths = argv + optind;
+		merge_count = argc - optind;
 
 		/* Load the input and encode it */
 		create_patch();
@@ -313,14 +984,25 @@ int main( int argc, char * const *argv ) {
 			dump_patch();
 
 		/* Extract the patch if requested */
-		if ( extract_patch_flag )
+		if ( extract_patch_flag && pack_path )
+			extract_patch_pack();
+		else if ( extract_patch_flag )
 			extract_patch();
 
 	} else
 		usage("no mode specified");
 
+	/* Write out all queued output files */
+	outq_flush();
+
+	/* Report the statistics if requested */
+	report_stats();
+
+	/* Write out the remaining trace records */
+	trace_close();
+
 	/* Cleanup dynamically allocated memory  */
 	cleanup();
 
-	return EXIT_SUCCESS;
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -1,32 +1,177 @@
 #ifndef __patchtools_h__
 #define __patchtools_h__
+#include <stdio.h>
 #include "patchfile.h"
 
+#define DECRYPT_OK              (0)
+#define DECRYPT_MISSING_FPROM   (1)
+#define DECRYPT_BAD_ICV         (2)
+#define DECRYPT_UNKNOWN_KEY     (4)
+
+#define ENCRYPT_MISSING_FPROM   (1)
+#define ENCRYPT_OK              (0)
+
+#define DUMP_FORMAT_TEXT        (0)
+#define DUMP_FORMAT_JSON        (1)
+#define DUMP_FORMAT_CSV         (2)
+
 int fprom_exists( uint32_t addr );
 
 uint32_t fprom_get( uint32_t addr );
 
 uint32_t cpukeys_get_base( uint32_t proc_sig );
 
+int cpukeys_lookup( uint32_t proc_sig, uint32_t *base );
+
+typedef struct {
+	const char   *name;
+	uint32_t      base;
+} cpukey_t;
+
+const cpukey_t *cpukeys_list( int *count );
+
+extern const patch_layout_t patch_layout_default;
+
+int layout_word_count( const patch_layout_t *layout );
+
+int decrypt_layout(
+	uint32_t *out,
+	const uint32_t *in,
+	const patch_layout_t *layout,
+	uint32_t iv,
+	uint32_t key,
+	int *checked );
+
+void probe_patch( const void *data, size_t size, const char *layout_file );
+
 void encrypt_patch_body(
 	epatch_body_t *out,
 	const patch_body_t *in,
 	uint32_t proc_sig,
 	uint32_t seed );
 
+int encrypt_patch_incremental(
+	epatch_body_t *out,
+	const patch_body_t *in,
+	uint32_t proc_sig,
+	uint32_t seed,
+	patch_ckpt_t *ckpt,
+	int valid );
+
+int _decrypt_patch(
+	patch_body_t *out,
+	const epatch_body_t *in,
+	uint32_t iv,
+	uint32_t key,
+	int fatal );
+
 void decrypt_patch_body(
 	patch_body_t *out,
 	const epatch_body_t *in,
 	uint32_t proc_sig );
 
+int decrypt_patch_checked(
+	patch_body_t *out,
+	const epatch_body_t *in,
+	uint32_t proc_sig );
+
+int derive_key(
+	uint32_t *iv,
+	uint32_t *key,
+	uint32_t proc_sig,
+	uint32_t seed );
+
+int seed_residues( uint32_t proc_sig, uint64_t *usable );
+
+void patch_cipher_stream( const epatch_body_t *in, uint32_t *stream );
+
+void decrypt_patch_batch(
+	patch_body_t *out,
+	const epatch_file_t *in,
+	int *status,
+	int count );
+
+void generate_corpus( const char *spec, const char *prefix );
+
+void watch_configs( const char *path );
+
 void dump_patch_header( const patch_hdr_t *hdr );
 
 void dump_patch_body( const patch_body_t *body );
 
+void dump_csv_header( void );
+
+void dump_patch_record(
+	int format,
+	const char *name,
+	const patch_hdr_t *hdr,
+	uint32_t key_seed,
+	const patch_body_t *body );
+
+int dump_patch_files( char *const *paths, int count, int format );
+
 void read_file(const char *path, void *data, size_t size);
 
 void write_file(const char *path, const void *data, size_t size);
 
+int try_write_file(const char *path, const void *data, size_t size);
+
+int try_read_file(const char *path, void *data, size_t size);
+
+void *read_file_alloc(const char *path, size_t *size);
+
+void outq_write( const char *path, const void *data, size_t size );
+
+void outq_flush( void );
+
+typedef struct pack pack_t;
+
+pack_t *pack_open( const char *path );
+
+pack_t *pack_open_write( const char *path );
+
+void pack_close( pack_t *pack );
+
+int pack_count( const pack_t *pack );
+
+const char *pack_name( const pack_t *pack, int idx );
+
+int pack_find( const pack_t *pack, const char *name );
+
+const pack_entry_t *pack_entry( const pack_t *pack, int idx );
+
+void pack_add( pack_t *pack, const char *name, const pack_entry_t *entry );
+
+void format_patch_config(
+	FILE *file,
+	const patch_hdr_t *hdr,
+	const patch_body_t *body,
+	const char *msram_fn,
+	uint32_t key_seed );
+
+void parse_patch_config(
+	FILE *file,
+	patch_hdr_t *hdr,
+	patch_body_t *body,
+	char **msram_fnp,
+	uint32_t *key_seed );
+
+void format_msram( FILE *file, const patch_body_t *body );
+
+void parse_msram( FILE *file, patch_body_t *body );
+
+int try_parse_patch_config(
+	FILE *file,
+	patch_hdr_t *hdr,
+	patch_body_t *body,
+	char **msram_fnp,
+	uint32_t *key_seed,
+	char *err,
+	size_t err_size );
+
+int try_parse_msram( FILE *file, patch_body_t *body, char *err,
+                     size_t err_size );
+
 void write_patch_config(
 	const patch_hdr_t *hdr,
 	const patch_body_t *body,
@@ -45,4 +190,66 @@ void read_patch_config(
 
 void read_msram_file( patch_body_t *body, const char *filename );
 
+int try_read_patch_config(
+	patch_hdr_t *hdr,
+	patch_body_t *body,
+	const char *filename,
+	char **msram_fnp,
+	uint32_t *key_seed,
+	char *err,
+	size_t err_size );
+
+int try_read_msram_file( patch_body_t *body, const char *filename,
+                         char *err, size_t err_size );
+
+typedef void (*workpool_fn_t)( void *arg, int index );
+
+extern int workpool_threads;
+
+int workpool_size( void );
+
+void workpool_run( workpool_fn_t fn, void *arg, int count );
+
+void workpool_run_n( workpool_fn_t fn, void *arg, int count, int size );
+
+void corpus_bitstats(
+	char *const *paths,
+	int count,
+	const char *pack_path,
+	const char *prefix );
+
+void extract_archive( const char *path, const char *pack_path );
+
+int verify_patches( char *const *paths, int count );
+
+void search_keys(
+	const char *dir,
+	const epatch_file_t *patch,
+	const char *cascade );
+
+int create_manifest( const char *path );
+
+int kernel_stress( uint64_t pairs );
+
+void merge_patches(
+	const patch_hdr_t *hdr,
+	patch_body_t *body,
+	char *const *paths,
+	int count );
+
+void create_targets(
+	const patch_hdr_t *hdr,
+	const patch_body_t *body,
+	uint32_t seed,
+	const char *list,
+	const char *prefix,
+	const char *concat_path );
+
+void create_sweep(
+	const patch_hdr_t *hdr,
+	const patch_body_t *base,
+	uint32_t seed,
+	const char *spec,
+	const char *prefix );
+
 #endif
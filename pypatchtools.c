@@ -0,0 +1,377 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <stdint.h>
+#include <string.h>
+#include "crypto.h"
+#include "patchtools.h"
+#include "patchfile.h"
+
+/**
+ * Python bindings for batch decryption and encryption of patches. Inputs are
+ * taken as buffers of concatenated records and the results are returned as
+ * views on a single allocation, exported through the buffer protocol so that
+ * they can be wrapped by memoryview or numpy without copying.
+ */
+
+#define PYPT_MAX_DIM     (3)
+
+/** Number of patches decrypted together by one worker */
+#define PYPT_DECRYPT_CHUNK  (4 * CRYPTO_LANES)
+
+/**
+ * A strided view on part of a result allocation. The allocation is owned by a
+ * capsule that is shared by all views on it.
+ */
+typedef struct {
+	PyObject_HEAD
+	PyObject     *owner;
+	char         *buf;
+	const char   *format;
+	Py_ssize_t    itemsize;
+	int           ndim;
+	Py_ssize_t    shape[ PYPT_MAX_DIM ];
+	Py_ssize_t    strides[ PYPT_MAX_DIM ];
+} pypt_view_t;
+
+typedef struct {
+	const uint8_t *in;
+	uint8_t       *out;
+	uint32_t      *status;
+	Py_ssize_t     count;
+} pypt_job_t;
+
+static PyTypeObject pypt_view_type;
+
+static int pypt_view_getbuffer( PyObject *obj, Py_buffer *view, int flags ) {
+	pypt_view_t *self = (pypt_view_t *) obj;
+	Py_ssize_t len;
+	int i;
+
+	/* The views are generally not contiguous */
+	if ( (flags & PyBUF_STRIDES) != PyBUF_STRIDES ) {
+		PyErr_SetString( PyExc_BufferError,
+		                 "patch views require strided buffer access" );
+		view->obj = NULL;
+		return -1;
+	}
+
+	len = self->itemsize;
+	for ( i = 0; i < self->ndim; i++ )
+		len *= self->shape[i];
+
+	view->buf        = self->buf;
+	view->obj        = obj;
+	view->len        = len;
+	view->readonly   = 0;
+	view->itemsize   = self->itemsize;
+	view->format     = (flags & PyBUF_FORMAT) ? (char *) self->format : NULL;
+	view->ndim       = self->ndim;
+	view->shape      = self->shape;
+	view->strides    = self->strides;
+	view->suboffsets = NULL;
+	view->internal   = NULL;
+	Py_INCREF( obj );
+
+	return 0;
+}
+
+static void pypt_view_dealloc( PyObject *obj ) {
+	pypt_view_t *self = (pypt_view_t *) obj;
+	Py_XDECREF( self->owner );
+	Py_TYPE( obj )->tp_free( obj );
+}
+
+static PyBufferProcs pypt_view_as_buffer = {
+	.bf_getbuffer = pypt_view_getbuffer,
+};
+
+static PyTypeObject pypt_view_type = {
+	PyVarObject_HEAD_INIT( NULL, 0 )
+	.tp_name      = "pypatchtools.View",
+	.tp_doc       = "Strided view on a batch of patches",
+	.tp_basicsize = sizeof(pypt_view_t),
+	.tp_flags     = Py_TPFLAGS_DEFAULT,
+	.tp_dealloc   = pypt_view_dealloc,
+	.tp_as_buffer = &pypt_view_as_buffer,
+};
+
+/**
+ * Creates a view on a result allocation.
+ * @param owner    The capsule owning the allocation
+ * @param buf      The first element of the view
+ * @param format   The struct module format of the elements
+ * @param itemsize The size of the elements
+ * @param ndim     The number of dimensions, followed by ndim pairs of shape
+ *                 and stride.
+ */
+static PyObject *pypt_view_new( PyObject *owner, void *buf,
+                                const char *format, Py_ssize_t itemsize,
+                                int ndim, ... ) {
+	pypt_view_t *self;
+	va_list ap;
+	int i;
+
+	self = PyObject_New( pypt_view_t, &pypt_view_type );
+	if ( !self )
+		return NULL;
+
+	Py_INCREF( owner );
+	self->owner    = owner;
+	self->buf      = buf;
+	self->format   = format;
+	self->itemsize = itemsize;
+	self->ndim     = ndim;
+
+	va_start( ap, ndim );
+	for ( i = 0; i < ndim; i++ ) {
+		self->shape[i]   = va_arg( ap, Py_ssize_t );
+		self->strides[i] = va_arg( ap, Py_ssize_t );
+	}
+	va_end( ap );
+
+	return (PyObject *) self;
+}
+
+static void pypt_storage_free( PyObject *capsule ) {
+	free( PyCapsule_GetPointer( capsule, NULL ) );
+}
+
+/**
+ * Allocates a result buffer owned by a capsule.
+ */
+static PyObject *pypt_storage_new( size_t size, void **ptr ) {
+	PyObject *capsule;
+
+	*ptr = calloc( 1, size ? size : 1 );
+	if ( !*ptr )
+		return PyErr_NoMemory();
+
+	capsule = PyCapsule_New( *ptr, NULL, pypt_storage_free );
+	if ( !capsule )
+		free( *ptr );
+
+	return capsule;
+}
+
+/**
+ * Decrypts a chunk of PYPT_DECRYPT_CHUNK patches as a single batch.
+ */
+static void pypt_decrypt_chunk( void *_job, int idx ) {
+	pypt_job_t *job = _job;
+	Py_ssize_t first, count;
+
+	first = (Py_ssize_t) idx * PYPT_DECRYPT_CHUNK;
+	count = job->count - first;
+	if ( count > PYPT_DECRYPT_CHUNK )
+		count = PYPT_DECRYPT_CHUNK;
+
+	decrypt_patch_batch(
+		(patch_body_t *) job->out + first,
+		(const epatch_file_t *)( job->in + first * sizeof(epatch_file_t) ),
+		(int *) job->status + first,
+		count );
+}
+
+static void pypt_encrypt_one( void *_job, int idx ) {
+	pypt_job_t *job = _job;
+	const pack_entry_t *in;
+	epatch_file_t *out;
+	uint32_t base;
+
+	in  = (const pack_entry_t *)( job->in + idx * sizeof(pack_entry_t) );
+	out = (epatch_file_t *) job->out + idx;
+
+	if ( !cpukeys_lookup( in->header.proc_sig, &base ) ) {
+		job->status[idx] = DECRYPT_UNKNOWN_KEY;
+		return;
+	}
+
+	encrypt_patch_body(
+		&out->body,
+		&in->body,
+		in->header.proc_sig,
+		in->key_seed );
+	memcpy( &out->header, &in->header, sizeof(patch_hdr_t) );
+	job->status[idx] = DECRYPT_OK;
+}
+
+/**
+ * Runs a batch job on the worker pool with the GIL released.
+ */
+static void pypt_run( workpool_fn_t fn, pypt_job_t *job, int count,
+                      int threads ) {
+	Py_BEGIN_ALLOW_THREADS
+	workpool_run_n( fn, job, count, threads );
+	Py_END_ALLOW_THREADS
+}
+
+/**
+ * Gets the input buffer of a batch call and the number of records in it.
+ */
+static int pypt_get_input( PyObject *data, Py_buffer *in, size_t recsize,
+                           Py_ssize_t *count ) {
+	if ( PyObject_GetBuffer( data, in, PyBUF_SIMPLE ) )
+		return -1;
+
+	if ( in->len % recsize ) {
+		PyErr_Format( PyExc_ValueError,
+		              "input size is not a multiple of %zu bytes",
+		              recsize );
+		PyBuffer_Release( in );
+		return -1;
+	}
+
+	*count = in->len / recsize;
+	if ( *count > INT32_MAX ) {
+		PyErr_SetString( PyExc_ValueError, "too many records" );
+		PyBuffer_Release( in );
+		return -1;
+	}
+
+	return 0;
+}
+
+PyDoc_STRVAR( pypt_decrypt_doc,
+"decrypt(data, threads=0) -> (msram, cr_ops, status)\n\n"
+"Decrypts a buffer of concatenated encrypted patch files. Returns views of\n"
+"shape (N, 168) holding the MSRAM contents, (N, 16, 4) holding the control\n"
+"register ops as address, mask, value and integrity (always zero), and (N,)\n"
+"holding the DECRYPT_ status flags of every patch.");
+
+static PyObject *pypt_decrypt( PyObject *self, PyObject *args,
+                               PyObject *kwargs ) {
+	static char *kwlist[] = { "data", "threads", NULL };
+	PyObject *data, *storage, *result;
+	Py_buffer in;
+	Py_ssize_t n, body_size;
+	pypt_job_t job;
+	void *buf;
+	int threads = 0;
+
+	if ( !PyArg_ParseTupleAndKeywords( args, kwargs, "O|i", kwlist,
+	                                   &data, &threads ) )
+		return NULL;
+
+	if ( pypt_get_input( data, &in, sizeof(epatch_file_t), &n ) )
+		return NULL;
+
+	body_size = sizeof(patch_body_t);
+	storage = pypt_storage_new( n * ( body_size + sizeof(uint32_t) ), &buf );
+	if ( !storage ) {
+		PyBuffer_Release( &in );
+		return NULL;
+	}
+
+	job.in     = in.buf;
+	job.out    = buf;
+	job.status = (uint32_t *)( (uint8_t *) buf + n * body_size );
+	job.count  = n;
+
+	pypt_run( pypt_decrypt_chunk, &job,
+	          ( n + PYPT_DECRYPT_CHUNK - 1 ) / PYPT_DECRYPT_CHUNK, threads );
+	PyBuffer_Release( &in );
+
+	result = Py_BuildValue( "(NNN)",
+		pypt_view_new( storage, job.out, "I", sizeof(uint32_t), 2,
+		               n, body_size,
+		               (Py_ssize_t) MSRAM_DWORD_COUNT,
+		               (Py_ssize_t) sizeof(uint32_t) ),
+		pypt_view_new( storage, job.out + sizeof(uint32_t) *
+		                                  MSRAM_DWORD_COUNT,
+		               "I", sizeof(uint32_t), 3,
+		               n, body_size,
+		               (Py_ssize_t) PATCH_CR_OP_COUNT,
+		               (Py_ssize_t) sizeof(patch_cr_op_t),
+		               (Py_ssize_t) 4,
+		               (Py_ssize_t) sizeof(uint32_t) ),
+		pypt_view_new( storage, job.status, "I", sizeof(uint32_t), 1,
+		               n, (Py_ssize_t) sizeof(uint32_t) ) );
+
+	Py_DECREF( storage );
+	return result;
+}
+
+PyDoc_STRVAR( pypt_encrypt_doc,
+"encrypt(entries, threads=0) -> (patches, status)\n\n"
+"Encrypts a buffer of concatenated pack file entries (header, key seed,\n"
+"reserved word and plaintext body). Returns a view of shape (N, 992)\n"
+"holding the encrypted patch files and a view of shape (N,) holding the\n"
+"DECRYPT_ status flags, DECRYPT_UNKNOWN_KEY for unsupported processors.");
+
+static PyObject *pypt_encrypt( PyObject *self, PyObject *args,
+                               PyObject *kwargs ) {
+	static char *kwlist[] = { "entries", "threads", NULL };
+	PyObject *data, *storage, *result;
+	Py_buffer in;
+	Py_ssize_t n, file_size;
+	pypt_job_t job;
+	void *buf;
+	int threads = 0;
+
+	if ( !PyArg_ParseTupleAndKeywords( args, kwargs, "O|i", kwlist,
+	                                   &data, &threads ) )
+		return NULL;
+
+	if ( pypt_get_input( data, &in, sizeof(pack_entry_t), &n ) )
+		return NULL;
+
+	file_size = sizeof(epatch_file_t);
+	storage = pypt_storage_new( n * ( file_size + sizeof(uint32_t) ), &buf );
+	if ( !storage ) {
+		PyBuffer_Release( &in );
+		return NULL;
+	}
+
+	job.in     = in.buf;
+	job.out    = buf;
+	job.status = (uint32_t *)( (uint8_t *) buf + n * file_size );
+
+	pypt_run( pypt_encrypt_one, &job, n, threads );
+	PyBuffer_Release( &in );
+
+	result = Py_BuildValue( "(NN)",
+		pypt_view_new( storage, job.out, "B", 1, 2,
+		               n, file_size,
+		               file_size, (Py_ssize_t) 1 ),
+		pypt_view_new( storage, job.status, "I", sizeof(uint32_t), 1,
+		               n, (Py_ssize_t) sizeof(uint32_t) ) );
+
+	Py_DECREF( storage );
+	return result;
+}
+
+static PyMethodDef pypt_methods[] = {
+	{ "decrypt", (PyCFunction)(void (*)(void)) pypt_decrypt,
+	  METH_VARARGS | METH_KEYWORDS, pypt_decrypt_doc },
+	{ "encrypt", (PyCFunction)(void (*)(void)) pypt_encrypt,
+	  METH_VARARGS | METH_KEYWORDS, pypt_encrypt_doc },
+	{ NULL, NULL, 0, NULL }
+};
+
+static struct PyModuleDef pypt_module = {
+	PyModuleDef_HEAD_INIT,
+	.m_name    = "pypatchtools",
+	.m_doc     = "Batch decryption and encryption of Pentium II patches",
+	.m_size    = -1,
+	.m_methods = pypt_methods,
+};
+
+PyMODINIT_FUNC PyInit_pypatchtools( void ) {
+	PyObject *m;
+
+	if ( PyType_Ready( &pypt_view_type ) < 0 )
+		return NULL;
+
+	m = PyModule_Create( &pypt_module );
+	if ( !m )
+		return NULL;
+
+	PyModule_AddIntConstant( m, "DECRYPT_OK",            DECRYPT_OK );
+	PyModule_AddIntConstant( m, "DECRYPT_MISSING_FPROM", DECRYPT_MISSING_FPROM );
+	PyModule_AddIntConstant( m, "DECRYPT_BAD_ICV",       DECRYPT_BAD_ICV );
+	PyModule_AddIntConstant( m, "DECRYPT_UNKNOWN_KEY",   DECRYPT_UNKNOWN_KEY );
+	PyModule_AddIntConstant( m, "PATCH_SIZE",  sizeof(epatch_file_t) );
+	PyModule_AddIntConstant( m, "ENTRY_SIZE",  sizeof(pack_entry_t) );
+
+	return m;
+}
@@ -0,0 +1,190 @@
+#include <stdint.h>
+#include <string.h>
+#include "crypto.h"
+
+/**
+ * Decryption of a single cipher stream as a prefix scan. For a fixed key the
+ * blockfunc is linear over GF(2), so every decrypt step is the affine map
+ *     state_i = M * state_{i-1} ^ ciphertext_i
+ * and running n steps from a state S ends in M^n * S ^ T, where T is where
+ * the same n steps end when started from zero. The stream is cut into one
+ * chunk per lane, all chunks are run from zero at once, the true start state
+ * of every chunk is found by applying M^n to the end of the previous one, and
+ * the chunks are run again from their true start states. This takes twice
+ * the blockfuncs, but the lanes clock them CRYPTO_LANES at a time instead of
+ * one after the other.
+ */
+
+/** Streams shorter than this many words per lane are decrypted serially */
+#define SCAN_MIN_CHUNK (4)
+
+/* M^n for the key and chunk length last used by this thread */
+static __thread uint32_t scan_key;
+static __thread int scan_len;
+static __thread uint32_t scan_pow[32];
+
+/**
+ * Applies a GF(2) matrix, given as its columns, to a vector.
+ */
+static uint32_t gf2_apply( const uint32_t *m, uint32_t x ) {
+	uint32_t r;
+	int b;
+
+	for ( r = 0, b = 0; b < 32; b++ )
+		r ^= m[b] & -( ( x >> b ) & 1 );
+
+	return r;
+}
+
+/**
+ * Multiplies two GF(2) matrices, out = a * b. out may alias either input.
+ * The columns of b are multiplied CRYPTO_LANES at a time.
+ */
+static void gf2_mul( uint32_t *out, const uint32_t *a, const uint32_t *b ) {
+	crypto_lanes_t x, r[ 32 / CRYPTO_LANES ];
+	int j, k;
+
+	for ( j = 0; j < 32 / CRYPTO_LANES; j++ ) {
+		memcpy( &x, b + j * CRYPTO_LANES, sizeof x );
+		r[j] = x ^ x;
+		for ( k = 0; k < 32; k++ )
+			r[j] ^= a[k] & -( ( x >> k ) & 1 );
+	}
+	memcpy( out, r, sizeof r );
+}
+
+/**
+ * Computes M^n, the linear part of n decrypt steps, for a key.
+ */
+static void scan_power( uint32_t *out, uint32_t key, int n ) {
+	crypto_lanes_ctx_t ctx;
+	crypto_lanes_t zero;
+	uint32_t m[32], keys[ CRYPTO_LANES ];
+	int b;
+
+	for ( b = 0; b < CRYPTO_LANES; b++ )
+		keys[b] = key;
+	for ( b = 0; b < 32; b++ )
+		out[b] = 1u << b;
+
+	/* A step from a basis vector with a zero ciphertext ends in the
+	 * corresponding column */
+	for ( b = 0; b < 32; b += CRYPTO_LANES ) {
+		crypto_lanes_init( &ctx, keys, out + b );
+		zero = ctx.state ^ ctx.state;
+		crypto_lanes_decrypt( &ctx, &zero );
+		memcpy( m + b, &ctx.state, sizeof ctx.state );
+	}
+
+	/* Square and multiply */
+	for ( ; n; n >>= 1 ) {
+		if ( n & 1 )
+			gf2_mul( out, m, out );
+		if ( n > 1 )
+			gf2_mul( m, m, m );
+	}
+}
+
+/**
+ * Decrypts a cipher stream one word after the other.
+ */
+static void crypto_scan_serial(
+	uint32_t key,
+	uint32_t iv,
+	const uint32_t *ct,
+	uint32_t *pt,
+	uint32_t *state,
+	int count ) {
+	crypto_ctx_t saved;
+	int i;
+
+	crypto_save( &saved );
+	crypto_init( key, iv );
+	for ( i = 0; i < count; i++ ) {
+		if ( state )
+			state[i] = crypto_getstate();
+		pt[i] = crypto_decrypt( ct[i] );
+	}
+	crypto_restore( &saved );
+}
+
+/**
+ * Decrypts a cipher stream, as crypto_init followed by crypto_decrypt on every
+ * word would, but with the chain evaluated as a parallel prefix scan over the
+ * cipher lanes. The thread cipher state is not used or changed.
+ * @param key      The key
+ * @param iv       The initialization vector
+ * @param ct       The ciphertext words in cipher order
+ * @param pt       Receives the plaintext words
+ * @param state    If not NULL, receives the cipher state before every word
+ *                 is decrypted, from which ICVs are derived
+ * @param count    The number of words in the stream
+ */
+void crypto_scan_decrypt(
+	uint32_t key,
+	uint32_t iv,
+	const uint32_t *ct,
+	uint32_t *pt,
+	uint32_t *state,
+	int count ) {
+	crypto_lanes_ctx_t ctx;
+	crypto_lanes_t words;
+	uint32_t keys[ CRYPTO_LANES ], start[ CRYPTO_LANES ];
+	int len, l, i, pos;
+
+	len = ( count + CRYPTO_LANES - 1 ) / CRYPTO_LANES;
+
+	if ( len < SCAN_MIN_CHUNK ) {
+		crypto_scan_serial( key, iv, ct, pt, state, count );
+		return;
+	}
+
+	for ( l = 0; l < CRYPTO_LANES; l++ ) {
+		keys[l]  = key;
+		start[l] = l == 0 ? iv : 0;
+	}
+
+	/* Run every chunk from zero, the first one from the IV */
+	crypto_lanes_init( &ctx, keys, start );
+	for ( i = 0; i < len; i++ ) {
+		for ( l = 0; l < CRYPTO_LANES; l++ ) {
+			pos = l * len + i;
+			words[l] = pos < count ? ct[ pos ] : 0;
+		}
+		crypto_lanes_decrypt( &ctx, &words );
+	}
+
+	if ( scan_len != len || scan_key != key ) {
+		scan_power( scan_pow, key, len );
+		scan_key = key;
+		scan_len = len;
+	}
+
+	/* Carry the true state over the chunk boundaries */
+	start[0] = iv;
+	for ( l = 1; l < CRYPTO_LANES; l++ ) {
+		start[l] = ctx.state[ l - 1 ];
+		if ( l > 1 )
+			start[l] ^= gf2_apply( scan_pow, start[ l - 1 ] );
+	}
+
+	/* Run every chunk again from its true state */
+	crypto_lanes_init( &ctx, keys, start );
+	for ( l = 1; l < CRYPTO_LANES; l++ )
+		ctx.last_cword[l] = l * len - 1 < count ? ct[ l * len - 1 ] : 0;
+
+	for ( i = 0; i < len; i++ ) {
+		for ( l = 0; l < CRYPTO_LANES; l++ ) {
+			pos = l * len + i;
+			words[l] = pos < count ? ct[ pos ] : 0;
+			if ( state && pos < count )
+				state[ pos ] = ctx.state[l];
+		}
+		crypto_lanes_decrypt( &ctx, &words );
+		for ( l = 0; l < CRYPTO_LANES; l++ ) {
+			pos = l * len + i;
+			if ( pos < count )
+				pt[ pos ] = words[l];
+		}
+	}
+}
@@ -0,0 +1,178 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "stats.h"
+
+#ifdef PATCHTOOLS_STATS
+
+typedef struct {
+	char         *name;
+	stats_t       stats;
+} stats_patch_t;
+
+/** Counters of the current thread, merged into stats_total by stats_flush */
+__thread stats_t stats_local;
+
+/** Value of stats_local when the current patch was started */
+static __thread stats_t stats_mark;
+
+static stats_t stats_total;
+static stats_patch_t *stats_patches;
+static int stats_patch_count;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t stats_clock( void ) {
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Adds the difference of two sets of counters to another.
+ * @param dst      The counters to add to
+ * @param a        The counters to add
+ * @param b        The counters to subtract, may be NULL
+ */
+static void stats_accumulate(
+	stats_t *dst,
+	const stats_t *a,
+	const stats_t *b ) {
+	const uint64_t *pa = (const uint64_t *) a;
+	const uint64_t *pb = (const uint64_t *) b;
+	uint64_t *pd = (uint64_t *) dst;
+	int i;
+
+	for ( i = 0; i < sizeof(stats_t) / sizeof(uint64_t); i++ )
+		pd[i] += pa[i] - ( pb ? pb[i] : 0 );
+}
+
+int stats_enabled( void ) {
+	return 1;
+}
+
+/**
+ * Merges the counters of the calling thread into the totals. Must be called
+ * by every thread that did work before it exits.
+ */
+void stats_flush( void ) {
+	pthread_mutex_lock( &stats_lock );
+	stats_accumulate( &stats_total, &stats_local, NULL );
+	pthread_mutex_unlock( &stats_lock );
+	memset( &stats_local, 0, sizeof stats_local );
+	memset( &stats_mark,  0, sizeof stats_mark );
+}
+
+/**
+ * Marks the start of the processing of a single patch in batch mode.
+ */
+void stats_patch_begin( void ) {
+	memcpy( &stats_mark, &stats_local, sizeof stats_mark );
+}
+
+/**
+ * Marks the end of the processing of a single patch in batch mode and records
+ * the counters accumulated by it.
+ * @param name     The name to report the patch under
+ */
+void stats_patch_end( const char *name ) {
+	stats_patch_t *p;
+
+	pthread_mutex_lock( &stats_lock );
+	stats_patches = realloc( stats_patches,
+	                   (stats_patch_count + 1) * sizeof(stats_patch_t) );
+	if ( !stats_patches ) {
+		perror( "Could not allocate statistics" );
+		exit( EXIT_FAILURE );
+	}
+	p = stats_patches + stats_patch_count++;
+	p->name = strdup( name );
+	memset( &p->stats, 0, sizeof p->stats );
+	stats_accumulate( &p->stats, &stats_local, &stats_mark );
+	pthread_mutex_unlock( &stats_lock );
+}
+
+static void stats_write_counter( FILE *file, const char *indent,
+                                 const char *name, uint64_t value ) {
+	fprintf( file, "%s\"%s\": %" PRIu64 ",\n", indent, name, value );
+}
+
+static void stats_write( FILE *file, const stats_t *s, const char *indent ) {
+	const char *sep = "";
+	int i;
+
+	stats_write_counter( file, indent, "blockfunc",     s->blockfunc );
+	stats_write_counter( file, indent, "encrypt_words", s->encrypt_words );
+	stats_write_counter( file, indent, "decrypt_words", s->decrypt_words );
+	stats_write_counter( file, indent, "seed_attempts", s->seed_attempts );
+	stats_write_counter( file, indent, "icv_pass",      s->icv_pass );
+	stats_write_counter( file, indent, "icv_fail",      s->icv_fail );
+	stats_write_counter( file, indent, "parse_ns",      s->parse_ns );
+	stats_write_counter( file, indent, "format_ns",     s->format_ns );
+	stats_write_counter( file, indent, "io_ns",         s->io_ns );
+	fprintf( file, "%s\"fprom_miss\": {", indent );
+	for ( i = 0; i < STATS_FPROM_SIZE; i++ ) {
+		if ( !s->fprom_miss[i] )
+			continue;
+		fprintf( file, "%s\"0x%03X\": %" PRIu64,
+		         sep, i, s->fprom_miss[i] );
+		sep = ", ";
+	}
+	fprintf( file, "}\n" );
+}
+
+/**
+ * Writes the collected statistics as a JSON object.
+ * @param file     The stream to write to
+ */
+void stats_report( FILE *file ) {
+	const char *name;
+	int i;
+
+	stats_flush();
+
+	fprintf( file, "{\n\t\"total\": {\n" );
+	stats_write( file, &stats_total, "\t\t" );
+	fprintf( file, "\t},\n\t\"patches\": [" );
+	for ( i = 0; i < stats_patch_count; i++ ) {
+		fprintf( file, "%s\n\t\t{\n\t\t\t\"name\": \"", i ? "," : "" );
+		for ( name = stats_patches[i].name; *name; name++ ) {
+			/* Escape the characters that would end the string */
+			if ( *name == '"' || *name == '\\' )
+				fputc( '\\', file );
+			fputc( *name, file );
+		}
+		fprintf( file, "\",\n" );
+		stats_write( file, &stats_patches[i].stats, "\t\t\t" );
+		fprintf( file, "\t\t}" );
+		free( stats_patches[i].name );
+	}
+	fprintf( file, "%s]\n}\n", stats_patch_count ? "\n\t" : "" );
+
+	free( stats_patches );
+	stats_patches = NULL;
+	stats_patch_count = 0;
+}
+
+#else
+
+int stats_enabled( void ) {
+	return 0;
+}
+
+void stats_flush( void ) {
+}
+
+void stats_patch_begin( void ) {
+}
+
+void stats_patch_end( const char *name ) {
+}
+
+void stats_report( FILE *file ) {
+}
+
+#endif
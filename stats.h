@@ -0,0 +1,56 @@
+#ifndef __stats_h__
+#define __stats_h__
+#include <stdio.h>
+#include <stdint.h>
+
+#define STATS_FPROM_SIZE (512)
+
+/**
+ * Hot path counters and timers. These are only compiled in when building with
+ * PATCHTOOLS_STATS defined (make STATS=1), otherwise the macros below expand
+ * to nothing.
+ */
+typedef struct {
+	uint64_t      blockfunc;
+	uint64_t      encrypt_words;
+	uint64_t      decrypt_words;
+	uint64_t      seed_attempts;
+	uint64_t      icv_pass;
+	uint64_t      icv_fail;
+	uint64_t      parse_ns;
+	uint64_t      format_ns;
+	uint64_t      io_ns;
+	uint64_t      fprom_miss[ STATS_FPROM_SIZE ];
+} stats_t;
+
+#ifdef PATCHTOOLS_STATS
+
+extern __thread stats_t stats_local;
+
+uint64_t stats_clock( void );
+
+#define STAT_INC( c )        ( stats_local.c++ )
+#define STAT_ADD( c, n )     ( stats_local.c += (n) )
+#define STAT_TIMER( t )      uint64_t t = stats_clock()
+#define STAT_ELAPSED( c, t ) ( stats_local.c += stats_clock() - (t) )
+
+#else
+
+#define STAT_INC( c )        do {} while ( 0 )
+#define STAT_ADD( c, n )     do {} while ( 0 )
+#define STAT_TIMER( t )      do {} while ( 0 )
+#define STAT_ELAPSED( c, t ) do {} while ( 0 )
+
+#endif
+
+int stats_enabled( void );
+
+void stats_flush( void );
+
+void stats_patch_begin( void );
+
+void stats_patch_end( const char *name );
+
+void stats_report( FILE *file );
+
+#endif
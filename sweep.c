@@ -0,0 +1,277 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stddef.h>
+#include "patchtools.h"
+#include "patchfile.h"
+#include "stats.h"
+
+#define SWEEP_MAX_DIMS   (64)
+
+/**
+ * A single swept word of the patch body, given as its word index in the body,
+ * together with the list of values it should take.
+ */
+typedef struct {
+	int       word;
+	uint32_t *values;
+	int       count;
+} sweep_dim_t;
+
+typedef struct {
+	const patch_hdr_t  *hdr;
+	const patch_body_t *base;
+	const char         *prefix;
+	uint32_t            seed;
+	int                 dim_count;
+	sweep_dim_t         dims[ SWEEP_MAX_DIMS ];
+	uint32_t           *seeds;
+} sweep_t;
+
+static char sweep_line_buf[4096];
+
+/**
+ * Parses a value list of the form "item[,item...]" where each item is either
+ * a single value, a range "lo-hi" or a stepped range "lo-hi/step".
+ * @param dim      The sweep dimension to append the values to
+ * @param list     The value list to parse
+ */
+static void sweep_parse_values( sweep_dim_t *dim, char *list ) {
+	char *item, *save, *hi_s, *step_s;
+	uint32_t lo, hi, step;
+	uint64_t v;
+
+	for ( item = strtok_r( list, ",", &save ); item;
+	      item = strtok_r( NULL, ",", &save ) ) {
+		step_s = strchr( item, '/' );
+		if ( step_s )
+			*step_s++ = 0;
+		hi_s = strchr( item, '-' );
+		if ( hi_s )
+			*hi_s++ = 0;
+
+		lo   = strtoul( item, NULL, 0 );
+		hi   = hi_s   ? strtoul( hi_s,   NULL, 0 ) : lo;
+		step = step_s ? strtoul( step_s, NULL, 0 ) : 1;
+
+		if ( hi < lo || step == 0 ) {
+			fprintf( stderr, "Invalid sweep range: 0x%08X-0x%08X/%u\n",
+			         lo, hi, step );
+			exit( EXIT_FAILURE );
+		}
+
+		for ( v = lo; v <= hi; v += step ) {
+			dim->values = realloc( dim->values,
+			                   (dim->count + 1) * sizeof(uint32_t) );
+			if ( !dim->values ) {
+				perror( "Could not allocate sweep values" );
+				exit( EXIT_FAILURE );
+			}
+			dim->values[ dim->count++ ] = v;
+		}
+	}
+}
+
+/**
+ * Reads a sweep specification. Every line selects one word of the patch body
+ * and the values it should be swept over:
+ *
+ *     write_creg <n> <address|mask|value> <values>
+ *     msram <address> <values>
+ *
+ * Where <n> is the index of the control register op and <address> is the
+ * MSRAM dword address as used in the MSRAM hexdump file.
+ */
+static void read_sweep_spec( sweep_t *sweep, const char *filename ) {
+	FILE *file;
+	char *par_n, *par_v, *par_v2, *par_v3, *save;
+	sweep_dim_t *dim;
+	size_t op;
+	uint32_t idx;
+
+	file = fopen( filename, "r" );
+	if ( !file ) {
+		perror( "Could not open sweep spec input file" );
+		exit( EXIT_FAILURE );
+	}
+
+	while ( fgets( sweep_line_buf, sizeof sweep_line_buf, file ) ) {
+		par_n = strtok_r( sweep_line_buf, " \t\n", &save );
+		if ( !par_n || par_n[0] == '#' )
+			continue;
+
+		if ( sweep->dim_count >= SWEEP_MAX_DIMS ) {
+			fprintf( stderr, "Too many sweep statements\n" );
+			exit( EXIT_FAILURE );
+		}
+		dim = sweep->dims + sweep->dim_count;
+
+		par_v  = strtok_r( NULL, " \t\n", &save );
+		par_v2 = strtok_r( NULL, " \t\n", &save );
+		if ( !par_v || !par_v2 ) {
+			fprintf( stderr, "Incomplete sweep statement \"%s\"\n",
+			         par_n );
+			exit( EXIT_FAILURE );
+		}
+
+		if ( strcmp( par_n, "write_creg" ) == 0 ) {
+			par_v3 = strtok_r( NULL, " \t\n", &save );
+			idx = strtoul( par_v, NULL, 0 );
+			if ( !par_v3 || idx >= PATCH_CR_OP_COUNT ) {
+				fprintf( stderr, "Invalid write_creg sweep\n" );
+				exit( EXIT_FAILURE );
+			}
+			op = offsetof( patch_body_t, cr_ops ) +
+			     idx * sizeof(patch_cr_op_t);
+			if ( strcmp( par_v2, "address" ) == 0 )
+				op += offsetof( patch_cr_op_t, address );
+			else if ( strcmp( par_v2, "mask" ) == 0 )
+				op += offsetof( patch_cr_op_t, mask );
+			else if ( strcmp( par_v2, "value" ) == 0 )
+				op += offsetof( patch_cr_op_t, value );
+			else {
+				fprintf( stderr, "Unknown write_creg field \"%s\"\n",
+				         par_v2 );
+				exit( EXIT_FAILURE );
+			}
+			dim->word = op / sizeof(uint32_t);
+			sweep_parse_values( dim, par_v3 );
+			if ( strcmp( par_v2, "address" ) == 0 ) {
+				for ( idx = 0; idx < dim->count; idx++ ) {
+					if ( dim->values[idx] & ~0x1FF ) {
+						fprintf( stderr,
+						"Invalid creg address: 0x%03X\n",
+						dim->values[idx] );
+						exit( EXIT_FAILURE );
+					}
+				}
+			}
+		} else if ( strcmp( par_n, "msram" ) == 0 ) {
+			idx = strtoul( par_v, NULL, 16 );
+			if ( idx < MSRAM_BASE_ADDRESS * 8 ||
+			     idx - MSRAM_BASE_ADDRESS * 8 >= MSRAM_DWORD_COUNT ) {
+				fprintf( stderr,
+				         "Address not in MSRAM range :%08X\n",
+				         idx );
+				exit( EXIT_FAILURE );
+			}
+			dim->word = offsetof( patch_body_t, msram ) /
+			            sizeof(uint32_t) + idx - MSRAM_BASE_ADDRESS * 8;
+			sweep_parse_values( dim, par_v2 );
+		} else {
+			fprintf( stderr, "Unknown sweep statement \"%s\"\n",
+			         par_n );
+			exit( EXIT_FAILURE );
+		}
+
+		sweep->dim_count++;
+	}
+
+	fclose( file );
+}
+
+/**
+ * Gets the value index of a sweep dimension for a given variant. The variant
+ * index is decoded as a mixed radix number with one digit per dimension, the
+ * last dimension being the least significant.
+ */
+static int sweep_digit( const sweep_t *sweep, int index, int dim ) {
+	int d;
+
+	for ( d = sweep->dim_count - 1; d > dim; d-- )
+		index /= sweep->dims[d].count;
+
+	return index % sweep->dims[dim].count;
+}
+
+/**
+ * Builds and writes a single variant of the sweep.
+ */
+static void sweep_variant( void *_sweep, int index ) {
+	sweep_t *sweep = _sweep;
+	patch_body_t body;
+	epatch_file_t out;
+	char path[4096];
+	uint32_t *words = (uint32_t *) &body;
+	int d;
+
+	stats_patch_begin();
+	memcpy( &body, sweep->base, sizeof body );
+
+	for ( d = 0; d < sweep->dim_count; d++ )
+		words[ sweep->dims[d].word ] =
+			sweep->dims[d].values[ sweep_digit( sweep, index, d ) ];
+
+	/* Every variant gets its own seed search */
+	encrypt_patch_body( &out.body, &body, sweep->hdr->proc_sig, sweep->seed );
+	memcpy( &out.header, sweep->hdr, sizeof(patch_hdr_t) );
+	sweep->seeds[index] = out.body.key_seed;
+
+	snprintf( path, sizeof path, "%s_%d.dat", sweep->prefix, index );
+	outq_write( path, &out, sizeof out );
+	stats_patch_end( path );
+}
+
+/**
+ * Creates every variant of a patch described by a sweep specification.
+ * The variants are encrypted in parallel and written to <prefix>_<n>.dat,
+ * a listing of the variants and their swept values is printed to stdout.
+ *
+ * @param hdr      The header for all variants
+ * @param base     The parsed base patch body
+ * @param seed     The initial key seed to be tried for every variant
+ * @param spec     Path of the sweep specification
+ * @param prefix   Prefix of the output paths
+ */
+void create_sweep(
+	const patch_hdr_t *hdr,
+	const patch_body_t *base,
+	uint32_t seed,
+	const char *spec,
+	const char *prefix ) {
+
+	sweep_t sweep;
+	int d, i, count;
+
+	memset( &sweep, 0, sizeof sweep );
+	sweep.hdr    = hdr;
+	sweep.base   = base;
+	sweep.seed   = seed;
+	sweep.prefix = prefix;
+
+	read_sweep_spec( &sweep, spec );
+
+	count = 1;
+	for ( d = 0; d < sweep.dim_count; d++ ) {
+		if ( sweep.dims[d].count > INT_MAX / count ) {
+			fprintf( stderr, "Too many sweep variants\n" );
+			exit( EXIT_FAILURE );
+		}
+		count *= sweep.dims[d].count;
+	}
+
+	/* Fail early if we do not know the key for this CPU */
+	cpukeys_get_base( hdr->proc_sig );
+
+	sweep.seeds = calloc( count, sizeof(uint32_t) );
+	if ( !sweep.seeds ) {
+		perror( "Could not allocate sweep variants" );
+		exit( EXIT_FAILURE );
+	}
+
+	workpool_run( sweep_variant, &sweep, count );
+
+	for ( i = 0; i < count; i++ ) {
+		printf( "%s_%d.dat key_seed 0x%08X", prefix, i, sweep.seeds[i] );
+		for ( d = 0; d < sweep.dim_count; d++ )
+			printf( " 0x%08X",
+			        sweep.dims[d].values[ sweep_digit( &sweep, i, d ) ] );
+		printf( "\n" );
+	}
+
+	for ( d = 0; d < sweep.dim_count; d++ )
+		free( sweep.dims[d].values );
+	free( sweep.seeds );
+}
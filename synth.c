@@ -0,0 +1,221 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "patchtools.h"
+#include "patchfile.h"
+
+/** Number of patches generated in parallel before they are written out */
+#define SYNTH_BLOCK      (4096)
+
+#define SYNTH_RANDOM     (0)
+#define SYNTH_PATTERN    (1)
+
+typedef struct {
+	uint64_t       seed;
+	int            pattern;
+	uint32_t       sigs[ 0x100 ];
+	int            sig_count;
+	int64_t        first;
+	epatch_file_t *cipher;
+	patch_body_t  *plain;
+} synth_t;
+
+/**
+ * The splitmix64 generator, also used to derive an independent stream for
+ * every patch from the corpus seed and the patch index.
+ */
+static uint64_t synth_next( uint64_t *state ) {
+	uint64_t z;
+
+	z = ( *state += 0x9E3779B97F4A7C15ull );
+	z = ( z ^ ( z >> 30 ) ) * 0xBF58476D1CE4E5B9ull;
+	z = ( z ^ ( z >> 27 ) ) * 0x94D049BB133111EBull;
+	return z ^ ( z >> 31 );
+}
+
+static uint32_t synth_rand( uint64_t *state ) {
+	return synth_next( state ) >> 32;
+}
+
+/**
+ * Converts a number below 100 to BCD.
+ */
+static uint32_t synth_bcd( uint32_t v ) {
+	return ( ( v / 10 ) << 4 ) | ( v % 10 );
+}
+
+/**
+ * Generates, encrypts and stores a single patch of the current block.
+ */
+static void synth_worker( void *_synth, int idx ) {
+	synth_t *synth = _synth;
+	epatch_file_t *out = synth->cipher + idx;
+	patch_body_t *body = synth->plain + idx;
+	patch_hdr_t hdr;
+	uint64_t n, rng;
+	uint32_t year, seed;
+	int i;
+
+	/* Every patch depends only on the corpus seed and its own index */
+	n   = synth->first + idx;
+	rng = synth->seed ^ ( n * 0xD1B54A32D192ED03ull );
+	synth_next( &rng );
+
+	memset( &hdr, 0, sizeof hdr );
+	year = 1997 + synth_rand( &rng ) % 7;
+	hdr.header_ver = 1;
+	hdr.update_rev = 1 + synth_rand( &rng ) % 0x40;
+	hdr.date_bcd   = synth_bcd( 1 + synth_rand( &rng ) % 12 ) << 24 |
+	                 synth_bcd( 1 + synth_rand( &rng ) % 28 ) << 16 |
+	                 synth_bcd( year / 100 ) << 8 |
+	                 synth_bcd( year % 100 );
+	hdr.proc_sig   = synth->sigs[ n % synth->sig_count ];
+	hdr.loader_ver = 1;
+	hdr.proc_flags = 1 << ( synth_rand( &rng ) % 8 );
+	seed           = synth_rand( &rng );
+
+	memset( body, 0, sizeof(patch_body_t) );
+	for ( i = 0; i < MSRAM_DWORD_COUNT; i++ ) {
+		if ( synth->pattern == SYNTH_PATTERN )
+			body->msram[i] = (uint32_t) n << 16 |
+			                 ( MSRAM_BASE_ADDRESS * 8 + i );
+		else
+			body->msram[i] = synth_rand( &rng );
+	}
+
+	/* Control register addresses stay in the range real patches use */
+	for ( i = 0; i < PATCH_CR_OP_COUNT; i++ ) {
+		if ( synth->pattern == SYNTH_PATTERN ) {
+			body->cr_ops[i].address = 0x100 + i;
+			body->cr_ops[i].mask    = 0xFFFFFFFF;
+			body->cr_ops[i].value   = (uint32_t) n;
+		} else {
+			body->cr_ops[i].address = synth_rand( &rng ) % 0x200;
+			body->cr_ops[i].mask    = synth_rand( &rng );
+			body->cr_ops[i].value   = synth_rand( &rng );
+		}
+	}
+
+	memcpy( &out->header, &hdr, sizeof hdr );
+	encrypt_patch_body( &out->body, body, hdr.proc_sig, seed );
+}
+
+/**
+ * Parses a generator specification of the form "count[:seed[:pattern]]".
+ * @return         The number of patches to generate
+ */
+static int64_t synth_parse( synth_t *synth, const char *spec ) {
+	char *buf, *seed_s, *pattern_s;
+	int64_t count;
+
+	buf = strdup( spec );
+	if ( !buf ) {
+		perror( "Could not allocate generator specification" );
+		exit( EXIT_FAILURE );
+	}
+
+	seed_s = strchr( buf, ':' );
+	if ( seed_s )
+		*seed_s++ = 0;
+	pattern_s = seed_s ? strchr( seed_s, ':' ) : NULL;
+	if ( pattern_s )
+		*pattern_s++ = 0;
+
+	count          = strtoll( buf, NULL, 0 );
+	synth->seed    = seed_s ? strtoull( seed_s, NULL, 0 ) : 0;
+	synth->pattern = SYNTH_RANDOM;
+	if ( pattern_s && strcmp( pattern_s, "pattern" ) == 0 )
+		synth->pattern = SYNTH_PATTERN;
+	else if ( pattern_s && strcmp( pattern_s, "random" ) ) {
+		fprintf( stderr, "Unknown generator pattern: %s\n", pattern_s );
+		exit( EXIT_FAILURE );
+	}
+
+	free( buf );
+	return count;
+}
+
+static FILE *synth_open( char *tmp, size_t size, const char *path ) {
+	FILE *file;
+
+	snprintf( tmp, size, "%s.tmp", path );
+	file = fopen( tmp, "wb" );
+	if ( !file ) {
+		perror( "Could not open generator output file" );
+		exit( EXIT_FAILURE );
+	}
+
+	return file;
+}
+
+static void synth_close( FILE *file, const char *tmp, const char *path ) {
+	if ( fclose( file ) || rename( tmp, path ) ) {
+		perror( "Could not write generator output file" );
+		exit( EXIT_FAILURE );
+	}
+}
+
+/**
+ * Generates a corpus of valid encrypted patches for every supported processor
+ * signature in turn. The encrypted patches are concatenated into
+ * <prefix>.dat and their plaintext bodies, as decrypted by
+ * decrypt_patch_batch, are concatenated into <prefix>.plain. The output only
+ * depends on the specification, not on the number of threads.
+ * @param spec     The generator specification, "count[:seed[:pattern]]",
+ *                 where pattern is random (default) or pattern
+ * @param prefix   The prefix of the output files
+ */
+void generate_corpus( const char *spec, const char *prefix ) {
+	synth_t synth;
+	FILE *dat, *plain;
+	char dat_path[4096], dat_tmp[4200], plain_path[4096], plain_tmp[4200];
+	int64_t count;
+	uint32_t sig, base;
+	int n;
+
+	memset( &synth, 0, sizeof synth );
+	count = synth_parse( &synth, spec );
+	if ( count <= 0 ) {
+		fprintf( stderr, "Invalid generator patch count: %s\n", spec );
+		exit( EXIT_FAILURE );
+	}
+
+	for ( sig = 0x600; sig < 0x700; sig++ )
+		if ( cpukeys_lookup( sig, &base ) )
+			synth.sigs[ synth.sig_count++ ] = sig;
+
+	synth.cipher = calloc( SYNTH_BLOCK, sizeof(epatch_file_t) );
+	synth.plain  = calloc( SYNTH_BLOCK, sizeof(patch_body_t) );
+	if ( !synth.cipher || !synth.plain ) {
+		perror( "Could not allocate generator buffers" );
+		exit( EXIT_FAILURE );
+	}
+
+	snprintf( dat_path,   sizeof dat_path,   "%s.dat",   prefix );
+	snprintf( plain_path, sizeof plain_path, "%s.plain", prefix );
+	dat   = synth_open( dat_tmp,   sizeof dat_tmp,   dat_path );
+	plain = synth_open( plain_tmp, sizeof plain_tmp, plain_path );
+
+	for ( synth.first = 0; synth.first < count; synth.first += n ) {
+		n = count - synth.first < SYNTH_BLOCK ?
+		    count - synth.first : SYNTH_BLOCK;
+
+		workpool_run( synth_worker, &synth, n );
+
+		if ( fwrite( synth.cipher, sizeof(epatch_file_t), n, dat ) != n ||
+		     fwrite( synth.plain, sizeof(patch_body_t), n, plain ) != n ) {
+			perror( "Could not write generator output file" );
+			exit( EXIT_FAILURE );
+		}
+	}
+
+	synth_close( dat,   dat_tmp,   dat_path );
+	synth_close( plain, plain_tmp, plain_path );
+
+	printf( "Generated %lld patches for %d processor signatures in %s\n",
+	        (long long) count, synth.sig_count, dat_path );
+
+	free( synth.cipher );
+	free( synth.plain );
+}
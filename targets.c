@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "patchtools.h"
+#include "patchfile.h"
+#include "stats.h"
+
+#define TARGETS_MAX (256)
+
+/** A processor to package the patch for */
+typedef struct {
+	uint32_t      proc_sig;
+	uint32_t      proc_flags;
+	int           has_flags;
+	epatch_file_t out;
+} target_t;
+
+typedef struct {
+	const patch_hdr_t  *hdr;
+	const patch_body_t *body;
+	uint32_t            seed;
+	target_t           *targets;
+	int                 count;
+} targets_t;
+
+/**
+ * Parses a target list of the form "sig[:flags][,sig[:flags]...]".
+ * @return         The number of targets
+ */
+static int parse_targets( target_t *targets, const char *list ) {
+	char *buf, *item, *flags, *save;
+	uint32_t base;
+	int count = 0;
+
+	buf = strdup( list );
+	if ( !buf ) {
+		perror( "Could not allocate target list" );
+		exit( EXIT_FAILURE );
+	}
+
+	for ( item = strtok_r( buf, ",", &save ); item;
+	      item = strtok_r( NULL, ",", &save ) ) {
+		if ( count >= TARGETS_MAX ) {
+			fprintf( stderr, "Too many targets\n" );
+			exit( EXIT_FAILURE );
+		}
+
+		flags = strchr( item, ':' );
+		if ( flags )
+			*flags++ = 0;
+
+		targets[count].proc_sig   = strtoul( item, NULL, 0 );
+		targets[count].has_flags  = flags != NULL;
+		targets[count].proc_flags = flags ? strtoul( flags, NULL, 0 ) : 0;
+
+		/* Check up front instead of failing halfway through */
+		if ( !cpukeys_lookup( targets[count].proc_sig, &base ) ) {
+			fprintf( stderr, "Unknown cpu key for target CPUID: %03X\n",
+			         targets[count].proc_sig & 0xFFF );
+			exit( EXIT_FAILURE );
+		}
+
+		count++;
+	}
+
+	free( buf );
+	return count;
+}
+
+/**
+ * Encrypts the patch for a single target.
+ */
+static void target_worker( void *_targets, int idx ) {
+	targets_t *t = _targets;
+	target_t *target = t->targets + idx;
+	char name[32];
+
+	stats_patch_begin();
+
+	memcpy( &target->out.header, t->hdr, sizeof(patch_hdr_t) );
+	target->out.header.proc_sig = target->proc_sig;
+	if ( target->has_flags )
+		target->out.header.proc_flags = target->proc_flags;
+
+	encrypt_patch_body( &target->out.body, t->body, target->proc_sig,
+	                    t->seed );
+
+	snprintf( name, sizeof name, "%08X", target->proc_sig );
+	stats_patch_end( name );
+}
+
+/**
+ * Encrypts a patch for several processors in parallel. Every target gets its
+ * own header with the signature and, if given, processor flags replaced, and
+ * its own seed search.
+ * @param hdr         The patch header
+ * @param body        The plaintext patch body
+ * @param seed        The initial key seed for every target
+ * @param list        The target list, "sig[:flags][,sig[:flags]...]"
+ * @param prefix      Targets are written to <prefix>_<sig>[_<flags>].dat
+ * @param concat_path If not NULL, all targets are instead concatenated into
+ *                    a single multi-update file at this path.
+ */
+void create_targets(
+	const patch_hdr_t *hdr,
+	const patch_body_t *body,
+	uint32_t seed,
+	const char *list,
+	const char *prefix,
+	const char *concat_path ) {
+	targets_t t;
+	epatch_file_t *all;
+	char path[4096];
+	int i;
+
+	t.hdr     = hdr;
+	t.body    = body;
+	t.seed    = seed;
+	t.targets = calloc( TARGETS_MAX, sizeof(target_t) );
+	if ( !t.targets ) {
+		perror( "Could not allocate targets" );
+		exit( EXIT_FAILURE );
+	}
+	t.count   = parse_targets( t.targets, list );
+	if ( !t.count ) {
+		fprintf( stderr, "Empty target list\n" );
+		exit( EXIT_FAILURE );
+	}
+
+	workpool_run( target_worker, &t, t.count );
+
+	if ( concat_path ) {
+		all = calloc( t.count, sizeof(epatch_file_t) );
+		if ( !all ) {
+			perror( "Could not allocate output" );
+			exit( EXIT_FAILURE );
+		}
+		for ( i = 0; i < t.count; i++ )
+			memcpy( all + i, &t.targets[i].out, sizeof(epatch_file_t) );
+		outq_write( concat_path, all, t.count * sizeof(epatch_file_t) );
+		free( all );
+	}
+
+	for ( i = 0; i < t.count; i++ ) {
+		if ( t.targets[i].has_flags )
+			snprintf( path, sizeof path, "%s_%03X_%02X.dat", prefix,
+			          t.targets[i].proc_sig, t.targets[i].proc_flags );
+		else
+			snprintf( path, sizeof path, "%s_%03X.dat", prefix,
+			          t.targets[i].proc_sig );
+		if ( !concat_path )
+			outq_write( path, &t.targets[i].out, sizeof(epatch_file_t) );
+		printf( "%s: proc_sig 0x%08X proc_flags 0x%08X seed 0x%08X\n",
+		        concat_path ? concat_path : path,
+		        t.targets[i].out.header.proc_sig,
+		        t.targets[i].out.header.proc_flags,
+		        t.targets[i].out.body.key_seed );
+	}
+
+	free( t.targets );
+}
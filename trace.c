@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "trace.h"
+
+#ifdef PATCHTOOLS_TRACE
+
+/** Set once a trace file is open, checked by every traced step */
+int trace_active;
+
+/** Record buffer and chain position of the current thread */
+__thread trace_local_t trace_local = { .fprom_idx = TRACE_NO_FPROM };
+
+static FILE *trace_file;
+static uint32_t trace_next_chain;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int trace_enabled( void ) {
+	return 1;
+}
+
+/**
+ * Writes out the records buffered by the calling thread, allocating the
+ * buffer on first use.
+ */
+void trace_flush( void ) {
+	if ( !trace_local.buf ) {
+		trace_local.buf = malloc( TRACE_BUFFER_RECORDS *
+		                          sizeof(trace_record_t) );
+		if ( !trace_local.buf ) {
+			perror( "Could not allocate trace buffer" );
+			exit( EXIT_FAILURE );
+		}
+		trace_local.count = 0;
+		return;
+	}
+
+	pthread_mutex_lock( &trace_lock );
+	if ( trace_file && trace_local.count &&
+	     fwrite( trace_local.buf, sizeof(trace_record_t), trace_local.count,
+	             trace_file ) != trace_local.count ) {
+		pthread_mutex_unlock( &trace_lock );
+		perror( "Could not write trace file" );
+		exit( EXIT_FAILURE );
+	}
+	pthread_mutex_unlock( &trace_lock );
+
+	trace_local.count = 0;
+}
+
+/**
+ * Starts a new chain, called whenever the cipher state is loaded.
+ * @param key        The key
+ * @param last_cword The initial LastCWord, equal to the key for a new patch
+ * @param state      The initial state, the IV for a new patch
+ * @param flags      TRACE_RESTORE if the state was restored from a checkpoint
+ */
+void trace_begin(
+	uint32_t key,
+	uint32_t last_cword,
+	uint32_t state,
+	uint32_t flags ) {
+	if ( !trace_active )
+		return;
+
+	trace_local.chain = __atomic_fetch_add( &trace_next_chain, 1,
+	                                        __ATOMIC_RELAXED );
+	trace_local.fprom_idx = TRACE_NO_FPROM;
+
+	/* The index wraps around to 0 for the first step */
+	trace_local.index = TRACE_INDEX_INIT;
+	trace_step( key, state, last_cword, 0, flags );
+}
+
+/**
+ * Writes out and releases the trace buffer of a thread that is about to exit.
+ */
+void trace_thread_exit( void ) {
+	if ( !trace_local.buf )
+		return;
+	trace_flush();
+	free( trace_local.buf );
+	trace_local.buf = NULL;
+}
+
+/**
+ * Opens the trace file and starts recording cipher steps. The file is closed
+ * when the program exits, also when it exits because of an error, so that the
+ * steps leading up to a failed ICV are kept.
+ * @param path     The trace file to write
+ */
+void trace_open( const char *path ) {
+	trace_hdr_t hdr;
+
+	trace_file = fopen( path, "wb" );
+	if ( !trace_file ) {
+		perror( "Could not open trace file" );
+		exit( EXIT_FAILURE );
+	}
+
+	hdr.magic       = TRACE_MAGIC;
+	hdr.version     = TRACE_VERSION;
+	hdr.record_size = sizeof(trace_record_t);
+	hdr.resvd_0     = 0;
+	if ( fwrite( &hdr, sizeof hdr, 1, trace_file ) != 1 ) {
+		perror( "Could not write trace file" );
+		exit( EXIT_FAILURE );
+	}
+
+	atexit( trace_close );
+	__atomic_store_n( &trace_active, 1, __ATOMIC_RELEASE );
+}
+
+/**
+ * Writes out the records of the calling thread and closes the trace file.
+ */
+void trace_close( void ) {
+	if ( !trace_file )
+		return;
+
+	trace_thread_exit();
+
+	pthread_mutex_lock( &trace_lock );
+	trace_active = 0;
+	fclose( trace_file );
+	trace_file = NULL;
+	pthread_mutex_unlock( &trace_lock );
+}
+
+#else
+
+int trace_enabled( void ) {
+	return 0;
+}
+
+void trace_open( const char *path ) {
+}
+
+void trace_close( void ) {
+}
+
+void trace_thread_exit( void ) {
+}
+
+#endif
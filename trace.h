@@ -0,0 +1,90 @@
+#ifndef __trace_h__
+#define __trace_h__
+#include <stdint.h>
+#include "patchfile.h"
+
+/** Records buffered per thread before they are written out */
+#define TRACE_BUFFER_RECORDS (65536)
+
+/**
+ * Cipher state trace. Like the statistics, this is only compiled in when
+ * building with PATCHTOOLS_TRACE defined (make TRACE=1), otherwise the macros
+ * below expand to nothing. Even then, steps are only recorded once a trace
+ * file has been opened with trace_open.
+ */
+typedef struct {
+	trace_record_t *buf;
+	int             count;
+	uint32_t        chain;
+	uint32_t        index;
+	uint32_t        fprom_idx;
+} trace_local_t;
+
+#ifdef PATCHTOOLS_TRACE
+
+extern int trace_active;
+
+extern __thread trace_local_t trace_local;
+
+void trace_begin(
+	uint32_t key,
+	uint32_t last_cword,
+	uint32_t state,
+	uint32_t flags );
+
+void trace_flush( void );
+
+/**
+ * Appends a cipher step to the buffer of the calling thread.
+ */
+static inline void trace_step(
+	uint32_t ct,
+	uint32_t state,
+	uint32_t last_cword,
+	uint32_t pt,
+	uint32_t flags ) {
+	trace_record_t *r;
+
+	if ( !trace_active )
+		return;
+
+	if ( trace_local.count == TRACE_BUFFER_RECORDS || !trace_local.buf )
+		trace_flush();
+
+	r = trace_local.buf + trace_local.count++;
+	r->chain      = trace_local.chain;
+	r->index      = trace_local.index++;
+	r->ciphertext = ct;
+	r->state      = state;
+	r->last_cword = last_cword;
+	r->plaintext  = pt;
+	r->fprom_idx  = trace_local.fprom_idx;
+	r->flags      = flags;
+
+	trace_local.fprom_idx = TRACE_NO_FPROM;
+}
+
+#define TRACE_ACTIVE()                 ( trace_active )
+#define TRACE_BEGIN( k, lcw, s, f ) \
+	do { if ( trace_active ) trace_begin( k, lcw, s, f ); } while ( 0 )
+#define TRACE_ICV( idx )               ( trace_local.fprom_idx = (idx) )
+#define TRACE_STEP( ct, s, lcw, pt, f ) trace_step( ct, s, lcw, pt, f )
+
+#else
+
+#define TRACE_ACTIVE()                 ( 0 )
+#define TRACE_BEGIN( k, lcw, s, f )    do {} while ( 0 )
+#define TRACE_ICV( idx )               do {} while ( 0 )
+#define TRACE_STEP( ct, s, lcw, pt, f ) do {} while ( 0 )
+
+#endif
+
+int trace_enabled( void );
+
+void trace_open( const char *path );
+
+void trace_close( void );
+
+void trace_thread_exit( void );
+
+#endif
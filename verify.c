@@ -0,0 +1,211 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include "patchtools.h"
+#include "patchfile.h"
+
+/** Outcome of the round trip of a single patch */
+typedef struct {
+	const char   *error;
+	int           word;
+	uint32_t      expected;
+	uint32_t      actual;
+	char          message[256];
+} verify_result_t;
+
+typedef struct {
+	char *const     *paths;
+	verify_result_t *results;
+} verify_t;
+
+/**
+ * Opens a stream reading from a formatted buffer.
+ */
+static FILE *verify_open( char *buf, size_t size ) {
+	FILE *file;
+
+	file = fmemopen( buf, size, "r" );
+	if ( !file ) {
+		perror( "Could not open in-memory patch files" );
+		exit( EXIT_FAILURE );
+	}
+
+	return file;
+}
+
+/**
+ * Describes the location of a word of a patch file.
+ */
+static void verify_describe( char *buf, size_t size, int word ) {
+	static const char *op_fields[] = {
+		"address", "mask", "value", "integrity"
+	};
+	size_t off = word * sizeof(uint32_t);
+	size_t body = offsetof( epatch_file_t, body );
+	size_t msram = body + offsetof( epatch_body_t, msram );
+	size_t ops = body + offsetof( epatch_body_t, cr_ops );
+
+	if ( off < body )
+		snprintf( buf, size, "header word %d", word );
+	else if ( off == body + offsetof( epatch_body_t, key_seed ) )
+		snprintf( buf, size, "key seed" );
+	else if ( off < msram )
+		snprintf( buf, size, "reserved" );
+	else if ( off < body + offsetof( epatch_body_t, msram_integrity ) )
+		snprintf( buf, size, "MSRAM %04X", (int)
+		          ( MSRAM_BASE_ADDRESS * 8 + ( off - msram ) / 4 ) );
+	else if ( off == body + offsetof( epatch_body_t, msram_integrity ) )
+		snprintf( buf, size, "MSRAM integrity" );
+	else if ( off < ops )
+		snprintf( buf, size, "reserved" );
+	else
+		snprintf( buf, size, "write_creg %d %s",
+		          (int) ( ( off - ops ) / sizeof(patch_cr_op_t) ),
+		          op_fields[ ( off - ops ) %
+		                     sizeof(patch_cr_op_t) / 4 ] );
+}
+
+/**
+ * Round trips a single patch through the config and MSRAM file formats and
+ * compares the re-encrypted patch against the original.
+ */
+static void verify_worker( void *_verify, int idx ) {
+	verify_t *verify = _verify;
+	verify_result_t *res = verify->results + idx;
+	epatch_file_t in, out;
+	patch_body_t body, parsed;
+	patch_hdr_t hdr;
+	uint32_t seed;
+	uint32_t a[ sizeof(epatch_file_t) / sizeof(uint32_t) ];
+	uint32_t b[ sizeof(epatch_file_t) / sizeof(uint32_t) ];
+	char *cfg_buf, *msram_buf, *msram_fn = NULL;
+	size_t cfg_size, msram_size;
+	FILE *file;
+	int i, status, parse_status;
+
+	memset( &in, 0, sizeof in );
+	if ( try_read_file( verify->paths[idx], &in, sizeof in ) !=
+	     sizeof in ) {
+		res->error = "could not read patch";
+		return;
+	}
+
+	status = decrypt_patch_checked( &body, &in.body, in.header.proc_sig );
+	if ( status & ( DECRYPT_BAD_ICV | DECRYPT_UNKNOWN_KEY ) ) {
+		res->error = "could not decrypt patch";
+		return;
+	}
+
+	/* Serialize exactly as extraction would, but to memory */
+	file = open_memstream( &cfg_buf, &cfg_size );
+	if ( !file ) {
+		perror( "Could not open in-memory patch files" );
+		exit( EXIT_FAILURE );
+	}
+	format_patch_config( file, &in.header, &body, "msram.hex",
+	                     in.body.key_seed );
+	fclose( file );
+
+	file = open_memstream( &msram_buf, &msram_size );
+	if ( !file ) {
+		perror( "Could not open in-memory patch files" );
+		exit( EXIT_FAILURE );
+	}
+	format_msram( file, &body );
+	fclose( file );
+
+	/* Parse it back, as patch creation would */
+	memset( &hdr, 0, sizeof hdr );
+	memset( &parsed, 0, sizeof parsed );
+	seed = 0;
+
+	/* The parsers can reject what was just formatted, for example a
+	   control register address wider than the config format allows */
+	file = verify_open( cfg_buf, cfg_size );
+	parse_status = try_parse_patch_config( file, &hdr, &parsed, &msram_fn,
+	                                       &seed, res->message,
+	                                       sizeof res->message );
+	fclose( file );
+	free( msram_fn );
+
+	if ( !parse_status ) {
+		file = verify_open( msram_buf, msram_size );
+		parse_status = try_parse_msram( file, &parsed, res->message,
+		                                sizeof res->message );
+		fclose( file );
+	}
+
+	free( cfg_buf );
+	free( msram_buf );
+
+	if ( parse_status ) {
+		res->error = res->message;
+		return;
+	}
+
+	/* Re-encrypt and compare */
+	memcpy( &out.header, &hdr, sizeof hdr );
+	encrypt_patch_body( &out.body, &parsed, hdr.proc_sig, seed );
+
+	memcpy( a, &in,  sizeof a );
+	memcpy( b, &out, sizeof b );
+	for ( i = 0; i < sizeof a / sizeof(uint32_t); i++ ) {
+		if ( a[i] == b[i] )
+			continue;
+		res->error    = "mismatch";
+		res->word     = i;
+		res->expected = a[i];
+		res->actual   = b[i];
+		return;
+	}
+}
+
+/**
+ * Checks that patches survive extraction and re-creation bit for bit. Every
+ * patch is decrypted, written to the config and MSRAM file formats in memory,
+ * parsed back and encrypted again with its original key seed. The first
+ * differing word of every failing patch is reported.
+ * @param paths    The patch files to verify
+ * @param count    The number of patch files
+ * @return         The number of patches that failed verification
+ */
+int verify_patches( char *const *paths, int count ) {
+	verify_t verify;
+	verify_result_t *res;
+	char where[64];
+	int i, failed;
+
+	verify.paths   = paths;
+	verify.results = calloc( count + 1, sizeof(verify_result_t) );
+	if ( !verify.results ) {
+		perror( "Could not allocate verification results" );
+		exit( EXIT_FAILURE );
+	}
+
+	workpool_run( verify_worker, &verify, count );
+
+	failed = 0;
+	for ( i = 0; i < count; i++ ) {
+		res = verify.results + i;
+		if ( !res->error )
+			continue;
+		failed++;
+		if ( strcmp( res->error, "mismatch" ) ) {
+			printf( "%s: %s\n", paths[i], res->error );
+			continue;
+		}
+		verify_describe( where, sizeof where, res->word );
+		printf( "%s: word 0x%03X (%s) differs, expected 0x%08X "
+		        "got 0x%08X\n",
+		        paths[i], res->word, where, res->expected,
+		        res->actual );
+	}
+
+	printf( "Verified %d patches, %d failed\n", count, failed );
+
+	free( verify.results );
+	return failed;
+}
@@ -0,0 +1,509 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include "patchtools.h"
+#include "patchfile.h"
+
+/** Time to wait for more events after a change, so a save is handled once */
+#define WATCH_SETTLE_MS  (20)
+
+#define WATCH_MAX_DIRS   (1024)
+
+#define WATCH_CONFIG     (0)
+#define WATCH_MSRAM      (1)
+
+/**
+ * The parsed contents of an input file. A config fills in the header, key
+ * seed, control register ops and MSRAM file name, an MSRAM file the MSRAM
+ * contents of body.
+ */
+typedef struct {
+	patch_hdr_t   hdr;
+	patch_body_t  body;
+	uint32_t      seed;
+	char          msram_fn[ 4096 ];
+} watch_parsed_t;
+
+/** An input file, with the parse of its last seen contents */
+typedef struct {
+	char            *path;
+	int              kind;
+	uint64_t         hash;
+	int              exists;
+	int              parsed;
+	watch_parsed_t   data;
+} watch_file_t;
+
+/** A patch built from a config and the MSRAM file it refers to */
+typedef struct {
+	int              config;
+	int              msram;
+	char            *output;
+	uint64_t         built_config;
+	uint64_t         built_msram;
+	int              built;
+	int              ckpt_valid;
+	patch_ckpt_t     ckpt;
+} watch_patch_t;
+
+typedef struct {
+	int              fd;
+	int              wd[ WATCH_MAX_DIRS ];
+	char            *dirs[ WATCH_MAX_DIRS ];
+	int              dir_count;
+	watch_file_t    *files;
+	int              file_count;
+	watch_patch_t   *patches;
+	int              patch_count;
+} watch_t;
+
+/**
+ * 64 bit FNV-1a hash of a buffer.
+ */
+static uint64_t watch_hash( const void *data, size_t size ) {
+	const uint8_t *p = data;
+	uint64_t h = 0xCBF29CE484222325ull;
+	size_t i;
+
+	for ( i = 0; i < size; i++ ) {
+		h ^= p[i];
+		h *= 0x100000001B3ull;
+	}
+
+	return h;
+}
+
+static double watch_ms( const struct timespec *a ) {
+	struct timespec b;
+
+	clock_gettime( CLOCK_MONOTONIC, &b );
+	return ( b.tv_sec - a->tv_sec ) * 1000.0 +
+	       ( b.tv_nsec - a->tv_nsec ) / 1000000.0;
+}
+
+/**
+ * Reads a whole file into memory.
+ * @return         The contents, or NULL if the file could not be read
+ */
+static char *watch_slurp( const char *path, size_t *size ) {
+	FILE *file;
+	char *buf;
+	long len;
+
+	file = fopen( path, "r" );
+	if ( !file )
+		return NULL;
+
+	if ( fseek( file, 0, SEEK_END ) || ( len = ftell( file ) ) < 0 ) {
+		fclose( file );
+		return NULL;
+	}
+	rewind( file );
+
+	buf = malloc( len + 1 );
+	if ( !buf ) {
+		perror( "Could not allocate watch buffer" );
+		exit( EXIT_FAILURE );
+	}
+	*size = fread( buf, 1, len, file );
+	buf[ *size ] = 0;
+	fclose( file );
+
+	return buf;
+}
+
+/**
+ * Parses the contents of an input file. A half written file is reported
+ * instead of ending the watch.
+ * @param err      Receives the error message if the contents are malformed
+ * @return         Non-zero if the contents were parsed
+ */
+static int watch_parse( int kind, char *buf, size_t size,
+                        watch_parsed_t *out, char *err, size_t err_size ) {
+	char *msram_fn = NULL;
+	FILE *file;
+	int status;
+
+	memset( out, 0, sizeof *out );
+	file = fmemopen( buf, size ? size : 1, "r" );
+	if ( !file ) {
+		perror( "Could not open watch buffer" );
+		exit( EXIT_FAILURE );
+	}
+
+	if ( kind == WATCH_CONFIG ) {
+		status = try_parse_patch_config( file, &out->hdr, &out->body,
+		                                 &msram_fn, &out->seed,
+		                                 err, err_size );
+		if ( !status && !msram_fn ) {
+			snprintf( err, err_size, "Config has no msram_file" );
+			status = -1;
+		} else if ( !status ) {
+			strncpy( out->msram_fn, msram_fn,
+			         sizeof out->msram_fn - 1 );
+		}
+		free( msram_fn );
+	} else {
+		status = try_parse_msram( file, &out->body, err, err_size );
+	}
+
+	fclose( file );
+	return status == 0;
+}
+
+/**
+ * Finds an input file, adding it if it is not tracked yet.
+ */
+static int watch_file( watch_t *w, const char *path, int kind ) {
+	watch_file_t *f;
+	int i;
+
+	for ( i = 0; i < w->file_count; i++ )
+		if ( w->files[i].kind == kind &&
+		     !strcmp( w->files[i].path, path ) )
+			return i;
+
+	w->files = realloc( w->files, ( w->file_count + 1 ) *
+	                              sizeof(watch_file_t) );
+	if ( !w->files ) {
+		perror( "Could not allocate watched files" );
+		exit( EXIT_FAILURE );
+	}
+
+	f = w->files + w->file_count;
+	memset( f, 0, sizeof *f );
+	f->path = strdup( path );
+	f->kind = kind;
+	return w->file_count++;
+}
+
+/** Parse results land here first, to keep the last good parse on errors */
+static watch_parsed_t watch_tmp;
+
+/**
+ * Rereads an input file and parses it again if its contents changed.
+ * @return         Non-zero if the contents changed
+ */
+static int watch_refresh( watch_file_t *f ) {
+	char *buf, err[256];
+	size_t size;
+	uint64_t hash;
+
+	buf = watch_slurp( f->path, &size );
+	if ( !buf ) {
+		f->exists = 0;
+		return 0;
+	}
+
+	hash = watch_hash( buf, size );
+	if ( f->exists && hash == f->hash ) {
+		/* Touched, but not changed */
+		free( buf );
+		return 0;
+	}
+
+	f->exists = 1;
+	f->hash   = hash;
+	f->parsed = watch_parse( f->kind, buf, size, &watch_tmp,
+	                         err, sizeof err );
+	if ( f->parsed )
+		memcpy( &f->data, &watch_tmp, sizeof watch_tmp );
+	else
+		fprintf( stderr, "%s: %s, keeping last build\n",
+		         f->path, err );
+
+	free( buf );
+	return 1;
+}
+
+/**
+ * Resolves the MSRAM file of a patch, relative to the directory of its
+ * config.
+ */
+static void watch_resolve_msram( watch_t *w, watch_patch_t *p ) {
+	watch_file_t *cfg = w->files + p->config;
+	char *dir, *tmp, *real, path[8192];
+
+	if ( cfg->data.msram_fn[0] == '/' ) {
+		snprintf( path, sizeof path, "%s", cfg->data.msram_fn );
+	} else {
+		tmp = strdup( cfg->path );
+		if ( !tmp ) {
+			perror( "Could not allocate path" );
+			exit( EXIT_FAILURE );
+		}
+		dir = dirname( tmp );
+		snprintf( path, sizeof path, "%s/%s", dir, cfg->data.msram_fn );
+		free( tmp );
+	}
+
+	/* Events name files by their watched directory */
+	real = realpath( path, NULL );
+	if ( real ) {
+		snprintf( path, sizeof path, "%s", real );
+		free( real );
+	}
+
+	p->msram = watch_file( w, path, WATCH_MSRAM );
+	if ( !w->files[ p->msram ].exists )
+		watch_refresh( w->files + p->msram );
+}
+
+/**
+ * Starts tracking a config file, if it is one.
+ */
+static void watch_add_config( watch_t *w, const char *path ) {
+	watch_patch_t *p;
+	char *buf, *name, out[8192];
+	const char *ext;
+	size_t size;
+	int i, idx;
+
+	ext = strrchr( path, '.' );
+	if ( !ext || strcmp( ext, ".txt" ) )
+		return;
+
+	for ( i = 0; i < w->patch_count; i++ )
+		if ( !strcmp( w->files[ w->patches[i].config ].path, path ) )
+			return;
+
+	/* Other text files, such as sweep specifications, are not configs */
+	buf = watch_slurp( path, &size );
+	if ( !buf )
+		return;
+	i = strstr( buf, "msram_file" ) != NULL;
+	free( buf );
+	if ( !i )
+		return;
+
+	idx = watch_file( w, path, WATCH_CONFIG );
+
+	w->patches = realloc( w->patches, ( w->patch_count + 1 ) *
+	                                  sizeof(watch_patch_t) );
+	if ( !w->patches ) {
+		perror( "Could not allocate watched patches" );
+		exit( EXIT_FAILURE );
+	}
+	p = w->patches + w->patch_count++;
+	memset( p, 0, sizeof *p );
+	p->config = idx;
+	p->msram  = -1;
+
+	/* Written next to the config, named after it */
+	snprintf( out, sizeof out, "%s", path );
+	name = strrchr( out, '.' );
+	snprintf( name, sizeof out - ( name - out ), ".dat" );
+	p->output = strdup( out );
+
+	watch_refresh( w->files + idx );
+	if ( w->files[ idx ].parsed )
+		watch_resolve_msram( w, p );
+}
+
+/**
+ * Watches a directory and everything below it, adding the configs in it.
+ */
+static void watch_add_dir( watch_t *w, const char *path ) {
+	struct dirent *ent;
+	struct stat st;
+	char sub[8192];
+	DIR *dir;
+	int wd;
+
+	if ( w->dir_count == WATCH_MAX_DIRS ) {
+		fprintf( stderr, "Too many directories to watch\n" );
+		exit( EXIT_FAILURE );
+	}
+
+	wd = inotify_add_watch( w->fd, path, IN_CLOSE_WRITE | IN_MOVED_TO |
+	                        IN_CREATE | IN_DELETE | IN_MOVED_FROM );
+	if ( wd < 0 ) {
+		fprintf( stderr, "Could not watch %s: %s\n", path,
+		         strerror( errno ) );
+		exit( EXIT_FAILURE );
+	}
+	w->wd[ w->dir_count ]     = wd;
+	w->dirs[ w->dir_count++ ] = strdup( path );
+
+	dir = opendir( path );
+	if ( !dir )
+		return;
+
+	while ( ( ent = readdir( dir ) ) ) {
+		if ( ent->d_name[0] == '.' )
+			continue;
+		snprintf( sub, sizeof sub, "%s/%s", path, ent->d_name );
+		if ( stat( sub, &st ) )
+			continue;
+		if ( S_ISDIR( st.st_mode ) )
+			watch_add_dir( w, sub );
+		else if ( S_ISREG( st.st_mode ) )
+			watch_add_config( w, sub );
+	}
+
+	closedir( dir );
+}
+
+/**
+ * Rebuilds the patches whose inputs changed since their last build.
+ */
+static void watch_rebuild( watch_t *w ) {
+	struct timespec start;
+	watch_patch_t *p;
+	watch_file_t *cfg, *msram;
+	epatch_file_t out;
+	patch_body_t body;
+	int i, reused;
+
+	for ( i = 0; i < w->patch_count; i++ ) {
+		p   = w->patches + i;
+		cfg = w->files + p->config;
+		if ( !cfg->exists || !cfg->parsed || p->msram < 0 )
+			continue;
+		msram = w->files + p->msram;
+		if ( !msram->exists || !msram->parsed )
+			continue;
+		if ( p->built && p->built_config == cfg->hash &&
+		     p->built_msram == msram->hash )
+			continue;
+
+		clock_gettime( CLOCK_MONOTONIC, &start );
+
+		memcpy( body.msram, msram->data.body.msram, sizeof body.msram );
+		memcpy( body.cr_ops, cfg->data.body.cr_ops, sizeof body.cr_ops );
+
+		/* The checkpoints keep the key and cipher state of the last
+		   build, so only the part after the first edit is encrypted */
+		reused = encrypt_patch_incremental( &out.body, &body,
+		                                    cfg->data.hdr.proc_sig,
+		                                    cfg->data.seed, &p->ckpt,
+		                                    p->ckpt_valid );
+		p->ckpt_valid = 1;
+		memcpy( &out.header, &cfg->data.hdr, sizeof(patch_hdr_t) );
+
+		outq_write( p->output, &out, sizeof out );
+		outq_flush();
+
+		p->built        = 1;
+		p->built_config = cfg->hash;
+		p->built_msram  = msram->hash;
+
+		printf( "%s: rebuilt in %.2f ms, %d of %d checkpoints reused\n",
+		        p->output, watch_ms( &start ), reused, PATCH_CKPT_COUNT );
+		fflush( stdout );
+	}
+}
+
+/**
+ * Handles a single change to a watched directory.
+ */
+static void watch_event( watch_t *w, const struct inotify_event *ev ) {
+	char path[8192];
+	int i;
+
+	for ( i = 0; i < w->dir_count; i++ )
+		if ( w->wd[i] == ev->wd )
+			break;
+	if ( i == w->dir_count || !ev->len )
+		return;
+
+	snprintf( path, sizeof path, "%s/%s", w->dirs[i], ev->name );
+
+	if ( ev->mask & IN_ISDIR ) {
+		if ( ev->mask & ( IN_CREATE | IN_MOVED_TO ) )
+			watch_add_dir( w, path );
+		return;
+	}
+
+	for ( i = 0; i < w->file_count; i++ ) {
+		if ( strcmp( w->files[i].path, path ) )
+			continue;
+		if ( ev->mask & ( IN_DELETE | IN_MOVED_FROM ) )
+			w->files[i].exists = 0;
+		else
+			watch_refresh( w->files + i );
+	}
+
+	if ( ev->mask & ( IN_CLOSE_WRITE | IN_MOVED_TO ) )
+		watch_add_config( w, path );
+}
+
+/**
+ * Watches a tree of patch configs and rebuilds every patch whenever its
+ * config or MSRAM file changes. Inputs are tracked by content, so a file that
+ * is saved without changes does not cause a rebuild, and the parsed inputs
+ * and cipher checkpoints of every patch are kept between rebuilds. Patches
+ * are written next to their config as <name>.dat. Does not return.
+ * @param path     The directory to watch
+ */
+void watch_configs( const char *path ) {
+	char buf[ 64 * 1024 ]
+		__attribute__(( aligned( __alignof__( struct inotify_event ) ) ));
+	const struct inotify_event *ev;
+	struct pollfd pfd;
+	watch_t w;
+	ssize_t n;
+	char *p, *root;
+	int i;
+
+	memset( &w, 0, sizeof w );
+
+	root = realpath( path, NULL );
+	if ( !root ) {
+		fprintf( stderr, "Could not watch %s: %s\n", path,
+		         strerror( errno ) );
+		exit( EXIT_FAILURE );
+	}
+
+	w.fd = inotify_init1( IN_CLOEXEC );
+	if ( w.fd < 0 ) {
+		perror( "Could not initialize inotify" );
+		exit( EXIT_FAILURE );
+	}
+
+	watch_add_dir( &w, root );
+	free( root );
+	printf( "Watching %d patches in %d directories\n", w.patch_count,
+	        w.dir_count );
+	watch_rebuild( &w );
+
+	pfd.fd     = w.fd;
+	pfd.events = POLLIN;
+
+	for ( ;; ) {
+		/* Block for the first event, then collect the rest of the
+		   burst an editor makes when saving */
+		for ( i = -1; poll( &pfd, 1, i ) > 0; i = WATCH_SETTLE_MS ) {
+			n = read( w.fd, buf, sizeof buf );
+			if ( n <= 0 ) {
+				if ( n < 0 && errno == EINTR )
+					continue;
+				perror( "Could not read inotify events" );
+				exit( EXIT_FAILURE );
+			}
+			for ( p = buf; p < buf + n;
+			      p += sizeof(struct inotify_event) + ev->len ) {
+				ev = (const struct inotify_event *) p;
+				watch_event( &w, ev );
+			}
+		}
+
+		/* Configs may now refer to another MSRAM file */
+		for ( i = 0; i < w.patch_count; i++ )
+			if ( w.files[ w.patches[i].config ].parsed )
+				watch_resolve_msram( &w, w.patches + i );
+
+		watch_rebuild( &w );
+	}
+}
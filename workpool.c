@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "patchtools.h"
+#include "stats.h"
+#include "trace.h"
+
+/** Number of worker threads to use, 0 selects one per online CPU */
+int workpool_threads;
+
+typedef struct {
+	workpool_fn_t fn;
+	void         *arg;
+	int           count;
+	int           next;
+} workpool_t;
+
+/**
+ * Returns the number of worker threads that workpool_run will start.
+ */
+int workpool_size( void ) {
+	long n;
+
+	if ( workpool_threads > 0 )
+		return workpool_threads;
+
+	n = sysconf( _SC_NPROCESSORS_ONLN );
+	return n > 0 ? n : 1;
+}
+
+static void *workpool_worker( void *_pool ) {
+	workpool_t *pool = _pool;
+	int idx;
+
+	/* Keep claiming work items until all have been handed out */
+	while ( (idx = __atomic_fetch_add( &pool->next, 1, __ATOMIC_RELAXED ))
+	        < pool->count )
+		pool->fn( pool->arg, idx );
+
+	stats_flush();
+	trace_thread_exit();
+	return NULL;
+}
+
+/**
+ * Runs a function for every index in [0, count) on a pool of worker threads
+ * and waits for all of them to complete.
+ * @param fn       The function to call for each work item
+ * @param arg      Opaque argument passed to every invocation of fn
+ * @param count    The number of work items
+ */
+void workpool_run( workpool_fn_t fn, void *arg, int count ) {
+	workpool_run_n( fn, arg, count, workpool_size() );
+}
+
+/**
+ * Runs a function for every index in [0, count) on a given number of worker
+ * threads, for callers that can not use the global thread count.
+ * @param size     The number of worker threads, 0 for workpool_size()
+ */
+void workpool_run_n( workpool_fn_t fn, void *arg, int count, int size ) {
+	workpool_t pool;
+	pthread_t *threads;
+	int i, nthreads;
+
+	pool.fn    = fn;
+	pool.arg   = arg;
+	pool.count = count;
+	pool.next  = 0;
+
+	nthreads = size > 0 ? size : workpool_size();
+	if ( nthreads > count )
+		nthreads = count;
+
+	/* Not worth starting threads for a single item */
+	if ( nthreads <= 1 ) {
+		workpool_worker( &pool );
+		return;
+	}
+
+	threads = calloc( nthreads, sizeof(pthread_t) );
+	if ( !threads ) {
+		perror( "Could not allocate worker threads" );
+		exit( EXIT_FAILURE );
+	}
+
+	for ( i = 0; i < nthreads; i++ ) {
+		if ( pthread_create( threads + i, NULL, workpool_worker, &pool ) ) {
+			fprintf( stderr, "Could not start worker thread\n" );
+			exit( EXIT_FAILURE );
+		}
+	}
+
+	for ( i = 0; i < nthreads; i++ )
+		pthread_join( threads[i], NULL );
+
+	free( threads );
+}